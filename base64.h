@@ -0,0 +1,193 @@
+#ifndef BASE64_H
+#define BASE64_H
+
+// Base64 decoding shared by server and client (canvas.json import, ui.json).
+// base64_decode() picks an AVX2, SSSE3 or scalar kernel for this CPU on
+// first use and decodes into a buffer the caller sized with
+// base64_decoded_size(). Like the decoder it replaces, it stops at the
+// first '=' or other non-alphabet character.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BASE64_X86 1
+#endif
+
+// Upper bound on the bytes decoded from len characters (SIMD kernels need
+// the slack past the last full group)
+inline size_t base64_decoded_size(size_t len) {
+    return len / 4 * 3 + 3;
+}
+
+// Character -> 6-bit value, -1 outside the alphabet
+struct Base64Table {
+    int8_t v[256];
+    Base64Table() {
+        const char* chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        memset(v, -1, sizeof(v));
+        for (int i = 0; i < 64; i++) v[(uint8_t)chars[i]] = i;
+    }
+};
+
+// Decode from in[*pos], four characters at a time, then the trailing
+// partial group. Advances *pos; returns the bytes written.
+inline size_t base64_decode_tail(const char* in, size_t len, size_t* pos_io, uint8_t* out) {
+    static const Base64Table table;
+    const int8_t* t = table.v;
+    size_t pos = *pos_io;
+    uint8_t* o = out;
+    while (pos + 4 <= len) {
+        int a = t[(uint8_t)in[pos]], b = t[(uint8_t)in[pos + 1]];
+        int c = t[(uint8_t)in[pos + 2]], d = t[(uint8_t)in[pos + 3]];
+        if ((a | b | c | d) < 0) break;
+        uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+        o[0] = v >> 16;
+        o[1] = v >> 8;
+        o[2] = v;
+        o += 3;
+        pos += 4;
+    }
+
+    // 0-3 characters before the end, '=' or anything else
+    uint32_t v = 0;
+    int n = 0;
+    while (n < 4 && pos < len && t[(uint8_t)in[pos]] >= 0) {
+        v = (v << 6) | t[(uint8_t)in[pos++]];
+        n++;
+    }
+    if (n >= 2) {
+        v <<= 6 * (4 - n);
+        for (int i = 0; i < n - 1; i++) *o++ = v >> (16 - 8 * i);
+    }
+    *pos_io = pos;
+    return o - out;
+}
+
+inline size_t base64_decode_scalar(const char* in, size_t len, uint8_t* out) {
+    size_t pos = 0;
+    return base64_decode_tail(in, len, &pos, out);
+}
+
+#ifdef BASE64_X86
+// Vector kernels after Muła & Lemire: classify each character by its high
+// and low nibble (pshufb lookups) to validate it and find the offset that
+// maps it to its 6-bit value, then pack four 6-bit values into three bytes
+// with two multiply-adds and a shuffle. A block holding any character outside
+// the alphabet (including '=') is left to the scalar tail.
+
+__attribute__((target("ssse3")))
+inline size_t base64_decode_ssse3(const char* in, size_t len, uint8_t* out) {
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                         0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                         0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i slash = _mm_set1_epi8(0x2F);
+    const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+    size_t pos = 0;
+    uint8_t* o = out;
+    // Each store writes 16 bytes for 12; stay a block ahead of the end
+    while (pos + 32 <= len) {
+        __m128i str = _mm_loadu_si128((const __m128i*)(in + pos));
+        __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), nibble);
+        __m128i lo_nibbles = _mm_and_si128(str, nibble);
+        __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+        __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0xFFFF) break;
+
+        __m128i eq_slash = _mm_cmpeq_epi8(str, slash);
+        __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_slash, hi_nibbles));
+        __m128i values = _mm_add_epi8(str, roll);
+
+        __m128i ab_bc = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+        __m128i abcd = _mm_madd_epi16(ab_bc, _mm_set1_epi32(0x00011000));
+        _mm_storeu_si128((__m128i*)o, _mm_shuffle_epi8(abcd, pack));
+        o += 12;
+        pos += 16;
+    }
+    return (o - out) + base64_decode_tail(in, len, &pos, o);
+}
+
+__attribute__((target("avx2")))
+inline size_t base64_decode_avx2(const char* in, size_t len, uint8_t* out) {
+    const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+                                            0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                            0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                              0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i slash = _mm256_set1_epi8(0x2F);
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                          2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1);
+
+    size_t pos = 0;
+    uint8_t* o = out;
+    // Each store writes 32 bytes for 24; stay a block ahead of the end
+    while (pos + 64 <= len) {
+        __m256i str = _mm256_loadu_si256((const __m256i*)(in + pos));
+        __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), nibble);
+        __m256i lo_nibbles = _mm256_and_si256(str, nibble);
+        __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+        __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+        if (!_mm256_testz_si256(lo, hi)) break;
+
+        __m256i eq_slash = _mm256_cmpeq_epi8(str, slash);
+        __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_slash, hi_nibbles));
+        __m256i values = _mm256_add_epi8(str, roll);
+
+        __m256i ab_bc = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+        __m256i abcd = _mm256_madd_epi16(ab_bc, _mm256_set1_epi32(0x00011000));
+        abcd = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(abcd, pack), lanes);
+        _mm256_storeu_si256((__m256i*)o, abcd);
+        o += 24;
+        pos += 32;
+    }
+    // Finish the last blocks 16 characters at a time
+    return (o - out) + base64_decode_ssse3(in + pos, len - pos, o);
+}
+#endif
+
+typedef size_t (*Base64DecodeFn)(const char* in, size_t len, uint8_t* out);
+
+// Kernel chosen for this CPU, on first use
+struct Base64Kernel {
+    Base64DecodeFn fn;
+    const char* name;
+
+    Base64Kernel() : fn(base64_decode_scalar), name("scalar") {
+#ifdef BASE64_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            fn = base64_decode_avx2;
+            name = "avx2";
+        } else if (__builtin_cpu_supports("ssse3")) {
+            fn = base64_decode_ssse3;
+            name = "ssse3";
+        }
+#endif
+    }
+
+    static const Base64Kernel& get() {
+        static const Base64Kernel kernel;
+        return kernel;
+    }
+};
+
+// Decode len characters into out (at least base64_decoded_size(len) bytes).
+// Returns the number of bytes written.
+inline size_t base64_decode(const char* in, size_t len, uint8_t* out) {
+    return Base64Kernel::get().fn(in, len, out);
+}
+
+#endif
@@ -0,0 +1,453 @@
+#ifndef BLEND_H
+#define BLEND_H
+
+// Source-over compositing of straight-alpha RGBA rows, shared by the server
+// raster, client prediction and remote apply. All paths compute the same
+// integer result for every pixel, so every peer ends up with the same
+// layer bytes:
+//
+//   t    = da * (255 - sa) / 255         (rounded)
+//   oa   = sa + t
+//   f    = floor(sa * 256 / oa)          (source weight, 0..256)
+//   oc   = (sc * f + dc * (256 - f) + 128) >> 8   per colour channel
+//
+// A source alpha of 0 leaves the destination pixel untouched. The vector
+// kernels compute f with a float division: both operands are below 2^16,
+// so truncating the correctly rounded quotient gives the exact floor.
+//
+// Layers can instead hold premultiplied RGBA (colour already scaled by
+// alpha). Source-over is then the same multiply-add on all four channels,
+// with no division, and matches the GPU's premultiplied blend:
+//
+//   o    = s + d * (255 - sa) / 255      (rounded, saturated)
+//
+// The *_pm kernels below take premultiplied rows; blend_span_pm still takes
+// a straight colour and premultiplies it by each pixel's alpha first.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLEND_X86 1
+#endif
+
+static inline void blend_pixel(uint8_t* d, const uint8_t* s) {
+    uint32_t sa = s[3];
+    if (sa == 0) return;
+    uint32_t x = d[3] * (255 - sa) + 128;
+    uint32_t oa = sa + ((x + (x >> 8)) >> 8);
+    uint32_t f = (sa << 8) / oa;
+    for (int ch = 0; ch < 3; ch++) d[ch] = (s[ch] * f + d[ch] * (256 - f) + 128) >> 8;
+    d[3] = oa;
+}
+
+// dst[i] = src[i] over dst[i], n pixels
+inline void blend_row_scalar(uint8_t* dst, const uint8_t* src, int n) {
+    for (int i = 0; i < n; i++) blend_pixel(dst + i * 4, src + i * 4);
+}
+
+// dst[i] = rgb with alpha[i] (or rgba[3] when alpha is null) over dst[i]
+inline void blend_span_scalar(uint8_t* dst, int n, const uint8_t* rgba, const uint8_t* alpha) {
+    uint8_t s[4] = {rgba[0], rgba[1], rgba[2], rgba[3]};
+    for (int i = 0; i < n; i++) {
+        if (alpha) s[3] = alpha[i];
+        blend_pixel(dst + i * 4, s);
+    }
+}
+
+// x * y / 255, rounded, for x, y <= 255
+static inline uint32_t mul_div255(uint32_t x, uint32_t y) {
+    uint32_t t = x * y + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+static inline void blend_pixel_pm(uint8_t* d, const uint8_t* s) {
+    uint32_t ia = 255 - s[3];
+    for (int ch = 0; ch < 4; ch++) {
+        uint32_t o = s[ch] + mul_div255(d[ch], ia);
+        d[ch] = o > 255 ? 255 : o;
+    }
+}
+
+// Straight colour with alpha a, premultiplied
+static inline void premultiply_pixel(uint8_t* p, const uint8_t* rgb, uint32_t a) {
+    for (int ch = 0; ch < 3; ch++) p[ch] = mul_div255(rgb[ch], a);
+    p[3] = a;
+}
+
+inline void blend_row_pm_scalar(uint8_t* dst, const uint8_t* src, int n) {
+    for (int i = 0; i < n; i++) blend_pixel_pm(dst + i * 4, src + i * 4);
+}
+
+inline void blend_span_pm_scalar(uint8_t* dst, int n, const uint8_t* rgba, const uint8_t* alpha) {
+    uint8_t s[4];
+    premultiply_pixel(s, rgba, rgba[3]);
+    for (int i = 0; i < n; i++) {
+        if (alpha) premultiply_pixel(s, rgba, alpha[i]);
+        blend_pixel_pm(dst + i * 4, s);
+    }
+}
+
+// Straight -> premultiplied, in place
+inline void premultiply_row_scalar(uint8_t* px, int n) {
+    for (int i = 0; i < n; i++, px += 4) premultiply_pixel(px, px, px[3]);
+}
+
+// Premultiplied -> straight, in place. Only used where pixels leave or
+// enter storage in the other form, so it stays scalar.
+inline void unpremultiply_row(uint8_t* px, int n) {
+    for (int i = 0; i < n; i++, px += 4) {
+        uint32_t a = px[3];
+        if (a == 255) continue;
+        for (int ch = 0; ch < 3; ch++) {
+            uint32_t c = a ? (px[ch] * 255 + a / 2) / a : 0;
+            px[ch] = c > 255 ? 255 : c;
+        }
+    }
+}
+
+#ifdef BLEND_X86
+// Four pixels (SSE2) or eight (AVX2) per step: the alpha terms are worked
+// out in 32-bit lanes, one per pixel, the colour channels in 16-bit lanes.
+
+__attribute__((target("sse2")))
+static inline __m128i blend4_sse2(__m128i s, __m128i d) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sa = _mm_srli_epi32(s, 24);
+    __m128i da = _mm_srli_epi32(d, 24);
+    // Products stay below 2^16, so 16-bit multiplies on the low halves suffice
+    __m128i x = _mm_add_epi32(_mm_mullo_epi16(da, _mm_sub_epi32(_mm_set1_epi32(255), sa)), _mm_set1_epi32(128));
+    __m128i oa = _mm_add_epi32(sa, _mm_srli_epi32(_mm_add_epi32(x, _mm_srli_epi32(x, 8)), 8));
+    __m128 q = _mm_div_ps(_mm_cvtepi32_ps(_mm_slli_epi32(sa, 8)), _mm_cvtepi32_ps(oa));
+    __m128i f = _mm_cvttps_epi32(q);
+    __m128i keep = _mm_cmpeq_epi32(sa, zero); // NaN lanes (sa = oa = 0) end up here
+
+    __m128i f16 = _mm_packs_epi32(f, f);
+    f16 = _mm_unpacklo_epi16(f16, f16);
+    __m128i f_lo = _mm_unpacklo_epi32(f16, f16);
+    __m128i f_hi = _mm_unpackhi_epi32(f16, f16);
+    const __m128i w256 = _mm_set1_epi16(256), r128 = _mm_set1_epi16(128);
+
+    __m128i s_lo = _mm_unpacklo_epi8(s, zero), d_lo = _mm_unpacklo_epi8(d, zero);
+    __m128i s_hi = _mm_unpackhi_epi8(s, zero), d_hi = _mm_unpackhi_epi8(d, zero);
+    __m128i o_lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(s_lo, f_lo),
+                                               _mm_mullo_epi16(d_lo, _mm_sub_epi16(w256, f_lo))), r128);
+    __m128i o_hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(s_hi, f_hi),
+                                               _mm_mullo_epi16(d_hi, _mm_sub_epi16(w256, f_hi))), r128);
+    __m128i o = _mm_packus_epi16(_mm_srli_epi16(o_lo, 8), _mm_srli_epi16(o_hi, 8));
+    o = _mm_or_si128(_mm_and_si128(o, _mm_set1_epi32(0x00FFFFFF)), _mm_slli_epi32(oa, 24));
+    return _mm_or_si128(_mm_and_si128(keep, d), _mm_andnot_si128(keep, o));
+}
+
+__attribute__((target("sse2")))
+inline void blend_row_sse2(uint8_t* dst, const uint8_t* src, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i * 4));
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i * 4));
+        _mm_storeu_si128((__m128i*)(dst + i * 4), blend4_sse2(s, d));
+    }
+    blend_row_scalar(dst + i * 4, src + i * 4, n - i);
+}
+
+__attribute__((target("sse2")))
+inline void blend_span_sse2(uint8_t* dst, int n, const uint8_t* rgba, const uint8_t* alpha) {
+    uint32_t c;
+    memcpy(&c, rgba, 4);
+    __m128i rgb = _mm_set1_epi32(c & 0x00FFFFFF);
+    __m128i solid = _mm_set1_epi32(c);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i s = solid;
+        if (alpha) {
+            int32_t a4;
+            memcpy(&a4, alpha + i, 4);
+            __m128i a = _mm_cvtsi32_si128(a4);
+            a = _mm_unpacklo_epi16(_mm_unpacklo_epi8(a, _mm_setzero_si128()), _mm_setzero_si128());
+            s = _mm_or_si128(rgb, _mm_slli_epi32(a, 24));
+        }
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i * 4));
+        _mm_storeu_si128((__m128i*)(dst + i * 4), blend4_sse2(s, d));
+    }
+    blend_span_scalar(dst + i * 4, n - i, rgba, alpha ? alpha + i : nullptr);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i blend8_avx2(__m256i s, __m256i d) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i sa = _mm256_srli_epi32(s, 24);
+    __m256i da = _mm256_srli_epi32(d, 24);
+    __m256i x = _mm256_add_epi32(_mm256_mullo_epi16(da, _mm256_sub_epi32(_mm256_set1_epi32(255), sa)),
+                                 _mm256_set1_epi32(128));
+    __m256i oa = _mm256_add_epi32(sa, _mm256_srli_epi32(_mm256_add_epi32(x, _mm256_srli_epi32(x, 8)), 8));
+    __m256 q = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_slli_epi32(sa, 8)), _mm256_cvtepi32_ps(oa));
+    __m256i f = _mm256_cvttps_epi32(q);
+    __m256i keep = _mm256_cmpeq_epi32(sa, zero);
+
+    // Unpacks work within 128-bit lanes: lo holds pixels 0,1,4,5, hi 2,3,6,7
+    __m256i f16 = _mm256_packs_epi32(f, f);
+    f16 = _mm256_unpacklo_epi16(f16, f16);
+    __m256i f_lo = _mm256_unpacklo_epi32(f16, f16);
+    __m256i f_hi = _mm256_unpackhi_epi32(f16, f16);
+    const __m256i w256 = _mm256_set1_epi16(256), r128 = _mm256_set1_epi16(128);
+
+    __m256i s_lo = _mm256_unpacklo_epi8(s, zero), d_lo = _mm256_unpacklo_epi8(d, zero);
+    __m256i s_hi = _mm256_unpackhi_epi8(s, zero), d_hi = _mm256_unpackhi_epi8(d, zero);
+    __m256i o_lo = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(s_lo, f_lo),
+                                                     _mm256_mullo_epi16(d_lo, _mm256_sub_epi16(w256, f_lo))), r128);
+    __m256i o_hi = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(s_hi, f_hi),
+                                                     _mm256_mullo_epi16(d_hi, _mm256_sub_epi16(w256, f_hi))), r128);
+    __m256i o = _mm256_packus_epi16(_mm256_srli_epi16(o_lo, 8), _mm256_srli_epi16(o_hi, 8));
+    o = _mm256_or_si256(_mm256_and_si256(o, _mm256_set1_epi32(0x00FFFFFF)), _mm256_slli_epi32(oa, 24));
+    return _mm256_blendv_epi8(o, d, keep);
+}
+
+__attribute__((target("avx2")))
+inline void blend_row_avx2(uint8_t* dst, const uint8_t* src, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i * 4));
+        _mm256_storeu_si256((__m256i*)(dst + i * 4), blend8_avx2(s, d));
+    }
+    blend_row_sse2(dst + i * 4, src + i * 4, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void blend_span_avx2(uint8_t* dst, int n, const uint8_t* rgba, const uint8_t* alpha) {
+    uint32_t c;
+    memcpy(&c, rgba, 4);
+    __m256i rgb = _mm256_set1_epi32(c & 0x00FFFFFF);
+    __m256i solid = _mm256_set1_epi32(c);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i s = solid;
+        if (alpha) {
+            __m256i a = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(alpha + i)));
+            s = _mm256_or_si256(rgb, _mm256_slli_epi32(a, 24));
+        }
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i * 4));
+        _mm256_storeu_si256((__m256i*)(dst + i * 4), blend8_avx2(s, d));
+    }
+    blend_span_sse2(dst + i * 4, n - i, rgba, alpha ? alpha + i : nullptr);
+}
+
+// Premultiplied kernels: everything stays in 16-bit lanes, two pixels per
+// register half, with each pixel's alpha copied across its four lanes.
+
+__attribute__((target("sse2")))
+static inline __m128i mul_div255_sse2(__m128i x, __m128i y) {
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(x, y), _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i spread_alpha_sse2(__m128i x) {
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+// Four straight pixels, premultiplied
+__attribute__((target("sse2")))
+static inline __m128i premultiply4_sse2(__m128i s) {
+    const __m128i zero = _mm_setzero_si128(), alpha_lane = _mm_set1_epi64x(0x00FF000000000000LL);
+    __m128i lo = _mm_unpacklo_epi8(s, zero), hi = _mm_unpackhi_epi8(s, zero);
+    // Multiplying the alpha lane by 255 keeps it as it is
+    lo = mul_div255_sse2(_mm_or_si128(lo, alpha_lane), spread_alpha_sse2(lo));
+    hi = mul_div255_sse2(_mm_or_si128(hi, alpha_lane), spread_alpha_sse2(hi));
+    return _mm_packus_epi16(lo, hi);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i blend4_pm_sse2(__m128i s, __m128i d) {
+    const __m128i zero = _mm_setzero_si128(), w255 = _mm_set1_epi16(255);
+    __m128i s_lo = _mm_unpacklo_epi8(s, zero), s_hi = _mm_unpackhi_epi8(s, zero);
+    __m128i d_lo = _mm_unpacklo_epi8(d, zero), d_hi = _mm_unpackhi_epi8(d, zero);
+    d_lo = mul_div255_sse2(d_lo, _mm_sub_epi16(w255, spread_alpha_sse2(s_lo)));
+    d_hi = mul_div255_sse2(d_hi, _mm_sub_epi16(w255, spread_alpha_sse2(s_hi)));
+    return _mm_adds_epu8(s, _mm_packus_epi16(d_lo, d_hi));
+}
+
+__attribute__((target("sse2")))
+inline void blend_row_pm_sse2(uint8_t* dst, const uint8_t* src, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i * 4));
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i * 4));
+        _mm_storeu_si128((__m128i*)(dst + i * 4), blend4_pm_sse2(s, d));
+    }
+    blend_row_pm_scalar(dst + i * 4, src + i * 4, n - i);
+}
+
+__attribute__((target("sse2")))
+inline void blend_span_pm_sse2(uint8_t* dst, int n, const uint8_t* rgba, const uint8_t* alpha) {
+    uint32_t c;
+    memcpy(&c, rgba, 4);
+    __m128i rgb = _mm_set1_epi32(c & 0x00FFFFFF);
+    __m128i solid = premultiply4_sse2(_mm_set1_epi32(c));
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i s = solid;
+        if (alpha) {
+            int32_t a4;
+            memcpy(&a4, alpha + i, 4);
+            __m128i a = _mm_cvtsi32_si128(a4);
+            a = _mm_unpacklo_epi16(_mm_unpacklo_epi8(a, _mm_setzero_si128()), _mm_setzero_si128());
+            s = premultiply4_sse2(_mm_or_si128(rgb, _mm_slli_epi32(a, 24)));
+        }
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i * 4));
+        _mm_storeu_si128((__m128i*)(dst + i * 4), blend4_pm_sse2(s, d));
+    }
+    blend_span_pm_scalar(dst + i * 4, n - i, rgba, alpha ? alpha + i : nullptr);
+}
+
+__attribute__((target("sse2")))
+inline void premultiply_row_sse2(uint8_t* px, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i*)(px + i * 4));
+        _mm_storeu_si128((__m128i*)(px + i * 4), premultiply4_sse2(p));
+    }
+    premultiply_row_scalar(px + i * 4, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i mul_div255_avx2(__m256i x, __m256i y) {
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(x, y), _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i spread_alpha_avx2(__m256i x) {
+    return _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(x, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i premultiply8_avx2(__m256i s) {
+    const __m256i zero = _mm256_setzero_si256(), alpha_lane = _mm256_set1_epi64x(0x00FF000000000000LL);
+    __m256i lo = _mm256_unpacklo_epi8(s, zero), hi = _mm256_unpackhi_epi8(s, zero);
+    lo = mul_div255_avx2(_mm256_or_si256(lo, alpha_lane), spread_alpha_avx2(lo));
+    hi = mul_div255_avx2(_mm256_or_si256(hi, alpha_lane), spread_alpha_avx2(hi));
+    return _mm256_packus_epi16(lo, hi);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i blend8_pm_avx2(__m256i s, __m256i d) {
+    const __m256i zero = _mm256_setzero_si256(), w255 = _mm256_set1_epi16(255);
+    __m256i s_lo = _mm256_unpacklo_epi8(s, zero), s_hi = _mm256_unpackhi_epi8(s, zero);
+    __m256i d_lo = _mm256_unpacklo_epi8(d, zero), d_hi = _mm256_unpackhi_epi8(d, zero);
+    d_lo = mul_div255_avx2(d_lo, _mm256_sub_epi16(w255, spread_alpha_avx2(s_lo)));
+    d_hi = mul_div255_avx2(d_hi, _mm256_sub_epi16(w255, spread_alpha_avx2(s_hi)));
+    return _mm256_adds_epu8(s, _mm256_packus_epi16(d_lo, d_hi));
+}
+
+__attribute__((target("avx2")))
+inline void blend_row_pm_avx2(uint8_t* dst, const uint8_t* src, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i * 4));
+        _mm256_storeu_si256((__m256i*)(dst + i * 4), blend8_pm_avx2(s, d));
+    }
+    blend_row_pm_sse2(dst + i * 4, src + i * 4, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void blend_span_pm_avx2(uint8_t* dst, int n, const uint8_t* rgba, const uint8_t* alpha) {
+    uint32_t c;
+    memcpy(&c, rgba, 4);
+    __m256i rgb = _mm256_set1_epi32(c & 0x00FFFFFF);
+    __m256i solid = premultiply8_avx2(_mm256_set1_epi32(c));
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i s = solid;
+        if (alpha) {
+            __m256i a = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(alpha + i)));
+            s = premultiply8_avx2(_mm256_or_si256(rgb, _mm256_slli_epi32(a, 24)));
+        }
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i * 4));
+        _mm256_storeu_si256((__m256i*)(dst + i * 4), blend8_pm_avx2(s, d));
+    }
+    blend_span_pm_sse2(dst + i * 4, n - i, rgba, alpha ? alpha + i : nullptr);
+}
+
+__attribute__((target("avx2")))
+inline void premultiply_row_avx2(uint8_t* px, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i p = _mm256_loadu_si256((const __m256i*)(px + i * 4));
+        _mm256_storeu_si256((__m256i*)(px + i * 4), premultiply8_avx2(p));
+    }
+    premultiply_row_sse2(px + i * 4, n - i);
+}
+#endif
+
+typedef void (*BlendRowFn)(uint8_t* dst, const uint8_t* src, int n);
+typedef void (*BlendSpanFn)(uint8_t* dst, int n, const uint8_t* rgba, const uint8_t* alpha);
+typedef void (*PixelRowFn)(uint8_t* px, int n);
+
+// Kernels chosen for this CPU, on first use
+struct BlendKernel {
+    BlendRowFn row, row_pm;
+    BlendSpanFn span, span_pm;
+    PixelRowFn premultiply;
+    const char* name;
+
+    BlendKernel() : row(blend_row_scalar), row_pm(blend_row_pm_scalar),
+                    span(blend_span_scalar), span_pm(blend_span_pm_scalar),
+                    premultiply(premultiply_row_scalar), name("scalar") {
+#ifdef BLEND_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            row = blend_row_avx2;
+            row_pm = blend_row_pm_avx2;
+            span = blend_span_avx2;
+            span_pm = blend_span_pm_avx2;
+            premultiply = premultiply_row_avx2;
+            name = "avx2";
+        } else if (__builtin_cpu_supports("sse2")) {
+            row = blend_row_sse2;
+            row_pm = blend_row_pm_sse2;
+            span = blend_span_sse2;
+            span_pm = blend_span_pm_sse2;
+            premultiply = premultiply_row_sse2;
+            name = "sse2";
+        }
+#endif
+    }
+
+    static const BlendKernel& get() {
+        static const BlendKernel kernel;
+        return kernel;
+    }
+};
+
+// src over dst for n RGBA pixels
+inline void blend_row(uint8_t* dst, const uint8_t* src, int n) {
+    BlendKernel::get().row(dst, src, n);
+}
+
+// One colour over n RGBA pixels; alpha[i] (when given) replaces the
+// colour's alpha per pixel, 0 leaving the pixel as it is
+inline void blend_span(uint8_t* dst, int n, const uint8_t* rgba, const uint8_t* alpha) {
+    BlendKernel::get().span(dst, n, rgba, alpha);
+}
+
+// Premultiplied src over premultiplied dst for n RGBA pixels
+inline void blend_row_pm(uint8_t* dst, const uint8_t* src, int n) {
+    BlendKernel::get().row_pm(dst, src, n);
+}
+
+// blend_span onto premultiplied pixels: rgba is a straight colour,
+// premultiplied by its alpha (or alpha[i]) before the blend
+inline void blend_span_pm(uint8_t* dst, int n, const uint8_t* rgba, const uint8_t* alpha) {
+    BlendKernel::get().span_pm(dst, n, rgba, alpha);
+}
+
+// Straight -> premultiplied, n RGBA pixels in place
+inline void premultiply_row(uint8_t* px, int n) {
+    BlendKernel::get().premultiply(px, n);
+}
+
+#endif
@@ -9,145 +9,449 @@
     typedef SDL_Color Pixel;
 #endif
 
-#include <functional>
 #include <cmath>
-#include <cstdlib> 
+#include <cstring>
+#include <cstdlib>
 #include <algorithm> // For std::min/max
+#include <atomic>
+#include <list>
+#include <unordered_map>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Brushes describe a dab as horizontal runs and hand them to a sink:
+//   sink.span(y, x0, x1, c)          every pixel x0..x1 of row y gets c
+//   sink.cover(y, x0, x1, c, alpha)  pixel x gets c with a = alpha[x - x0];
+//                                    alpha 0 means the pixel is not covered
+// Runs are inclusive and already clipped to the canvas (see DabClip), and
+// each pixel appears once per dab except for TexturedBrush, whose runs are
+// single pixels in painting order.
+//
+// Every dab except TexturedBrush's depends only on its parameters, not on
+// where it lands: its shape is computed once into a DabStamp and reused
+// from a per-thread LRU cache (all threads share one byte budget). Line
+// ops sweep that stamp along the line, emitting each covered pixel once.
+//
+// DabKernels<Sink> holds one paint_op instantiation per brush class and
+// DabMode (BrushTypes below), so picking the brush and the compositing
+// happens once per op and the sink's loops inline into each brush.
+
+#define STAMP_CACHE_BYTES (4u << 20) // Dab stamps kept, over all painting threads
+
+enum BrushKind {
+    BRUSH_KIND_ROUND,
+    BRUSH_KIND_SQUARE,
+    BRUSH_KIND_HARD_ERASER,
+    BRUSH_KIND_PRESSURE,
+    BRUSH_KIND_AIRBRUSH,
+    BRUSH_KIND_TEXTURED,
+    BRUSH_KIND_SOFT_ERASER,
+    BRUSH_KIND_COUNT
+};
+
+// Clips runs to a width x height canvas before passing them on
+template<class Sink>
+struct DabClip {
+    Sink& sink;
+    int width, height;
+
+    bool clip(int y, int& x0, int& x1) const {
+        if (y < 0 || y >= height) return false;
+        if (x0 < 0) x0 = 0;
+        if (x1 >= width) x1 = width - 1;
+        return x0 <= x1;
+    }
+
+    void span(int y, int x0, int x1, Pixel c) {
+        if (clip(y, x0, x1)) sink.span(y, x0, x1, c);
+    }
+
+    // Run with precomputed coverage, alpha[k] for pixel x0 + k
+    void cover(int y, int x0, int x1, Pixel c, const uint8_t* alpha) {
+        int start = x0;
+        if (clip(y, x0, x1)) sink.cover(y, x0, x1, c, alpha + (x0 - start));
+    }
+};
+
+// dst[i] = max(dst[i], src[i])
+inline void max_row(uint8_t* dst, const uint8_t* src, int n) {
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= n; i += 16) {
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_max_epu8(d, s));
+    }
+#endif
+    for (; i < n; i++) dst[i] = std::max(dst[i], src[i]);
+}
+
+// Coverage of one dab shape, relative to its centre. Round dabs only need
+// the per-row extents; soft brushes also keep their alpha mask.
+struct DabStamp {
+    int radius;                 // Offsets -radius..radius on both axes
+    std::vector<uint8_t> alpha; // (2 * radius + 1)^2, row-major; empty for solid stamps
+    std::vector<int16_t> lo, hi; // Per row: covered offsets lo..hi (lo > hi: none)
+
+    size_t bytes() const {
+        return sizeof(DabStamp) + alpha.capacity() + (lo.capacity() + hi.capacity()) * sizeof(int16_t);
+    }
+
+    // Fill the mask from coverage(i, j) (0 = not covered) and find the extents
+    template<class Coverage>
+    void build(int r, Coverage coverage) {
+        radius = r;
+        int n = 2 * r + 1;
+        alpha.resize((size_t)n * n);
+        lo.assign(n, (int16_t)(r + 1));
+        hi.assign(n, (int16_t)(-r - 1));
+        for (int j = -r; j <= r; j++) {
+            uint8_t* row = &alpha[(size_t)(j + r) * n];
+            for (int i = -r; i <= r; i++) {
+                uint8_t a = coverage(i, j);
+                row[i + r] = a;
+                if (!a) continue;
+                if (i < lo[j + r]) lo[j + r] = i;
+                hi[j + r] = i;
+            }
+        }
+    }
+
+    // Emit the stamp centred on (x, y) in colour c
+    template<class Sink>
+    void paint(int x, int y, Pixel c, DabClip<Sink>& out) const {
+        int n = 2 * radius + 1;
+        for (int j = 0; j < n; j++) {
+            if (lo[j] > hi[j]) continue;
+            if (alpha.empty()) {
+                out.span(y + j - radius, x + lo[j], x + hi[j], c);
+            } else {
+                out.cover(y + j - radius, x + lo[j], x + hi[j], c, &alpha[(size_t)j * n + lo[j] + radius]);
+            }
+        }
+    }
+
+    // Emit the union of the stamps centred on (xs[k], ys[k]), ys ascending:
+    // each pixel once, at the highest alpha any of those dabs gives it
+    template<class Sink>
+    void sweep(const int* xs, const int* ys, int count, Pixel c, DabClip<Sink>& out) const {
+        if (radius < 0) return;
+        int xmin = xs[0], xmax = xs[0];
+        for (int k = 1; k < count; k++) {
+            xmin = std::min(xmin, xs[k]);
+            xmax = std::max(xmax, xs[k]);
+        }
+        int bx0 = std::max(xmin - radius, 0), bx1 = std::min(xmax + radius, out.width - 1);
+        int by0 = std::max(ys[0] - radius, 0), by1 = std::min(ys[count - 1] + radius, out.height - 1);
+        if (bx0 > bx1) return;
+        int n = 2 * radius + 1;
+        std::vector<uint8_t> row(bx1 - bx0 + 1); // Coverage of row y; 1 = covered for solid stamps
+        int first = 0, last = 0;                 // Dabs [first, last) reach row y
+        for (int y = by0; y <= by1; y++) {
+            while (first < count && ys[first] < y - radius) first++;
+            while (last < count && ys[last] <= y + radius) last++;
+            int lx = (int)row.size(), hx = -1;
+            for (int k = first; k < last; k++) {
+                int j = y - ys[k] + radius;
+                int a = std::max(xs[k] + lo[j], bx0), b = std::min(xs[k] + hi[j], bx1);
+                if (a > b) continue;
+                uint8_t* dst = &row[a - bx0];
+                if (alpha.empty()) {
+                    memset(dst, 1, b - a + 1);
+                } else {
+                    max_row(dst, &alpha[(size_t)j * n + (a - xs[k]) + radius], b - a + 1);
+                }
+                lx = std::min(lx, a - bx0);
+                hx = std::max(hx, b - bx0);
+            }
+            // Covered runs, then clear the row for the next one
+            for (int i = lx; i <= hx;) {
+                if (!row[i]) { i++; continue; }
+                int e = i;
+                while (e + 1 <= hx && row[e + 1]) e++;
+                if (alpha.empty()) out.span(y, bx0 + i, bx0 + e, c);
+                else out.cover(y, bx0 + i, bx0 + e, c, &row[i]);
+                i = e + 1;
+            }
+            if (hx >= lx) memset(&row[lx], 0, hx - lx + 1);
+        }
+    }
+};
+
+// Hit/miss counters over every thread's cache
+inline std::atomic<uint64_t> stamp_hits{0};
+inline std::atomic<uint64_t> stamp_misses{0};
+inline std::atomic<uint64_t> stamp_evictions{0};
+inline std::atomic<int64_t> stamp_bytes{0};
+
+// Least recently used stamps, keyed by brush kind, size, pressure, opacity
+// and colour alpha (stamp_key). Each painting thread has its own
+// (stamp_cache()), so lookups take no lock. STAMP_CACHE_BYTES caps
+// stamp_bytes, the total over every thread: a thread that finds it over
+// evicts its own oldest stamps, keeping the one it just built, so the
+// total can pass the cap by at most one stamp per thread.
+class StampCache {
+    typedef std::list<std::pair<uint64_t, DabStamp>> Lru;
+    Lru lru; // Most recent first
+    std::unordered_map<uint64_t, Lru::iterator> index;
+    size_t bytes = 0;
+
+public:
+    ~StampCache() { stamp_bytes -= bytes; }
+
+    // The stamp for key, built with build(DabStamp&) on a miss. Valid until
+    // the next call.
+    template<class Build>
+    const DabStamp& get(uint64_t key, Build build) {
+        auto it = index.find(key);
+        if (it != index.end()) {
+            stamp_hits++;
+            lru.splice(lru.begin(), lru, it->second);
+            return lru.front().second;
+        }
+        stamp_misses++;
+        lru.emplace_front();
+        lru.front().first = key;
+        build(lru.front().second);
+        index[key] = lru.begin();
+        size_t added = lru.front().second.bytes();
+        bytes += added;
+        stamp_bytes += added;
+        while (stamp_bytes.load(std::memory_order_relaxed) > (int64_t)STAMP_CACHE_BYTES && lru.size() > 1) {
+            size_t dropped = lru.back().second.bytes();
+            bytes -= dropped;
+            stamp_bytes -= dropped;
+            stamp_evictions++;
+            index.erase(lru.back().first);
+            lru.pop_back();
+        }
+        return lru.front().second;
+    }
+};
+
+inline StampCache& stamp_cache() {
+    static thread_local StampCache cache;
+    return cache;
+}
+
+inline uint64_t stamp_key(int kind, int size, int pressure, int opacity, int alpha) {
+    return (uint64_t)kind << 56 | (uint64_t)(uint32_t)size << 24 |
+           (uint64_t)(pressure & 0xFF) << 16 | (uint64_t)(opacity & 0xFF) << 8 | (uint64_t)(alpha & 0xFF);
+}
+
+// Solid (2r + 1)^2 square, r < 0 giving an empty one
+inline const DabStamp& square_stamp(int kind, int r) {
+    return stamp_cache().get(stamp_key(kind, r, 0, 0, 0), [r](DabStamp& st) {
+        int n = std::max(2 * r + 1, 0);
+        st.radius = r;
+        st.lo.assign(n, (int16_t)-r);
+        st.hi.assign(n, (int16_t)r);
+    });
+}
+
+// Everything about one dab besides where it lands. Passed by value with
+// each op; brushes hold no per-user state, so any number of threads can
+// paint with the same Brush at once.
+struct DabParams {
+    Pixel color;
+    int size;
+    int pressure; // 0-255
+    int angle;    // Stroke direction in degrees (TexturedBrush)
+    int opacity;  // 0-255, on top of color.a
+};
 
 // --- BASE CLASS ---
+// Immutable descriptor: one shared instance per brush type
 class Brush {
 public:
-    int size = 15;
-    int opacity = 255; 
+    const BrushKind kind;
+    explicit Brush(BrushKind k) : kind(k) {}
     virtual ~Brush() = default;
-    virtual void paint(int x, int y, Pixel color, int size, int pressure, int angle, std::function<void(int, int, Pixel)> setPixel) = 0;
 };
 
-// --- EXISTING BRUSHES (Unchanged) ---
+// --- BRUSHES ---
 class RoundBrush : public Brush {
 public:
-    void paint(int x, int y, Pixel color, int size, int pressure, int angle, std::function<void(int, int, Pixel)> setPixel) override {
-        (void)angle; (void)pressure;
-        color.a = (uint8_t)((color.a * opacity) / 255);
-        int r = size / 2;
-        if (r < 1) { setPixel(x, y, color); return; }
-        for (int i = -r; i <= r; i++) {
+    static constexpr BrushKind KIND = BRUSH_KIND_ROUND;
+    static constexpr bool STAMPED = true; // Has stamp()
+    RoundBrush() : Brush(KIND) {}
+
+    // The dab's shape, and in color the colour to paint it in
+    const DabStamp& stamp(const DabParams& dp, Pixel& color) const {
+        color = dp.color;
+        color.a = (uint8_t)((color.a * dp.opacity) / 255);
+        int r = std::max(dp.size / 2, 0);
+        return stamp_cache().get(stamp_key(kind, r, 0, 0, 0), [r](DabStamp& st) {
+            int n = 2 * r + 1;
+            st.radius = r;
+            st.lo.resize(n);
+            st.hi.resize(n);
             for (int j = -r; j <= r; j++) {
-                if (i*i + j*j <= r*r) setPixel(x + i, y + j, color);
+                // Widest i with i*i + j*j <= r*r
+                int w = (int)sqrt((double)(r * r - j * j));
+                while ((w + 1) * (w + 1) + j * j <= r * r) w++;
+                while (w * w + j * j > r * r) w--;
+                st.lo[j + r] = -w;
+                st.hi[j + r] = w;
             }
-        }
+        });
+    }
+
+    template<class Sink>
+    void dab(int x, int y, const DabParams& dp, DabClip<Sink>& out) const {
+        Pixel color;
+        const DabStamp& st = stamp(dp, color);
+        st.paint(x, y, color, out);
     }
 };
 
 class SquareBrush : public Brush {
 public:
-    void paint(int x, int y, Pixel color, int size, int pressure, int angle, std::function<void(int, int, Pixel)> setPixel) override {
-        (void)angle; (void)pressure;
-        color.a = (uint8_t)((color.a * opacity) / 255);
-        int r = size / 2;
-        for (int i = -r; i <= r; i++) {
-            for (int j = -r; j <= r; j++) setPixel(x + i, y + j, color);
-        }
+    static constexpr BrushKind KIND = BRUSH_KIND_SQUARE;
+    static constexpr bool STAMPED = true; // Has stamp()
+    SquareBrush() : Brush(KIND) {}
+
+    const DabStamp& stamp(const DabParams& dp, Pixel& color) const {
+        color = dp.color;
+        color.a = (uint8_t)((color.a * dp.opacity) / 255);
+        return square_stamp(kind, dp.size / 2);
+    }
+
+    template<class Sink>
+    void dab(int x, int y, const DabParams& dp, DabClip<Sink>& out) const {
+        Pixel color;
+        const DabStamp& st = stamp(dp, color);
+        st.paint(x, y, color, out);
     }
 };
 
 class HardEraserBrush : public Brush {
 public:
-    void paint(int x, int y, Pixel color, int size, int pressure, int angle, std::function<void(int, int, Pixel)> setPixel) override {
-        (void)color; (void)pressure; (void)angle;
-        int r = size / 2;
-        for (int i = -r; i <= r; i++) {
-            for (int j = -r; j <= r; j++) {
-                Pixel erased = {0, 0, 0, 0}; 
-                setPixel(x + i, y + j, erased);
-            }
-        }
+    static constexpr BrushKind KIND = BRUSH_KIND_HARD_ERASER;
+    static constexpr bool STAMPED = true; // Has stamp()
+    HardEraserBrush() : Brush(KIND) {}
+
+    const DabStamp& stamp(const DabParams& dp, Pixel& color) const {
+        color = {0, 0, 0, 0};
+        return square_stamp(kind, dp.size / 2);
+    }
+
+    template<class Sink>
+    void dab(int x, int y, const DabParams& dp, DabClip<Sink>& out) const {
+        Pixel color;
+        const DabStamp& st = stamp(dp, color);
+        st.paint(x, y, color, out);
     }
 };
 
 class PressureBrush : public Brush {
 public:
-    void paint(int x, int y, Pixel color, int maxSize, int pressure, int angle, std::function<void(int, int, Pixel)> setPixel) override {
-        (void)angle;
-        float p = pressure / 255.0f;
-        float opacityCurve = 0.2f + 0.8f * sqrt(p);
-        if (opacityCurve > 1.0f) opacityCurve = 1.0f;
-        float baseAlpha = (color.a * opacity / 255.0f) * opacityCurve;
-        
-        // Thinner at low pressure: 10% to 100%
-        float effectiveDiameter = maxSize * (0.1f + 0.9f * p);
-        float radius = effectiveDiameter / 2.0f; 
-        if (radius < 0.5f) radius = 0.5f;
-        int range = (int)ceil(radius) + 1;
-        
-        float featherRange = 1.5f;
-        float maxDist = radius + (featherRange / 2.0f);
-        float maxDist2 = maxDist * maxDist;
-
-        for (int i = -range; i <= range; i++) {
-            int i2 = i * i;
-            for (int j = -range; j <= range; j++) {
-                float dist2 = i2 + j*j;
-                if (dist2 < maxDist2) {
-                    float dist = sqrt(dist2);
-                    float delta = (radius - dist + (featherRange / 2.0f)) / featherRange;
-                    if (delta > 0.0f) {
-                        if (delta > 1.0f) delta = 1.0f;
-                        Pixel px = color;
-                        px.a = (uint8_t)(baseAlpha * delta);
-                        if (px.a > 0) setPixel(x + i, y + j, px);
-                    }
-                }
-            }
-        }
+    static constexpr BrushKind KIND = BRUSH_KIND_PRESSURE;
+    static constexpr bool STAMPED = true; // Has stamp()
+    PressureBrush() : Brush(KIND) {}
+
+    const DabStamp& stamp(const DabParams& dp, Pixel& color) const {
+        color = dp.color;
+        int maxSize = dp.size, opacity = dp.opacity;
+        uint64_t key = stamp_key(kind, maxSize, dp.pressure, opacity, color.a);
+        return stamp_cache().get(key, [&](DabStamp& st) {
+            float p = dp.pressure / 255.0f;
+            float opacityCurve = 0.2f + 0.8f * sqrt(p);
+            if (opacityCurve > 1.0f) opacityCurve = 1.0f;
+            float baseAlpha = (color.a * opacity / 255.0f) * opacityCurve;
+
+            // Thinner at low pressure: 10% to 100%
+            float effectiveDiameter = maxSize * (0.1f + 0.9f * p);
+            float radius = effectiveDiameter / 2.0f;
+            if (radius < 0.5f) radius = 0.5f;
+            int range = (int)ceil(radius) + 1;
+
+            float featherRange = 1.5f;
+            float maxDist = radius + (featherRange / 2.0f);
+            float maxDist2 = maxDist * maxDist;
+
+            st.build(range, [&](int i, int j) -> uint8_t {
+                float dist2 = i * i + j * j;
+                if (dist2 >= maxDist2) return 0;
+                float dist = sqrt(dist2);
+                float delta = (radius - dist + (featherRange / 2.0f)) / featherRange;
+                if (delta <= 0.0f) return 0;
+                if (delta > 1.0f) delta = 1.0f;
+                return (uint8_t)(baseAlpha * delta);
+            });
+        });
+    }
+
+    template<class Sink>
+    void dab(int x, int y, const DabParams& dp, DabClip<Sink>& out) const {
+        Pixel color;
+        const DabStamp& st = stamp(dp, color);
+        st.paint(x, y, color, out);
     }
 };
 
 class Airbrush : public Brush {
 public:
-    void paint(int x, int y, Pixel color, int size, int pressure, int angle, std::function<void(int, int, Pixel)> setPixel) override {
-        (void)angle;
-        float p = pressure / 255.0f;
-        int effectiveSize = (int)(size * (0.5f + 0.5f * p)); 
-        if (effectiveSize < 1) effectiveSize = 1;
-        
-        // Much lower alpha for accumulation (0.05 to 0.2)
-        float pressureAlphaMod = 0.05f + 0.15f * p; 
-        int r = effectiveSize; 
-        int r2 = r * r;
-
-        for (int i = -r; i <= r; i++) {
-            int i2 = i * i;
-            for (int j = -r; j <= r; j++) {
-                int dist2 = i2 + j*j;
-                if (dist2 <= r2) {
-                    float dist = sqrt(dist2);
-                    float falloff = 1.0f - (dist / r);
-                    falloff = falloff * falloff; 
-                    float finalAlphaFloat = (color.a * opacity / 255.0f) * pressureAlphaMod * falloff;
-                    Pixel px = color;
-                    px.a = (uint8_t)finalAlphaFloat;
-                    if (px.a > 0) setPixel(x + i, y + j, px);
-                }
-            }
-        }
+    static constexpr BrushKind KIND = BRUSH_KIND_AIRBRUSH;
+    static constexpr bool STAMPED = true; // Has stamp()
+    Airbrush() : Brush(KIND) {}
+
+    const DabStamp& stamp(const DabParams& dp, Pixel& color) const {
+        color = dp.color;
+        int opacity = dp.opacity;
+        return stamp_cache().get(stamp_key(kind, dp.size, dp.pressure, opacity, color.a), [&](DabStamp& st) {
+            float p = dp.pressure / 255.0f;
+            int effectiveSize = (int)(dp.size * (0.5f + 0.5f * p));
+            if (effectiveSize < 1) effectiveSize = 1;
+
+            // Much lower alpha for accumulation (0.05 to 0.2)
+            float pressureAlphaMod = 0.05f + 0.15f * p;
+            int r = effectiveSize;
+            int r2 = r * r;
+
+            st.build(r, [&](int i, int j) -> uint8_t {
+                int dist2 = i * i + j * j;
+                if (dist2 > r2) return 0;
+                float dist = sqrt(dist2);
+                float falloff = 1.0f - (dist / r);
+                falloff = falloff * falloff;
+                float finalAlphaFloat = (color.a * opacity / 255.0f) * pressureAlphaMod * falloff;
+                return (uint8_t)finalAlphaFloat;
+            });
+        });
+    }
+
+    template<class Sink>
+    void dab(int x, int y, const DabParams& dp, DabClip<Sink>& out) const {
+        Pixel color;
+        const DabStamp& st = stamp(dp, color);
+        st.paint(x, y, color, out);
     }
 };
 
-// --- NEW / MODIFIED BRUSHES ---
 class TexturedBrush : public Brush {
     // A smoother bristle map. Lower numbers are gaps between bristles.
-    const float bristles[32] = { 
-        0.3f, 0.7f, 0.9f, 0.5f, 0.2f, 0.8f, 0.9f, 0.4f, 
+    const float bristles[32] = {
+        0.3f, 0.7f, 0.9f, 0.5f, 0.2f, 0.8f, 0.9f, 0.4f,
         0.9f, 0.6f, 0.3f, 0.8f, 0.9f, 0.2f, 0.7f, 0.5f,
         0.4f, 0.9f, 0.8f, 0.3f, 0.6f, 0.9f, 0.5f, 0.2f,
         0.8f, 0.4f, 0.9f, 0.7f, 0.3f, 0.8f, 0.6f, 0.4f
     };
 
 public:
-    void paint(int x, int y, Pixel color, int size, int pressure, int angle, std::function<void(int, int, Pixel)> setPixel) override {
-        float rads = angle * (M_PI / 180.0f);
-        float p = pressure / 255.0f;
+    static constexpr BrushKind KIND = BRUSH_KIND_TEXTURED;
+    static constexpr bool STAMPED = false; // No stamp(): the shape changes every dab
+    TexturedBrush() : Brush(KIND) {}
+
+    // A line across the stroke: single-pixel runs, which may repeat a pixel
+    template<class Sink>
+    void dab(int x, int y, const DabParams& dp, DabClip<Sink>& out) const {
+        Pixel color = dp.color;
+        int size = dp.size, opacity = dp.opacity;
+        float rads = dp.angle * (M_PI / 180.0f);
+        float p = dp.pressure / 255.0f;
 
         // Vector perpendicular to drawing direction
         float dx = -sin(rads);
@@ -166,14 +470,14 @@ public:
             int py = y + (int)(dy * i);
 
             // Sample bristle map. We mirror it for symmetry around the center.
-            int patternIndex = abs(i) % 32; 
+            int patternIndex = abs(i) % 32;
             float bristleStrength = bristles[patternIndex];
 
             // If pressure is high (1.0), combined strength becomes >= 1.0 everywhere.
             // If pressure is low, the bristle map dominates.
             float combinedStrength = bristleStrength + (pressurePower * 0.8f);
             if (combinedStrength > 1.0f) combinedStrength = 1.0f;
-            
+
             // Soft Edges: A slight falloff at the very tips of the brush
             float edgeDist = (float)abs(i) / halfWidth;
             float edgeSoftness = 1.0f - pow(edgeDist, 4.0f); // Sharp falloff near edge
@@ -185,7 +489,7 @@ public:
 
             // Only draw visible pixels
             if (finalColor.a > 5) {
-                setPixel(px, py, finalColor);
+                out.span(py, px, px, finalColor);
             }
         }
     }
@@ -194,44 +498,151 @@ public:
 // 2. NEW SOFT ERASER
 class SoftEraserBrush : public Brush {
 public:
-    void paint(int x, int y, Pixel color, int size, int pressure, int angle, std::function<void(int, int, Pixel)> setPixel) override {
-        (void)color; (void)angle;
-        float p = pressure / 255.0f;
-        
-        // Dynamic size with pressure (like airbrush)
-        int effectiveSize = (int)(size * (0.5f + 0.5f * p)); 
-        if (effectiveSize < 1) effectiveSize = 1;
-        
-        // Pressure affects how STRONG the erasing is
-        // 10% min strength -> 100% max
-        float pressureMod = 0.1f + 0.9f * p; 
-        
-        int r = effectiveSize; 
-        int r2 = r * r;
-
-        for (int i = -r; i <= r; i++) {
-            int i2 = i * i;
-            for (int j = -r; j <= r; j++) {
-                int dist2 = i2 + j*j;
-                if (dist2 <= r2) {
-                    float dist = sqrt(dist2);
-                    // Soft edges (Cubic falloff)
-                    float falloff = 1.0f - (dist / r);
-                    falloff = falloff * falloff * falloff;
-                    
-                    // Calculate "Eraser Strength" (0 to 255)
-                    // We store this in the ALPHA channel of the pixel we pass
-                    uint8_t strength = (uint8_t)(255 * falloff * pressureMod * (opacity / 255.0f));
-                    
-                    if (strength > 0) {
-                        // We send {0,0,0, strength}. 
-                        // The RGB doesn't matter, only the Alpha (Strength).
-                        Pixel p = {0, 0, 0, strength};
-                        setPixel(x + i, y + j, p);
-                    }
-                }
-            }
+    static constexpr BrushKind KIND = BRUSH_KIND_SOFT_ERASER;
+    static constexpr bool STAMPED = true; // Has stamp()
+    SoftEraserBrush() : Brush(KIND) {}
+
+    // Covers with {0,0,0,strength}: sinks subtract the strength from alpha
+    const DabStamp& stamp(const DabParams& dp, Pixel& color) const {
+        color = {0, 0, 0, 0};
+        int opacity = dp.opacity;
+        return stamp_cache().get(stamp_key(kind, dp.size, dp.pressure, opacity, 0), [&](DabStamp& st) {
+            float p = dp.pressure / 255.0f;
+
+            // Dynamic size with pressure (like airbrush)
+            int effectiveSize = (int)(dp.size * (0.5f + 0.5f * p));
+            if (effectiveSize < 1) effectiveSize = 1;
+
+            // Pressure affects how STRONG the erasing is
+            // 10% min strength -> 100% max
+            float pressureMod = 0.1f + 0.9f * p;
+
+            int r = effectiveSize;
+            int r2 = r * r;
+
+            st.build(r, [&](int i, int j) -> uint8_t {
+                int dist2 = i * i + j * j;
+                if (dist2 > r2) return 0;
+                float dist = sqrt(dist2);
+                // Soft edges (Cubic falloff)
+                float falloff = 1.0f - (dist / r);
+                falloff = falloff * falloff * falloff;
+
+                // "Eraser Strength" (0 to 255), carried in the alpha channel
+                return (uint8_t)(255 * falloff * pressureMod * (opacity / 255.0f));
+            });
+        });
+    }
+
+    template<class Sink>
+    void dab(int x, int y, const DabParams& dp, DabClip<Sink>& out) const {
+        Pixel color;
+        const DabStamp& st = stamp(dp, color);
+        st.paint(x, y, color, out);
+    }
+};
+
+// How a brush's runs combine with the layer: composited over it (blend.h),
+// written as they are, or (soft eraser) their alpha taken off the layer's
+enum DabMode { DAB_OVER, DAB_ERASE, DAB_SUBTRACT };
+
+inline DabMode dab_mode(const Brush* brush) {
+    if (brush->kind == BRUSH_KIND_HARD_ERASER) return DAB_ERASE;
+    if (brush->kind == BRUSH_KIND_SOFT_ERASER) return DAB_SUBTRACT;
+    return DAB_OVER;
+}
+
+// Calls f(x, y) for every step of the Bresenham line (x0, y0)-(x1, y1)
+template<class F>
+inline void bresenham(int x0, int y0, int x1, int y1, F f) {
+    int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+    int dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+    int err = dx + dy, e2;
+    while (true) {
+        f(x0, y0);
+        if (x0 == x1 && y0 == y1) break;
+        e2 = 2 * err;
+        if (e2 >= dy) { err += dy; x0 += sx; }
+        if (e2 <= dx) { err += dx; y0 += sy; }
+    }
+}
+
+// One MSG_DRAW dab at (x, y), or with line set, the MSG_LINE op
+// (x, y)-(ex, ey): a dab at every Bresenham step
+struct DabOp {
+    int x, y, ex, ey;
+    bool line;
+    DabParams params;
+};
+
+// Rasterize op with brush B. Stamped brushes sweep their stamp along a line
+// (DabStamp::sweep), so pixels several dabs overlap get the strongest
+// coverage once rather than being painted by each of them.
+template<class B, class Sink>
+inline void paint_op(const B* brush, const DabOp& op, DabClip<Sink>& out) {
+    if (!op.line) {
+        brush->dab(op.x, op.y, op.params, out);
+        return;
+    }
+    if constexpr (B::STAMPED) {
+        std::vector<int> xs, ys;
+        bresenham(op.x, op.y, op.ex, op.ey, [&](int x, int y) {
+            xs.push_back(x);
+            ys.push_back(y);
+        });
+        if (op.ey < op.y) { // sweep() wants rows in ascending order
+            std::reverse(xs.begin(), xs.end());
+            std::reverse(ys.begin(), ys.end());
+        }
+        Pixel c;
+        const DabStamp& stamp = brush->stamp(op.params, c);
+        stamp.sweep(xs.data(), ys.data(), (int)xs.size(), c, out);
+    } else {
+        bresenham(op.x, op.y, op.ex, op.ey, [&](int x, int y) {
+            brush->dab(x, y, op.params, out);
+        });
+    }
+}
+
+// Every brush class. Adding one here (with its BrushKind) gives it kernels
+// in every DabKernels table.
+template<class... Brushes> struct BrushTypes {};
+typedef BrushTypes<RoundBrush, SquareBrush, HardEraserBrush, PressureBrush,
+                   Airbrush, TexturedBrush, SoftEraserBrush> AllBrushes;
+
+// paint_op for every brush class and DabMode, into Sink<Mode>. A sink
+// family provides Target (what it paints into), Result (what an op reports
+// back), a Sink<Mode>(Target) constructor, result(), and the canvas size as
+// static width and height.
+template<template<DabMode> class Sink>
+struct DabKernels {
+    typedef typename Sink<DAB_OVER>::Target Target;
+    typedef typename Sink<DAB_OVER>::Result Result;
+    typedef Result (*Kernel)(const Brush* brush, Target target, const DabOp& op);
+
+    template<class B, DabMode Mode>
+    static Result kernel(const Brush* brush, Target target, const DabOp& op) {
+        Sink<Mode> sink(target);
+        DabClip<Sink<Mode>> out = {sink, Sink<Mode>::width, Sink<Mode>::height};
+        paint_op(static_cast<const B*>(brush), op, out);
+        return sink.result();
+    }
+
+    struct Table {
+        Kernel k[BRUSH_KIND_COUNT][3];
+
+        template<class... Bs>
+        explicit Table(BrushTypes<Bs...>) : k() {
+            ((k[Bs::KIND][DAB_OVER] = kernel<Bs, DAB_OVER>,
+              k[Bs::KIND][DAB_ERASE] = kernel<Bs, DAB_ERASE>,
+              k[Bs::KIND][DAB_SUBTRACT] = kernel<Bs, DAB_SUBTRACT>), ...);
         }
+    };
+
+    // Paint op with brush, combined per dab_mode(brush)
+    static Result run(const Brush* brush, Target target, const DabOp& op) {
+        static const Table table{AllBrushes()};
+        return table.k[brush->kind][dab_mode(brush)](brush, target, op);
     }
 };
 
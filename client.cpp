@@ -60,6 +60,10 @@ void print_tutorial_controls() {
 }
 
 #include "brushes.h"
+#include "blend.h"
+#include "codec.h"
+#include "base64.h"
+#include "seqwin.h"
 #include "RawInput.h"
 #include "undo.h"
 
@@ -72,7 +76,9 @@ void print_tutorial_controls() {
 #define CANVAS_WIDTH  1280
 #define CANVAS_HEIGHT 720
 #define TCP_PORT      6769
-#define UDP_BASE_PORT 6770
+#define UDP_PORT      6770  // Shared by all canvases; packets carry canvas_id
+#define CANVAS_TILES  (((CANVAS_WIDTH + TILE_SIZE - 1) / TILE_SIZE) * ((CANVAS_HEIGHT + TILE_SIZE - 1) / TILE_SIZE))
+#define MAX_DELTA_BYTES (sizeof(uint32_t) + CANVAS_TILES * (sizeof(SnapshotTileHeader) + TILE_MAX_PAYLOAD)) // Largest valid tile list
 
 const int BRUSH_ROUND_ID = 0;
 const int BRUSH_SQUARE_ID = 1;
@@ -97,7 +103,10 @@ enum MsgType {
     MSG_LAYER_SYNC = 13,   // Full layer data sync (for undo/redo)
     MSG_LAYER_REORDER = 14,
     MSG_SIGNATURE = 15,     // New signature message
-    MSG_LAYER_MOVE = 17
+    MSG_LAYER_MOVE = 17,
+    MSG_LAYER_DELTA = 18,   // Changed tiles of one layer (length in data[0..3])
+    MSG_NACK = 19,          // UDP: resend sender_uid's ops [sender_seq, +size)
+    MSG_LAYER_RESYNC = 20   // Ask for / reply with a whole layer as a tile list
 };
 
 #define SIGNATURE_WIDTH 450
@@ -114,6 +123,9 @@ struct TCPMessage {
     char     data[256]; // Reverted payload size
 } __attribute__((packed));
 
+// MSG_WELCOME data[0]
+#define WELCOME_PREMULTIPLIED 0x01 // Layers (snapshot, deltas, syncs) are premultiplied RGBA
+
 // Specialized packet for login with signature
 struct LoginPacket {
     uint8_t  type;        // MSG_LOGIN
@@ -127,6 +139,7 @@ struct LoginPacket {
 
 struct UDPMessage {
     uint8_t  type;
+    uint8_t  canvas_id; // Room this op belongs to (all rooms share UDP_PORT)
     uint8_t  brush_id;
     uint8_t  layer_id;
     int16_t  x;
@@ -135,6 +148,9 @@ struct UDPMessage {
     uint8_t  r, g, b, a;
     uint8_t  size;
     uint8_t  pressure;  // 0-255 representing 0.0-1.0 pressure 
+    uint8_t  sender_uid; // Author's room UID (0 = unsequenced)
+    uint16_t sender_seq; // Author's op counter; MSG_CURSOR: last op sent
+    uint8_t  opacity;    // Brush opacity, 0-255, applied on top of the colour's alpha
 } __attribute__((packed));
 
 /*****************************************************************************
@@ -212,6 +228,7 @@ int layerCount = 2;      // Layer 0 (paper) + Layer 1 (drawable)
 int layerDisplayIds[MAX_LAYERS]; // Maps index -> original ID
 uint8_t layerOpacity[MAX_LAYERS]; // Opacity for each layer (0-255)
 int loggedin = 0;
+bool premultipliedLayers = false; // Set by WELCOME: how this canvas's layers are stored
 volatile int running = 1;
 uint8_t* layers[MAX_LAYERS] = {nullptr};  // Layer 0 = paper (white), Layer 1+ = drawable
 // GPU mirrors of the layers
@@ -253,12 +270,100 @@ void mark_layer_dirty(int layer_id, int x, int y, int brushSize) {
     layerIsDirty[layer_id] = true;
 }
 
+// Box of pixels an op covered (max_x < 0 when it covered none)
+struct DabBox { int min_x, min_y, max_x, max_y; };
+
+// Brush runs (brushes.h) into a row-major RGBA layer, combined as the
+// brush's DabMode says, the same way the server does. Keeps the box it covered.
+template<DabMode Mode, bool Premul>
+struct RgbaSink {
+    typedef uint8_t* Target;
+    typedef DabBox Result;
+    static const int width = CANVAS_WIDTH, height = CANVAS_HEIGHT;
+
+    uint8_t* pixels;
+    DabBox box;
+
+    explicit RgbaSink(uint8_t* p) : pixels(p), box{CANVAS_WIDTH, CANVAS_HEIGHT, -1, -1} {}
+    DabBox result() const { return box; }
+
+    void span(int y, int x0, int x1, SDL_Color c) { write(y, x0, x1, c, nullptr); }
+    void cover(int y, int x0, int x1, SDL_Color c, const uint8_t* alpha) { write(y, x0, x1, c, alpha); }
+
+    void write(int y, int x0, int x1, SDL_Color c, const uint8_t* alpha) {
+        box.min_x = min(box.min_x, x0); box.max_x = max(box.max_x, x1);
+        box.min_y = min(box.min_y, y);  box.max_y = max(box.max_y, y);
+        uint8_t* p = pixels + ((size_t)y * CANVAS_WIDTH + x0) * 4;
+        int n = x1 - x0 + 1;
+        if (Mode == DAB_OVER) {
+            if (Premul) blend_span_pm(p, n, (const uint8_t*)&c, alpha);
+            else blend_span(p, n, (const uint8_t*)&c, alpha);
+            return;
+        }
+        for (int k = 0; k < n; k++, p += 4) {
+            if (alpha && !alpha[k]) continue;
+            uint8_t a = alpha ? alpha[k] : c.a;
+            if (Mode == DAB_ERASE) {
+                p[0] = c.r; p[1] = c.g; p[2] = c.b; p[3] = a;
+                if (Premul) premultiply_pixel(p, p, a);
+            } else {
+                uint8_t left = p[3] > a ? p[3] - a : 0; // Soft eraser: strength off the alpha
+                if (Premul && p[3]) {
+                    for (int ch = 0; ch < 3; ch++) p[ch] = (p[ch] * left + p[3] / 2) / p[3];
+                }
+                p[3] = left;
+            }
+        }
+    }
+};
+
+template<DabMode Mode> using StraightRgbaSink = RgbaSink<Mode, false>;
+template<DabMode Mode> using PremulRgbaSink = RgbaSink<Mode, true>;
+
+static DabBox paint_rgba_op(uint8_t* pixels, const Brush* brush, const DabOp& op) {
+    return premultipliedLayers ? DabKernels<PremulRgbaSink>::run(brush, pixels, op)
+                               : DabKernels<StraightRgbaSink>::run(brush, pixels, op);
+}
+
+static DabBox paint_rgba_dab(uint8_t* pixels, const Brush* brush, int x, int y, const DabParams& dp) {
+    DabOp op = {x, y, x, y, false, dp};
+    return paint_rgba_op(pixels, brush, op);
+}
+
+// A MSG_LINE op, rasterized like the server does it (dp.angle is ignored)
+static DabBox paint_rgba_line(uint8_t* pixels, const Brush* brush, int x0, int y0, int x1, int y1,
+                              const DabParams& dp) {
+    DabOp op = {x0, y0, x1, y1, true, dp};
+    op.params.angle = (int)(atan2(y1 - y0, x1 - x0) * 180.0 / M_PI);
+    return paint_rgba_op(pixels, brush, op);
+}
+
+// Corners of the covered box: same union as marking every pixel
+static void mark_layer_box(int layer_id, const DabBox& box) {
+    if (box.max_x < 0) return;
+    mark_layer_dirty(layer_id, box.min_x, box.min_y, 1);
+    mark_layer_dirty(layer_id, box.max_x, box.max_y, 1);
+}
+
 uint8_t* compositeCanvas = nullptr;       // Final composited image for display
 pthread_mutex_t layerMutex = PTHREAD_MUTEX_INITIALIZER;  // Protects layers array and layerCount
 
+// Sequenced stroke stream (see seqwin.h)
+#define UDP_SEND_RING 1024       // Our recent ops, kept for NACKed resends
+#define NACK_INTERVAL_MS 50      // Min gap between cursor-driven NACKs per author
+pthread_mutex_t udpSeqMutex = PTHREAD_MUTEX_INITIALIZER;
+uint16_t udpSendSeq = 0;
+UDPMessage udpSendRing[UDP_SEND_RING];
+SeqWindow udpRecvWindows[256];   // Per author room UID
+Uint32 udpLastNack[256];
+
 // Flag for pending UI updates (set by TCP thread, handled by main thread)
 volatile bool pendingLayerUpdate = false;
 
+// Layers whose server tiles failed to decode; the main thread asks for a
+// MSG_LAYER_RESYNC so the TCP thread never interleaves with its own sends.
+volatile bool layerResyncWanted[MAX_LAYERS] = {false};
+
 // Flag to auto-select new layer if we requested it
 volatile bool pendingMyNewLayer = false;
 
@@ -315,8 +420,15 @@ void clean_expired_commands() {
 
 bool strokeInProgress = false;
 
-// Brush system
-vector<Brush*> availableBrushes;
+// Brush system: shared immutable brushes, and the size and opacity picked
+// for each (main thread only), which travel by value with every op
+struct BrushSettings {
+    int size;
+    int opacity;
+};
+
+vector<const Brush*> availableBrushes;
+vector<BrushSettings> brushSettings;
 
 // Remote cursor tracking (forward declaration, defined in ui.h)
 struct RemoteCursor;
@@ -382,8 +494,8 @@ int connect_tcp() {
     return 0;
 }
 
-int setup_udp(int canvas_id) {
-    // printf("[Client][UDP] Setting up socket for canvas #%d (port %d)...\n", canvas_id, UDP_BASE_PORT + canvas_id);
+int setup_udp() {
+    // printf("[Client][UDP] Setting up socket for canvas #%d (port %d)...\n", currentCanvasId, UDP_PORT);
     
     udpSock = socket(AF_INET, SOCK_DGRAM, 0);
     if (udpSock < 0) {
@@ -393,10 +505,10 @@ int setup_udp(int canvas_id) {
 
     memset(&serverUdpAddr, 0, sizeof(serverUdpAddr));
     serverUdpAddr.sin_family = AF_INET;
-    serverUdpAddr.sin_port = htons(UDP_BASE_PORT + canvas_id);
+    serverUdpAddr.sin_port = htons(UDP_PORT);
     inet_pton(AF_INET, serverIp, &serverUdpAddr.sin_addr);
 
-    // printf("[Client][UDP] Socket ready for canvas #%d\n", canvas_id);
+    // printf("[Client][UDP] Socket ready for canvas #%d\n", currentCanvasId);
     return 0;
 }
 
@@ -591,6 +703,48 @@ void send_tcp_layer_sync(int layer_id) {
     }
 }
 
+// Send only the listed tiles (ty * tiles_x + tx) of a layer. The server
+// replaces those tiles and relays the same list to everyone else.
+void send_tcp_layer_delta(int layer_id, const vector<int>& tiles) {
+    if (tcpSock < 0) return;
+    if (layer_id <= 0 || layer_id >= MAX_LAYERS || !layers[layer_id] || tiles.empty()) return;
+    
+    const int tiles_x = (CANVAS_WIDTH + TILE_SIZE - 1) / TILE_SIZE;
+    vector<uint8_t> payload(sizeof(uint32_t));
+    uint32_t tile_count = tiles.size();
+    memcpy(payload.data(), &tile_count, sizeof(tile_count));
+    for (int idx : tiles) {
+        int tx = idx % tiles_x, ty = idx / tiles_x;
+        int x0 = tx * TILE_SIZE, y0 = ty * TILE_SIZE;
+        encode_snapshot_tile(layers[layer_id], CANVAS_WIDTH, tx, ty, x0, y0,
+                             min(TILE_SIZE, CANVAS_WIDTH - x0), min(TILE_SIZE, CANVAS_HEIGHT - y0), payload);
+    }
+    
+    TCPMessage msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = MSG_LAYER_DELTA;
+    msg.canvas_id = currentCanvasId;
+    msg.layer_id = layer_id;
+    uint32_t len = payload.size();
+    memcpy(msg.data, &len, sizeof(len));
+    msg.data_len = sizeof(len);
+    
+    if (send(tcpSock, &msg, sizeof(msg), 0) < 0) {
+        perror("[Client][TCP] Layer delta send failed");
+        return;
+    }
+    size_t total_sent = 0;
+    while (total_sent < payload.size()) {
+        ssize_t sent = send(tcpSock, payload.data() + total_sent, payload.size() - total_sent, 0);
+        if (sent < 0) {
+            perror("[Client][TCP] Layer delta send failed");
+            return;
+        }
+        total_sent += sent;
+    }
+    // printf("[Client][TCP] Layer delta sent: layer=%d tiles=%u (%zu bytes)\n", layer_id, tile_count, payload.size());
+}
+
 void send_all_layers_sync() {
     // Send all drawable layers to server for sync
     for (int l = 1; l < layerCount && l < MAX_LAYERS; l++) {
@@ -638,6 +792,84 @@ void send_tcp_layer_move(int layer_id, int dx, int dy) {
     }
 }
 
+// Send a draw/line op: stamp our UID and next sequence number and keep a copy
+// in case the server NACKs it
+void send_udp_op(UDPMessage& pkt) {
+    pthread_mutex_lock(&udpSeqMutex);
+    if (++udpSendSeq == 0) udpSendSeq = 1; // 0 means "nothing sent" in cursors
+    pkt.sender_uid = myUserId;
+    pkt.sender_seq = udpSendSeq;
+    udpSendRing[udpSendSeq % UDP_SEND_RING] = pkt;
+    pthread_mutex_unlock(&udpSeqMutex);
+    
+    sendto(udpSock, &pkt, sizeof(pkt), 0, (struct sockaddr*)&serverUdpAddr, sizeof(serverUdpAddr));
+}
+
+// Ask the server for [first, first + count) of uid's ops
+void send_udp_nack(uint8_t uid, uint16_t first, int count) {
+    UDPMessage pkt;
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.type = MSG_NACK;
+    pkt.canvas_id = currentCanvasId;
+    pkt.sender_uid = uid;
+    pkt.sender_seq = first;
+    pkt.size = count;
+    sendto(udpSock, &pkt, sizeof(pkt), 0, (struct sockaddr*)&serverUdpAddr, sizeof(serverUdpAddr));
+}
+
+// Sequence bookkeeping for a received packet: answers NACKs for our own ops,
+// drops duplicate ops and NACKs gaps in other authors' streams.
+// Returns false if the packet needs no further handling.
+bool udp_sequence_incoming(const UDPMessage* pkt) {
+    if (pkt->type == MSG_NACK) {
+        if (pkt->sender_uid != myUserId) return false;
+        vector<UDPMessage> resend;
+        pthread_mutex_lock(&udpSeqMutex);
+        for (int k = 0; k < pkt->size; k++) {
+            uint16_t seq = pkt->sender_seq + k;
+            const UDPMessage& op = udpSendRing[seq % UDP_SEND_RING];
+            if (op.type != 0 && op.sender_seq == seq) resend.push_back(op);
+        }
+        pthread_mutex_unlock(&udpSeqMutex);
+        for (const UDPMessage& op : resend) {
+            sendto(udpSock, &op, sizeof(op), 0, (struct sockaddr*)&serverUdpAddr, sizeof(serverUdpAddr));
+        }
+        return false;
+    }
+    
+    uint8_t uid = pkt->sender_uid;
+    if (uid == 0 || uid == myUserId) return true;
+    
+    bool keep = true;
+    pthread_mutex_lock(&udpSeqMutex);
+    SeqWindow& win = udpRecvWindows[uid];
+    if (pkt->type == MSG_CURSOR) {
+        // Cursor carries the author's newest op: catches lost stroke tails
+        Uint32 now = SDL_GetTicks();
+        if (pkt->sender_seq != 0 && now - udpLastNack[uid] >= NACK_INTERVAL_MS) {
+            uint16_t firsts[SEQ_MAX_RUNS];
+            int counts[SEQ_MAX_RUNS];
+            int runs = win.missing(pkt->sender_seq, firsts, counts);
+            for (int r = 0; r < runs; r++) send_udp_nack(uid, firsts[r], counts[r]);
+            if (runs > 0) udpLastNack[uid] = now;
+        }
+    } else if (pkt->type == MSG_DRAW || pkt->type == MSG_LINE) {
+        uint16_t gap_first;
+        int gap_count;
+        keep = win.accept(pkt->sender_seq, &gap_first, &gap_count);
+        if (gap_count > 0) send_udp_nack(uid, gap_first, gap_count);
+    }
+    pthread_mutex_unlock(&udpSeqMutex);
+    return keep;
+}
+
+// Parameters of our ops with the current brush
+static DabParams current_dab_params(int pressure, int angle) {
+    BrushSettings bs = {5, 255};
+    if (currentBrushId >= 0 && currentBrushId < (int)brushSettings.size()) bs = brushSettings[currentBrushId];
+    return {userColor, bs.size, pressure, angle, bs.opacity};
+}
+
 void send_udp_draw(int x, int y, int pressure, int angle) {
     if (udpSock < 0) return;
     if (x < 0 || x >= CANVAS_WIDTH || y < 0 || y >= CANVAS_HEIGHT) return;
@@ -651,10 +883,12 @@ void send_udp_draw(int x, int y, int pressure, int angle) {
     }
 
     lastSentPressure = pressure; // Update global tracker
+    DabParams dp = current_dab_params(pressure, angle);
 
     UDPMessage pkt;
     memset(&pkt, 0, sizeof(pkt));
     pkt.type = MSG_DRAW;
+    pkt.canvas_id = currentCanvasId;
     pkt.brush_id = currentBrushId;
     pkt.layer_id = currentLayerId;
     pkt.x = x;
@@ -663,96 +897,18 @@ void send_udp_draw(int x, int y, int pressure, int angle) {
     pkt.g = userColor.g;
     pkt.b = userColor.b;
     pkt.a = userColor.a;
-    pkt.size = (currentBrushId < (int)availableBrushes.size()) ? availableBrushes[currentBrushId]->size : 5;
+    pkt.size = dp.size;
     pkt.pressure = pressure;
+    pkt.opacity = dp.opacity;
     pkt.ex = (int16_t)angle;
 
-    sendto(udpSock, &pkt, sizeof(pkt), 0, (struct sockaddr*)&serverUdpAddr, sizeof(serverUdpAddr));
+    send_udp_op(pkt);
     
-    // apply locally to the correct layer for immediate feedback
+    // apply locally to the correct layer for immediate feedback, with the
+    // parameters the server gets
     if (currentBrushId < (int)availableBrushes.size()) {
-        SDL_Color col = userColor;
-        int layer_idx = currentLayerId;
-        bool isEraser = (currentBrushId == BRUSH_ERASER_ID);
-        bool isSoftEraser = (currentBrushId == BRUSH_SOFT_ERASER_ID);
-        
-        // Apply pressure locally for prediction if it's the pressure brush
-        int effectiveSize = availableBrushes[currentBrushId]->size;
-        if (currentBrushId == BRUSH_PRESSURE_ID) {
-            effectiveSize = (effectiveSize * pressure) / 255;
-            if (effectiveSize < 1) effectiveSize = 1;
-        }
-        
-        availableBrushes[currentBrushId]->paint(x, y, col, effectiveSize, pressure, angle,
-            [layer_idx, isEraser, isSoftEraser](int px, int py, SDL_Color c) {
-                if (px >= 0 && px < CANVAS_WIDTH && py >= 0 && py < CANVAS_HEIGHT) {
-                    int idx = (py * CANVAS_WIDTH + px) * 4;
-                    
-                    if (isEraser) {
-                        // Eraser: Overwrite with transparent
-                        layers[layer_idx][idx]     = 0;
-                        layers[layer_idx][idx + 1] = 0;
-                        layers[layer_idx][idx + 2] = 0;
-                        layers[layer_idx][idx + 3] = 0;
-                        return;
-                    }
-
-                    if (isSoftEraser) {
-                        uint8_t currentAlpha = layers[layer_idx][idx + 3];
-                        uint8_t eraseStrength = c.a; // "Strength" comes from brush alpha
-
-                        // Subtract strength from current alpha
-                        if (currentAlpha > 0) {
-                            int newAlpha = (int)currentAlpha - (int)eraseStrength;
-                            if (newAlpha < 0) newAlpha = 0;
-                            
-                            layers[layer_idx][idx + 3] = (uint8_t)newAlpha;
-                            
-                            // Optional: If alpha is 0, clear RGB to keep memory clean
-                            if (newAlpha == 0) {
-                                layers[layer_idx][idx] = 0;
-                                layers[layer_idx][idx+1] = 0;
-                                layers[layer_idx][idx+2] = 0;
-                            }
-                        }
-                        return;
-                    }
-                    
-                    // Alpha Blending (Source Over Destination)
-                    uint8_t dst_r = layers[layer_idx][idx];
-                    uint8_t dst_g = layers[layer_idx][idx + 1];
-                    uint8_t dst_b = layers[layer_idx][idx + 2];
-                    uint8_t dst_a = layers[layer_idx][idx + 3];
-                    
-                    uint8_t src_r = c.r;
-                    uint8_t src_g = c.g;
-                    uint8_t src_b = c.b;
-                    uint8_t src_a = c.a;
-                    
-                    if (src_a == 255) {
-                        layers[layer_idx][idx]     = src_r;
-                        layers[layer_idx][idx + 1] = src_g;
-                        layers[layer_idx][idx + 2] = src_b;
-                        layers[layer_idx][idx + 3] = src_a;
-                    } else if (src_a > 0) {
-                        float sa = src_a / 255.0f;
-                        float da = dst_a / 255.0f;
-                        float out_a = sa + da * (1.0f - sa);
-                        
-                        if (out_a > 0.0f) {
-                            float out_r = (src_r * sa + dst_r * da * (1.0f - sa)) / out_a;
-                            float out_g = (src_g * sa + dst_g * da * (1.0f - sa)) / out_a;
-                            float out_b = (src_b * sa + dst_b * da * (1.0f - sa)) / out_a;
-                            
-                            layers[layer_idx][idx]     = (uint8_t)out_r;
-                            layers[layer_idx][idx + 1] = (uint8_t)out_g;
-                            layers[layer_idx][idx + 2] = (uint8_t)out_b;
-                            layers[layer_idx][idx + 3] = (uint8_t)(out_a * 255.0f);
-                        }
-                    }
-                }
-            });
-        mark_layer_dirty(layer_idx, x, y, effectiveSize);
+        DabBox box = paint_rgba_dab(layers[currentLayerId], availableBrushes[currentBrushId], x, y, dp);
+        mark_layer_box(currentLayerId, box);
     }
 }
 
@@ -760,10 +916,12 @@ void send_udp_line(int x, int y, int ex, int ey, int pressure, int angle) {
     if (udpSock < 0) return;
     if (currentLayerId <= 0) return;
     if (currentLayerId >= MAX_LAYERS || !layers[currentLayerId]) return;
+    DabParams dp = current_dab_params(pressure, angle);
 
     UDPMessage pkt;
     memset(&pkt, 0, sizeof(pkt));
     pkt.type = MSG_LINE;
+    pkt.canvas_id = currentCanvasId;
     pkt.brush_id = currentBrushId;
     pkt.layer_id = currentLayerId;
     pkt.x = x;
@@ -774,10 +932,17 @@ void send_udp_line(int x, int y, int ex, int ey, int pressure, int angle) {
     pkt.g = userColor.g;
     pkt.b = userColor.b;
     pkt.a = userColor.a;
-    pkt.size = (currentBrushId < (int)availableBrushes.size()) ? availableBrushes[currentBrushId]->size : 5;
+    pkt.size = dp.size;
     pkt.pressure = pressure;
+    pkt.opacity = dp.opacity;
     
-    sendto(udpSock, &pkt, sizeof(pkt), 0, (struct sockaddr*)&serverUdpAddr, sizeof(serverUdpAddr));
+    send_udp_op(pkt);
+
+    // Predict it locally the way the server will rasterize it
+    if (currentBrushId < (int)availableBrushes.size()) {
+        DabBox box = paint_rgba_line(layers[currentLayerId], availableBrushes[currentBrushId], x, y, ex, ey, dp);
+        mark_layer_box(currentLayerId, box);
+    }
 }
 
 void send_udp_cursor(int x, int y) {
@@ -797,9 +962,14 @@ void send_udp_cursor(int x, int y) {
     UDPMessage pkt;
     memset(&pkt, 0, sizeof(pkt));
     pkt.type = MSG_CURSOR;
+    pkt.canvas_id = currentCanvasId;
     pkt.x = x;
     pkt.y = y;
     pkt.brush_id = myUserId; // Send our ID in the brush_id field
+    pkt.sender_uid = myUserId;
+    pthread_mutex_lock(&udpSeqMutex);
+    pkt.sender_seq = udpSendSeq; // Newest op, so peers can spot a lost stroke tail
+    pthread_mutex_unlock(&udpSeqMutex);
     pkt.r = userColor.r;
     pkt.g = userColor.g;
     pkt.b = userColor.b;
@@ -809,6 +979,32 @@ void send_udp_cursor(int x, int y) {
     sendto(udpSock, &pkt, sizeof(pkt), 0, (struct sockaddr*)&serverUdpAddr, sizeof(serverUdpAddr));
 }
 
+// Decode a tile list (codec.h) into layers[layer_idx]; caller holds
+// layerMutex. Returns false if the list is truncated or a tile fails to
+// decode, in which case the layer is out of step and needs a resync.
+bool apply_tile_list(int layer_idx, const uint8_t* data, size_t len) {
+    uint32_t tile_count;
+    memcpy(&tile_count, data, sizeof(tile_count));
+    size_t pos = sizeof(tile_count);
+    for (uint32_t t = 0; t < tile_count; t++) {
+        SnapshotTileHeader th;
+        if (pos + sizeof(th) > len) return false;
+        memcpy(&th, data + pos, sizeof(th));
+        pos += sizeof(th);
+        if (th.len > len - pos) return false;
+        
+        int x0 = th.tx * TILE_SIZE, y0 = th.ty * TILE_SIZE;
+        if (x0 < CANVAS_WIDTH && y0 < CANVAS_HEIGHT) {
+            int w = min(TILE_SIZE, CANVAS_WIDTH - x0);
+            int h = min(TILE_SIZE, CANVAS_HEIGHT - y0);
+            if (!decode_snapshot_tile(th, data + pos, layers[layer_idx], CANVAS_WIDTH, x0, y0, w, h)) return false;
+            mark_layer_dirty(layer_idx, x0 + TILE_SIZE / 2, y0 + TILE_SIZE / 2, TILE_SIZE);
+        }
+        pos += th.len;
+    }
+    return true;
+}
+
 /*****************************************************************************
    THREAD FUNCTIONS
  *****************************************************************************/
@@ -856,6 +1052,11 @@ void* tcp_receiver_thread(void* arg) {
                     remote_cursors.erase(msg.user_id);
                 }
                 pthread_mutex_unlock(&remoteClientsMutex);
+                
+                // The UID may be handed to someone else with a new op stream
+                pthread_mutex_lock(&udpSeqMutex);
+                udpRecvWindows[msg.user_id].reset();
+                pthread_mutex_unlock(&udpSeqMutex);
                 break;
 
             case MSG_WELCOME:
@@ -867,9 +1068,18 @@ void* tcp_receiver_thread(void* arg) {
                 loggedin = 1;
                 myUserId = msg.user_id;
                 
+                // New session: our op counter and every author's window start over
+                pthread_mutex_lock(&udpSeqMutex);
+                udpSendSeq = 0;
+                memset(udpSendRing, 0, sizeof(udpSendRing));
+                for (int u = 0; u < 256; u++) udpRecvWindows[u].reset();
+                pthread_mutex_unlock(&udpSeqMutex);
+                
                 pthread_mutex_lock(&layerMutex);
                 layerCount = msg.layer_count > 0 ? msg.layer_count : 2;
                 currentLayerId = 1;
+                // Older servers send no flags: straight alpha
+                premultipliedLayers = msg.data_len >= 1 && (msg.data[0] & WELCOME_PREMULTIPLIED);
                 
                 // Initialize all layers based on layer_count
                 for (int l = 1; l < layerCount && l < MAX_LAYERS; l++) {
@@ -880,36 +1090,75 @@ void* tcp_receiver_thread(void* arg) {
                 }
                 pthread_mutex_unlock(&layerMutex);
                 
-                // Receive layer data from server (skip layer 0 which is white paper)
+                // --- RESIZE WINDOW TO CANVAS MODE (before layers stream in) ---
+                SDL_SetWindowSize(window, CANVAS_WIDTH, CANVAS_HEIGHT);
+                SDL_SetWindowPosition(window, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED);
+                windowWidth = CANVAS_WIDTH;
+                windowHeight = CANVAS_HEIGHT;
+                SetupUI();
+                
+                UpdateLayerButtons();
+                
+                // Receive layer snapshots from server (skip layer 0 which is white paper).
+                // Tiles are decoded as they arrive and each layer is shown as soon
+                // as it is complete; tiles the server leaves out are transparent.
                 {
                     int recv_layer_count;
-                    if (recv(tcpSock, &recv_layer_count, sizeof(int), MSG_WAITALL) == sizeof(int)) {
+                    bool stream_ok = recv(tcpSock, &recv_layer_count, sizeof(int), MSG_WAITALL) == sizeof(int) &&
+                                     recv_layer_count <= MAX_LAYERS;
+                    if (stream_ok) {
                         // printf("[Client][TCP-Thread] Receiving %d layers from server\n", recv_layer_count);
+                        vector<uint8_t> payload;
                         
-                        for (int l = 1; l < recv_layer_count; l++) {
+                        for (int l = 1; l < recv_layer_count && stream_ok; l++) {
                             if (!layers[l]) {
                                 init_layer(l, false);
                             }
+                            memset(layers[l], 0, CANVAS_WIDTH * CANVAS_HEIGHT * 4);
                             
-                            size_t layer_size = CANVAS_WIDTH * CANVAS_HEIGHT * 4;
-                            size_t received = 0;
-                            uint8_t* ptr = layers[l];
-                            
-                            while (received < layer_size) {
-                                ssize_t r = recv(tcpSock, ptr + received, layer_size - received, 0);
-                                if (r <= 0) break;
-                                received += r;
+                            uint32_t tile_count = 0;
+                            if (recv(tcpSock, &tile_count, sizeof(tile_count), MSG_WAITALL) != sizeof(tile_count)) {
+                                stream_ok = false;
+                                break;
+                            }
+                            for (uint32_t t = 0; t < tile_count; t++) {
+                                SnapshotTileHeader th;
+                                if (recv(tcpSock, &th, sizeof(th), MSG_WAITALL) != sizeof(th) ||
+                                    th.len > TILE_MAX_PAYLOAD) {
+                                    stream_ok = false;
+                                    break;
+                                }
+                                payload.resize(th.len);
+                                if (th.len > 0 && recv(tcpSock, payload.data(), th.len, MSG_WAITALL) != (ssize_t)th.len) {
+                                    stream_ok = false;
+                                    break;
+                                }
+                                
+                                int x0 = th.tx * TILE_SIZE, y0 = th.ty * TILE_SIZE;
+                                if (x0 >= CANVAS_WIDTH || y0 >= CANVAS_HEIGHT) continue;
+                                int w = min(TILE_SIZE, CANVAS_WIDTH - x0);
+                                int h = min(TILE_SIZE, CANVAS_HEIGHT - y0);
+                                if (!decode_snapshot_tile(th, payload.data(), layers[l], CANVAS_WIDTH, x0, y0, w, h)) {
+                                    printf("[Client][TCP-Thread] ERROR: Bad tile (%d,%d) in layer %d, requesting resync\n", th.tx, th.ty, l);
+                                    layerResyncWanted[l] = true;
+                                }
                             }
                             
-                            // printf("[Client][TCP-Thread] Received layer %d: %zu bytes\n", l, received);
+                            // printf("[Client][TCP-Thread] Received layer %d: %u tiles\n", l, tile_count);
                             layerIsDirty[l] = true; // Force GPU upload
                             layerDirtyRects[l] = {0, 0, CANVAS_WIDTH, CANVAS_HEIGHT};
                         }
                     }
+                    if (!stream_ok) {
+                        // The rest of the snapshot cannot be skipped safely: the stream is out of step
+                        printf("[Client][TCP-Thread] ERROR: Bad canvas snapshot, disconnecting\n");
+                        shutdown(tcpSock, SHUT_RDWR);
+                        break;
+                    }
                 }
                 
                 // Setup UDP for this canvas
-                if (setup_udp(currentCanvasId) < 0) {
+                if (setup_udp() < 0) {
                     // printf("[Client][TCP-Thread] UDP setup failed!\n");
                 } else {
                     pthread_t udp_tid;
@@ -917,14 +1166,6 @@ void* tcp_receiver_thread(void* arg) {
                     pthread_detach(udp_tid);
                 }
                 
-                // --- RESIZE WINDOW TO CANVAS MODE ---
-                SDL_SetWindowSize(window, CANVAS_WIDTH, CANVAS_HEIGHT);
-                SDL_SetWindowPosition(window, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED);
-                windowWidth = CANVAS_WIDTH;
-                windowHeight = CANVAS_HEIGHT;
-                SetupUI();
-                
-                UpdateLayerButtons();
                 break;
 
             // --- SIGNATURE IMPLEMENTATION START ---
@@ -1058,6 +1299,67 @@ void* tcp_receiver_thread(void* arg) {
                 }
                 break;
 
+            case MSG_LAYER_DELTA:
+                // printf("[Client][TCP-Thread] LAYER_DELTA received: layer=%d\n", msg.layer_id);
+                {
+                    uint32_t len;
+                    memcpy(&len, msg.data, sizeof(len));
+                    if (len < sizeof(uint32_t) || len > MAX_DELTA_BYTES) {
+                        // The payload cannot be skipped safely: the stream is out of step
+                        printf("[Client][TCP-Thread] ERROR: LAYER_DELTA of %u bytes, disconnecting\n", len);
+                        shutdown(tcpSock, SHUT_RDWR);
+                        break;
+                    }
+                    vector<uint8_t> payload(len);
+                    if (recv(tcpSock, payload.data(), len, MSG_WAITALL) != (ssize_t)len) break;
+                    
+                    int layer_idx = msg.layer_id;
+                    if (layer_idx > 0 && layer_idx < MAX_LAYERS) {
+                        pthread_mutex_lock(&layerMutex);
+                        if (!layers[layer_idx]) {
+                            init_layer(layer_idx, false);
+                        }
+                        
+                        if (!apply_tile_list(layer_idx, payload.data(), len)) {
+                            printf("[Client][TCP-Thread] ERROR: Bad LAYER_DELTA for layer %d, requesting resync\n", layer_idx);
+                            layerResyncWanted[layer_idx] = true;
+                        }
+                        pthread_mutex_unlock(&layerMutex);
+                    }
+                }
+                break;
+
+            case MSG_LAYER_RESYNC:
+                // Whole layer as a tile list, in reply to our request
+                {
+                    uint32_t len;
+                    memcpy(&len, msg.data, sizeof(len));
+                    if (len < sizeof(uint32_t) || len > MAX_DELTA_BYTES) {
+                        printf("[Client][TCP-Thread] ERROR: LAYER_RESYNC of %u bytes, disconnecting\n", len);
+                        shutdown(tcpSock, SHUT_RDWR);
+                        break;
+                    }
+                    vector<uint8_t> payload(len);
+                    if (recv(tcpSock, payload.data(), len, MSG_WAITALL) != (ssize_t)len) break;
+                    
+                    int layer_idx = msg.layer_id;
+                    if (layer_idx > 0 && layer_idx < MAX_LAYERS) {
+                        pthread_mutex_lock(&layerMutex);
+                        if (!layers[layer_idx]) {
+                            init_layer(layer_idx, false);
+                        }
+                        memset(layers[layer_idx], 0, CANVAS_WIDTH * CANVAS_HEIGHT * 4);
+                        if (!apply_tile_list(layer_idx, payload.data(), len)) {
+                            // Asking again would likely loop; keep what decoded
+                            printf("[Client][TCP-Thread] ERROR: Resync of layer %d failed to decode\n", layer_idx);
+                        }
+                        layerIsDirty[layer_idx] = true;
+                        layerDirtyRects[layer_idx] = {0, 0, CANVAS_WIDTH, CANVAS_HEIGHT};
+                        pthread_mutex_unlock(&layerMutex);
+                    }
+                }
+                break;
+
             case MSG_LAYER_REORDER:
                 {
                     int old_idx = (uint8_t)msg.data[0];
@@ -1147,8 +1449,11 @@ void* udp_receiver_thread(void* arg) {
         ssize_t n = recvfrom(udpSock, buffer, sizeof(buffer), 0, (struct sockaddr*)&fromAddr, &fromLen);
         if (n <= 0) continue;
 
-        if (n >= (ssize_t)sizeof(UDPMessage)) {
-            UDPMessage* pkt = (UDPMessage*)buffer;
+        // The server may pack several messages into one datagram (broadcast tick)
+        for (ssize_t off = 0; off + (ssize_t)sizeof(UDPMessage) <= n; off += sizeof(UDPMessage)) {
+            UDPMessage* pkt = (UDPMessage*)(buffer + off);
+            if (pkt->canvas_id != (uint8_t)currentCanvasId) continue; // Stale packet from a previous room
+            if (!udp_sequence_incoming(pkt)) continue; // Duplicate, or a NACK we answered
             
             switch (pkt->type) {
 
@@ -1167,72 +1472,13 @@ void* udp_receiver_thread(void* arg) {
                         if (pkt->brush_id < (int)availableBrushes.size()) {
                             SDL_Color col = {pkt->r, pkt->g, pkt->b, pkt->a};
                             int brushSize = pkt->size > 0 ? pkt->size : 5;
-                            bool isEraser = (pkt->brush_id == BRUSH_ERASER_ID);
-                            bool isSoftEraser = (pkt->brush_id == BRUSH_SOFT_ERASER_ID);
                             int angle = pkt->ex;
+                            DabParams dp = {col, brushSize, pkt->pressure, angle, pkt->opacity};
                             
-                            availableBrushes[pkt->brush_id]->paint(pkt->x, pkt->y, col, brushSize, pkt->pressure, angle,
-                                [layer_idx, isEraser, isSoftEraser](int px, int py, SDL_Color c) {
-                                    if (px >= 0 && px < CANVAS_WIDTH && py >= 0 && py < CANVAS_HEIGHT) {
-                                        int idx = (py * CANVAS_WIDTH + px) * 4;
-                                        
-                                        if (isEraser) {
-                                            // Eraser: Overwrite with transparent
-                                            layers[layer_idx][idx]     = 0;
-                                            layers[layer_idx][idx + 1] = 0;
-                                            layers[layer_idx][idx + 2] = 0;
-                                            layers[layer_idx][idx + 3] = 0;
-                                            return;
-                                        }
-
-                                        if (isSoftEraser) {
-                                            uint8_t currentAlpha = layers[layer_idx][idx + 3];
-                                            uint8_t eraseStrength = c.a;
-                                            if (currentAlpha > 0) {
-                                                int newAlpha = (int)currentAlpha - (int)eraseStrength;
-                                                if (newAlpha < 0) newAlpha = 0;
-                                                layers[layer_idx][idx + 3] = (uint8_t)newAlpha;
-                                            }
-                                            return;
-                                        }
-                                        
-                                        // Simple alpha blending with existing pixel
-                                        uint8_t oldR = layers[layer_idx][idx];
-                                        uint8_t oldG = layers[layer_idx][idx + 1];
-                                        uint8_t oldB = layers[layer_idx][idx + 2];
-                                        uint8_t oldA = layers[layer_idx][idx + 3];
-                                        
-                                        // If new pixel is fully opaque, just overwrite
-                                        if (c.a == 255) {
-                                            layers[layer_idx][idx]     = c.r;
-                                            layers[layer_idx][idx + 1] = c.g;
-                                            layers[layer_idx][idx + 2] = c.b;
-                                            layers[layer_idx][idx + 3] = c.a;
-                                        } else {
-                                            // Standard alpha blending: src over dst
-                                            // outA = srcA + dstA * (1 - srcA)
-                                            // outRGB = (srcRGB * srcA + dstRGB * dstA * (1 - srcA)) / outA
-                                            
-                                            float srcA = c.a / 255.0f;
-                                            float dstA = oldA / 255.0f;
-                                            float outA = srcA + dstA * (1.0f - srcA);
-                                            
-                                            if (outA > 0.0f) {
-                                                float outR = (c.r * srcA + oldR * dstA * (1.0f - srcA)) / outA;
-                                                float outG = (c.g * srcA + oldG * dstA * (1.0f - srcA)) / outA;
-                                                float outB = (c.b * srcA + oldB * dstA * (1.0f - srcA)) / outA;
-                                                
-                                                layers[layer_idx][idx]     = (uint8_t)outR;
-                                                layers[layer_idx][idx + 1] = (uint8_t)outG;
-                                                layers[layer_idx][idx + 2] = (uint8_t)outB;
-                                                layers[layer_idx][idx + 3] = (uint8_t)(outA * 255.0f);
-                                            }
-                                        }
-                                    }
-                                });
+                            DabBox box = paint_rgba_dab(layers[layer_idx], availableBrushes[pkt->brush_id], pkt->x, pkt->y, dp);
                             
                             pthread_mutex_lock(&layerMutex);
-                            mark_layer_dirty(layer_idx, pkt->x, pkt->y, brushSize);
+                            mark_layer_box(layer_idx, box);
                             pthread_mutex_unlock(&layerMutex);
                         }
                     }
@@ -1247,76 +1493,12 @@ void* udp_receiver_thread(void* arg) {
                         if (pkt->brush_id < (int)availableBrushes.size()) {
                             SDL_Color col = {pkt->r, pkt->g, pkt->b, pkt->a};
                             int brushSize = pkt->size > 0 ? pkt->size : 5;
-                            bool isEraser = (pkt->brush_id == BRUSH_ERASER_ID);
-                            bool isSoftEraser = (pkt->brush_id == BRUSH_SOFT_ERASER_ID);
-                            int angle = (int)(atan2(pkt->ey - pkt->y, pkt->ex - pkt->x) * 180.0 / M_PI);
-
-                            // Bresenham / Interpolation Loop
-                            int x0 = pkt->x, y0 = pkt->y;
-                            int x1 = pkt->ex, y1 = pkt->ey;
-                            int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
-                            int dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
-                            int err = dx + dy, e2;
-
-                            auto setPixel = [layer_idx, isEraser, isSoftEraser](int px, int py, SDL_Color c) {
-                                if (px >= 0 && px < CANVAS_WIDTH && py >= 0 && py < CANVAS_HEIGHT) {
-                                    int idx = (py * CANVAS_WIDTH + px) * 4;
-                                    if (isEraser) {
-                                        layers[layer_idx][idx] = layers[layer_idx][idx+1] = layers[layer_idx][idx+2] = layers[layer_idx][idx+3] = 0;
-                                        return;
-                                    }
-                                    if (isSoftEraser) {
-                                        uint8_t currentAlpha = layers[layer_idx][idx + 3];
-                                        uint8_t eraseStrength = c.a;
-                                        if (currentAlpha > 0) {
-                                            int newAlpha = (int)currentAlpha - (int)eraseStrength;
-                                            if (newAlpha < 0) newAlpha = 0;
-                                            layers[layer_idx][idx + 3] = (uint8_t)newAlpha;
-                                        }
-                                        return;
-                                    }
-                                    // Blending
-                                    uint8_t oldR = layers[layer_idx][idx];
-                                    uint8_t oldG = layers[layer_idx][idx + 1];
-                                    uint8_t oldB = layers[layer_idx][idx + 2];
-                                    uint8_t oldA = layers[layer_idx][idx + 3];
-                                    
-                                    if (c.a == 255) {
-                                        layers[layer_idx][idx] = c.r; layers[layer_idx][idx+1] = c.g; layers[layer_idx][idx+2] = c.b; layers[layer_idx][idx+3] = c.a;
-                                    } else {
-                                        float srcA = c.a / 255.0f;
-                                        float dstA = oldA / 255.0f;
-                                        float outA = srcA + dstA * (1.0f - srcA);
-                                        if (outA > 0.0f) {
-                                            float outR = (c.r * srcA + oldR * dstA * (1.0f - srcA)) / outA;
-                                            float outG = (c.g * srcA + oldG * dstA * (1.0f - srcA)) / outA;
-                                            float outB = (c.b * srcA + oldB * dstA * (1.0f - srcA)) / outA;
-                                            layers[layer_idx][idx] = (uint8_t)outR;
-                                            layers[layer_idx][idx+1] = (uint8_t)outG;
-                                            layers[layer_idx][idx+2] = (uint8_t)outB;
-                                            layers[layer_idx][idx+3] = (uint8_t)(outA * 255.0f);
-                                        }
-                                    }
-                                }
-                            };
-
-                            while (true) {
-                                availableBrushes[pkt->brush_id]->paint(x0, y0, col, brushSize, pkt->pressure, angle, setPixel);
-                                if (x0 == x1 && y0 == y1) break;
-                                e2 = 2 * err;
-                                if (e2 >= dy) { err += dy; x0 += sx; }
-                                if (e2 <= dx) { err += dx; y0 += sy; }
-                            }
+                            DabParams dp = {col, brushSize, pkt->pressure, 0, pkt->opacity};
+                            DabBox box = paint_rgba_line(layers[layer_idx], availableBrushes[pkt->brush_id],
+                                                         pkt->x, pkt->y, pkt->ex, pkt->ey, dp);
 
                             pthread_mutex_lock(&layerMutex);
-                            // Mark the bounding box of the line as dirty
-                            int minX = min(pkt->x, pkt->ex) - brushSize;
-                            int minY = min(pkt->y, pkt->ey) - brushSize;
-                            int w = abs(pkt->ex - pkt->x) + brushSize * 2;
-                            int h = abs(pkt->ey - pkt->y) + brushSize * 2;
-                            mark_layer_dirty(layer_idx, pkt->x, pkt->y, brushSize);
-                            mark_layer_dirty(layer_idx, pkt->ex, pkt->ey, brushSize);
-                            mark_layer_dirty(layer_idx, (pkt->x + pkt->ex)/2, (pkt->y + pkt->ey)/2, brushSize);
+                            mark_layer_box(layer_idx, box);
                             pthread_mutex_unlock(&layerMutex);
                         }
                     }
@@ -1460,48 +1642,6 @@ uint32_t lastMenuAnimTime = 0;
 int currentMenuFrame = 0; // 0 = Frame A (Layer 13), 1 = Frame B (Layer 14)
 
 // --- HELPER FUNCTIONS FOR LOADING UI.JSON ---
-static const string b64_chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-
-bool is_base64(unsigned char c) {
-    return (isalnum(c) || (c == '+') || (c == '/'));
-}
-
-vector<unsigned char> base64_decode(const string& encoded_string) {
-    int in_len = encoded_string.size();
-    int i = 0, j = 0, in_ = 0;
-    unsigned char char_array_4[4], char_array_3[3];
-    vector<unsigned char> ret;
-
-    while (in_len-- && encoded_string[in_] != '=' && is_base64(encoded_string[in_])) {
-        char_array_4[i++] = encoded_string[in_]; in_++;
-        if (i == 4) {
-            for (i = 0; i < 4; i++)
-                char_array_4[i] = b64_chars.find(char_array_4[i]);
-
-            char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-            char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-            char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
-
-            for (i = 0; i < 3; i++)
-                ret.push_back(char_array_3[i]);
-            i = 0;
-        }
-    }
-
-    if (i) {
-        for (j = i; j < 4; j++) char_array_4[j] = 0;
-        for (j = 0; j < 4; j++) char_array_4[j] = b64_chars.find(char_array_4[j]);
-
-        char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-        char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-        char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
-
-        for (j = 0; j < i - 1; j++) ret.push_back(char_array_3[j]);
-    }
-
-    return ret;
-}
-
 vector<uint8_t> packbits_decompress(const vector<uint8_t>& in) {
     vector<uint8_t> out;
     size_t i = 0;
@@ -1551,10 +1691,10 @@ void load_menu_ui() {
     while ((pos = json.find("\"data\":", pos)) != string::npos) {
         size_t start = json.find("\"", pos + 7) + 1;
         size_t end = json.find("\"", start);
-        string b64 = json.substr(start, end - start);
         
         // Decode
-        vector<unsigned char> compressed = base64_decode(b64);
+        vector<uint8_t> compressed(base64_decoded_size(end - start));
+        compressed.resize(base64_decode(json.data() + start, end - start, compressed.data()));
         vector<uint8_t> data = packbits_decompress(compressed);
         
         // FIX: Check against MENU dimensions, not CANVAS dimensions
@@ -1605,21 +1745,10 @@ void update_menu_texture() {
     if (currentMenuFrame == 0) animLayerIdx = 12; // Layer 13
     else animLayerIdx = 13;                       // Layer 14
 
-    // Helper to blend
+    // Helper to blend (menu layers are straight alpha; alpha stays 255 over the opaque bg)
     auto blend = [&](int layerIdx) {
         if (layerIdx >= menuLayers.size()) return;
-        uint8_t* src = menuLayers[layerIdx].pixels;
-        for (int i = 0; i < MENU_WIDTH * MENU_HEIGHT * 4; i+=4) {
-            uint8_t srcA = src[i+3];
-            if (srcA == 0) continue;
-            
-            // Simple alpha blend over composite
-            float a = srcA / 255.0f;
-            composite[i]   = (uint8_t)(src[i] * a   + composite[i] * (1-a));
-            composite[i+1] = (uint8_t)(src[i+1] * a + composite[i+1] * (1-a));
-            composite[i+2] = (uint8_t)(src[i+2] * a + composite[i+2] * (1-a));
-            // Alpha stays 255 (opaque bg)
-        }
+        blend_row(composite, menuLayers[layerIdx].pixels, MENU_WIDTH * MENU_HEIGHT);
     };
 
     // Blend Static Layers
@@ -1717,31 +1846,12 @@ void download_as_bmp() {
         compositeCanvas[i + 3] = 255;
     }
     
-    // 2. Blend all other layers
+    // 2. Blend all other layers. Over the opaque background the result is
+    // opaque, so premultiplied layers need no conversion for export.
     for (int l = 1; l < layerCount; l++) {
-        if (layers[l]) {
-            for (int i = 0; i < CANVAS_WIDTH * CANVAS_HEIGHT * 4; i += 4) {
-                uint8_t srcA = layers[l][i + 3];
-                if (srcA == 0) continue;
-                
-                uint8_t srcR = layers[l][i];
-                uint8_t srcG = layers[l][i + 1];
-                uint8_t srcB = layers[l][i + 2];
-                
-                if (srcA == 255) {
-                    compositeCanvas[i]     = srcR;
-                    compositeCanvas[i + 1] = srcG;
-                    compositeCanvas[i + 2] = srcB;
-                    compositeCanvas[i + 3] = 255;
-                } else {
-                    // Simple alpha blend over opaque background
-                    float a = srcA / 255.0f;
-                    compositeCanvas[i]     = (uint8_t)(srcR * a + compositeCanvas[i] * (1.0f - a));
-                    compositeCanvas[i + 1] = (uint8_t)(srcG * a + compositeCanvas[i + 1] * (1.0f - a));
-                    compositeCanvas[i + 2] = (uint8_t)(srcB * a + compositeCanvas[i + 2] * (1.0f - a));
-                }
-            }
-        }
+        if (!layers[l]) continue;
+        if (premultipliedLayers) blend_row_pm(compositeCanvas, layers[l], CANVAS_WIDTH * CANVAS_HEIGHT);
+        else blend_row(compositeCanvas, layers[l], CANVAS_WIDTH * CANVAS_HEIGHT);
     }
     
     // Generate filename with timestamp
@@ -1800,9 +1910,7 @@ void init_brushes() {
     availableBrushes.push_back(new Airbrush());         // 5
     availableBrushes.push_back(new TexturedBrush());    // 6
     
-    for (int i = 0; i < (int)availableBrushes.size(); i++) {
-        availableBrushes[i]->size = 15;
-    }
+    brushSettings.assign(availableBrushes.size(), BrushSettings{15, 255});
     
     // printf("[Client][Brushes] %zu brushes loaded\n", availableBrushes.size());
 }
@@ -1812,33 +1920,18 @@ SDL_Color get_composite_pixel(int x, int y) {
     if (x < 0 || x >= CANVAS_WIDTH || y < 0 || y >= CANVAS_HEIGHT) return c;
     
     int idx = (y * CANVAS_WIDTH + x) * 4;
-    float r = 255.0f, g = 255.0f, b = 255.0f; // Start with white background
+    uint8_t px[4] = {255, 255, 255, 255}; // Start with white background
     
-    // Iterate all layers (0 is paper, usually opaque white)
+    // Iterate all layers (0 is paper, usually opaque white); px stays opaque
     for (int i = 0; i < layerCount; i++) {
-        if (layers[i]) {
-            uint8_t srcR = layers[i][idx];
-            uint8_t srcG = layers[i][idx+1];
-            uint8_t srcB = layers[i][idx+2];
-            uint8_t srcA = layers[i][idx+3];
-            
-            if (srcA == 0) continue;
-            
-            if (srcA == 255) {
-                r = srcR; g = srcG; b = srcB;
-            } else {
-                float sa = srcA / 255.0f;
-                r = srcR * sa + r * (1.0f - sa);
-                g = srcG * sa + g * (1.0f - sa);
-                b = srcB * sa + b * (1.0f - sa);
-            }
-        }
+        if (!layers[i]) continue;
+        if (premultipliedLayers) blend_pixel_pm(px, layers[i] + idx);
+        else blend_pixel(px, layers[i] + idx);
     }
     
-    c.r = (uint8_t)r;
-    c.g = (uint8_t)g;
-    c.b = (uint8_t)b;
-    c.a = 255;
+    c.r = px[0];
+    c.g = px[1];
+    c.b = px[2];
     return c;
 }
 
@@ -1885,63 +1978,6 @@ void move_layer_local(int layer_id, int dx, int dy) {
     layerDirtyRects[layer_id] = {0, 0, CANVAS_WIDTH, CANVAS_HEIGHT};
 }
 
-void draw_brush(int x, int y, SDL_Color color, int size, int pressure, int angle) {
-    if (currentBrushId < 0 || currentBrushId >= (int)availableBrushes.size()) return;
-    
-    bool isEraser = (currentBrushId == BRUSH_ERASER_ID);
-    bool isSoftEraser = (currentBrushId == BRUSH_SOFT_ERASER_ID);
-    
-    availableBrushes[currentBrushId]->paint(x, y, color, size, pressure, angle,
-        [isEraser, isSoftEraser](int px, int py, SDL_Color c) {
-            if (px >= 0 && px < CANVAS_WIDTH && py >= 0 && py < CANVAS_HEIGHT) {
-                int idx = (py * CANVAS_WIDTH + px) * 4;
-                
-                if (isEraser) {
-                    layers[currentLayerId][idx]     = 0;
-                    layers[currentLayerId][idx + 1] = 0;
-                    layers[currentLayerId][idx + 2] = 0;
-                    layers[currentLayerId][idx + 3] = 0;
-                    mark_layer_dirty(currentLayerId, px, py, 1);
-                    return;
-                }
-
-                if (isSoftEraser) {
-                    uint8_t currentAlpha = layers[currentLayerId][idx + 3];
-                    uint8_t eraseStrength = c.a;
-                    if (currentAlpha > 0) {
-                        int newAlpha = (int)currentAlpha - (int)eraseStrength;
-                        if (newAlpha < 0) newAlpha = 0;
-                        layers[currentLayerId][idx + 3] = (uint8_t)newAlpha;
-                        mark_layer_dirty(currentLayerId, px, py, 1);
-                    }
-                    return;
-                }
-                
-                // Correct Alpha Blending (Accumulation)
-                uint8_t oldR = layers[currentLayerId][idx];
-                uint8_t oldG = layers[currentLayerId][idx + 1];
-                uint8_t oldB = layers[currentLayerId][idx + 2];
-                uint8_t oldA = layers[currentLayerId][idx + 3];
-
-                float sa = c.a / 255.0f;
-                float da = oldA / 255.0f;
-                float na = sa + da * (1.0f - sa);
-                
-                if (na > 0.0f) {
-                    float r = (c.r * sa + oldR * da * (1.0f - sa)) / na;
-                    float g = (c.g * sa + oldG * da * (1.0f - sa)) / na;
-                    float b = (c.b * sa + oldB * da * (1.0f - sa)) / na;
-                    
-                    layers[currentLayerId][idx]     = (uint8_t)min(255.0f, r);
-                    layers[currentLayerId][idx + 1] = (uint8_t)min(255.0f, g);
-                    layers[currentLayerId][idx + 2] = (uint8_t)min(255.0f, b);
-                    layers[currentLayerId][idx + 3] = (uint8_t)min(255.0f, na * 255.0f);
-                }
-                mark_layer_dirty(currentLayerId, px, py, 1);
-            }
-        });
-}
-
 void handle_events() {
     SDL_Event e;
     while (SDL_PollEvent(&e)) {
@@ -2358,22 +2394,10 @@ void handle_events() {
                             // Use the stabilized angle
                             int angle = lastStableAngle;
                             
-                            // Send LINE packet to server (Optimization: One packet instead of many)
+                            // Send LINE packet to server (Optimization: One packet instead of many),
+                            // drawing it locally too
                             send_udp_line(lastMouseX - viewOffsetX, lastMouseY - viewOffsetY, 
                                           mx - viewOffsetX, my - viewOffsetY, pressure, angle);
-
-                            // Interpolate LOCALLY for immediate feedback
-                            int steps = max(abs(dx), abs(dy));
-                            if (steps > 0) {
-                                for (int i = 1; i <= steps; i++) {
-                                    int ix = lastMouseX + (dx * i) / steps;
-                                    int iy = lastMouseY + (dy * i) / steps;
-                                    // Draw locally only (don't send network)
-                                    draw_brush(ix - viewOffsetX, iy - viewOffsetY, userColor, 
-                                               (currentBrushId < (int)availableBrushes.size()) ? availableBrushes[currentBrushId]->size : 5, 
-                                               pressure, angle);
-                                }
-                            }
                             
                             lastMouseX = mx;
                             lastMouseY = my;
@@ -2417,16 +2441,16 @@ void handle_events() {
                     }
                     else if (e.key.keysym.sym == SDLK_q) {
                         if (currentBrushId >= 0 && currentBrushId < (int)availableBrushes.size()) {
-                            if (availableBrushes[currentBrushId]->size > 1) {
-                                availableBrushes[currentBrushId]->size--;
-                                // printf("[Client][UI] Brush size decreased to %d\n", availableBrushes[currentBrushId]->size);
+                            if (brushSettings[currentBrushId].size > 1) {
+                                brushSettings[currentBrushId].size--;
+                                // printf("[Client][UI] Brush size decreased to %d\n", brushSettings[currentBrushId].size);
                             }
                         }
                     } else if (e.key.keysym.sym == SDLK_w) {
                         if (currentBrushId >= 0 && currentBrushId < (int)availableBrushes.size()) {
-                            if (availableBrushes[currentBrushId]->size < 150) {
-                                availableBrushes[currentBrushId]->size++;
-                                // printf("[Client][UI] Brush size increased to %d\n", availableBrushes[currentBrushId]->size);
+                            if (brushSettings[currentBrushId].size < 150) {
+                                brushSettings[currentBrushId].size++;
+                                // printf("[Client][UI] Brush size increased to %d\n", brushSettings[currentBrushId].size);
                             }
                         }
                     }
@@ -2495,9 +2519,9 @@ void handle_events() {
                         } else {
                             // Increase opacity
                             if (currentBrushId >= 0 && currentBrushId < (int)availableBrushes.size()) {
-                                int op = availableBrushes[currentBrushId]->opacity;
+                                int op = brushSettings[currentBrushId].opacity;
                                 op = min(255, op + 10);
-                                availableBrushes[currentBrushId]->opacity = op;
+                                brushSettings[currentBrushId].opacity = op;
                                 //printf("[Client][Brush] Opacity increased to %d\n", op);
                             }
                         }
@@ -2505,9 +2529,9 @@ void handle_events() {
                     case SDLK_a:
                         // Decrease opacity
                         if (currentBrushId >= 0 && currentBrushId < (int)availableBrushes.size()) {
-                            int op = availableBrushes[currentBrushId]->opacity;
+                            int op = brushSettings[currentBrushId].opacity;
                             op = max(0, op - 10);
-                            availableBrushes[currentBrushId]->opacity = op;
+                            brushSettings[currentBrushId].opacity = op;
                             //printf("[Client][Brush] Opacity decreased to %d\n", op);
                         }
                         break;
@@ -2793,6 +2817,14 @@ int main(int argc, char* argv[]) {
             pendingLayerUpdate = false;
             UpdateLayerButtons();
         }
+        
+        // Ask the server again for layers we failed to decode
+        for (int l = 1; l < MAX_LAYERS; l++) {
+            if (layerResyncWanted[l]) {
+                layerResyncWanted[l] = false;
+                send_tcp(MSG_LAYER_RESYNC, l);
+            }
+        }
 
         // Clean expired undo/redo commands
         clean_expired_commands();
@@ -2907,6 +2939,14 @@ int main(int argc, char* argv[]) {
 
     // printf("[Client][Main] Shutting down...\n");
 
+    // Dab stamp cache over the session (brushes.h), like the server's stats line
+    uint64_t st_hits = stamp_hits.load(), st_dabs = st_hits + stamp_misses.load();
+    if (st_dabs > 0) {
+        printf("[Client][Stats][Stamps] %.1f%% hits (%llu / %llu dabs), %llu evicted\n",
+               100.0 * st_hits / st_dabs, (unsigned long long)st_hits, (unsigned long long)st_dabs,
+               (unsigned long long)stamp_evictions.load());
+    }
+
     if (use_raw_input) {
         RawInput_Stop();
     }
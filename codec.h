@@ -0,0 +1,254 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+// Tile codecs shared by server and client (join snapshots, layer deltas).
+
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+#define TILE_SIZE 64
+#define TILE_PIXELS (TILE_SIZE * TILE_SIZE)
+#define TILE_MAX_PAYLOAD (TILE_PIXELS * 4 + TILE_PIXELS / 128 + 1 + TILE_SIZE * 2) // Worst case of either codec
+
+// Per-tile encodings
+enum TileCodec {
+    TILE_CODEC_FILL = 0, // Payload: one RGBA pixel repeated over the tile
+    TILE_CODEC_RLE = 1,  // Payload: pixel RLE (see rle_encode_pixels)
+    TILE_CODEC_ROWS = 2  // Payload: per-row modes (see rows_encode_pixels)
+};
+
+// TILE_CODEC_ROWS: every row starts with one of these
+enum RowMode {
+    ROW_CLEAR = 0,   // All pixels 0x00000000, nothing follows
+    ROW_REPEAT = 1,  // Same as the row above, nothing follows
+    ROW_RLE = 2,     // Pixel RLE of the row
+    ROW_DELTA = 3    // Pixel RLE of (row - row above), per byte, wrapping
+};
+
+// Tile list, used for the join snapshot (one per drawable layer; tiles that
+// are not listed are fully transparent) and for MSG_LAYER_DELTA (listed
+// tiles replace the layer's, the rest stay as they are):
+//   uint32_t tile_count
+//   tile_count x { SnapshotTileHeader, payload[len] }
+struct SnapshotTileHeader {
+    uint8_t  tx, ty;   // Tile column / row
+    uint8_t  codec;    // TileCodec
+    uint8_t  reserved;
+    uint32_t len;      // Payload bytes
+} __attribute__((packed));
+
+// Pixel RLE over a linear run of RGBA pixels. Control byte c:
+//   c < 128  -> c+1 literal pixels follow (4 bytes each)
+//   c >= 128 -> next pixel repeats (c - 127) times (1..128)
+inline void rle_encode_pixels(const uint32_t* px, int count, std::vector<uint8_t>& out) {
+    int i = 0;
+    while (i < count) {
+        int run = 1;
+        while (i + run < count && run < 128 && px[i + run] == px[i]) run++;
+        if (run >= 2) {
+            out.push_back((uint8_t)(127 + run));
+            const uint8_t* p = (const uint8_t*)&px[i];
+            out.insert(out.end(), p, p + 4);
+            i += run;
+            continue;
+        }
+
+        // Literals until the next run of 2+ (or 128 pixels)
+        int j = i;
+        while (j < count && j - i < 128) {
+            if (j + 1 < count && px[j] == px[j + 1]) break;
+            j++;
+        }
+        out.push_back((uint8_t)(j - i - 1));
+        const uint8_t* p = (const uint8_t*)&px[i];
+        out.insert(out.end(), p, p + (j - i) * 4);
+        i = j;
+    }
+}
+
+// Decode RLE from in[*pos] until exactly count pixels are produced.
+// Returns false if the stream runs out or a run overshoots.
+inline bool rle_decode_some(const uint8_t* in, size_t len, size_t* pos_io, uint32_t* px, int count) {
+    size_t pos = *pos_io;
+    int n = 0;
+    while (n < count) {
+        if (pos >= len) return false;
+        uint8_t c = in[pos++];
+        if (c >= 128) {
+            int run = c - 127;
+            if (pos + 4 > len || n + run > count) return false;
+            uint32_t v;
+            memcpy(&v, in + pos, 4);
+            pos += 4;
+            for (int k = 0; k < run; k++) px[n++] = v;
+        } else {
+            int lit = c + 1;
+            if (pos + (size_t)lit * 4 > len || n + lit > count) return false;
+            memcpy(&px[n], in + pos, lit * 4);
+            pos += lit * 4;
+            n += lit;
+        }
+    }
+    *pos_io = pos;
+    return true;
+}
+
+// Returns false if the stream is malformed or does not produce exactly count pixels
+inline bool rle_decode_pixels(const uint8_t* in, size_t len, uint32_t* px, int count) {
+    size_t pos = 0;
+    int n = 0;
+    while (pos < len) {
+        uint8_t c = in[pos++];
+        if (c >= 128) {
+            int run = c - 127;
+            if (pos + 4 > len || n + run > count) return false;
+            uint32_t v;
+            memcpy(&v, in + pos, 4);
+            pos += 4;
+            for (int k = 0; k < run; k++) px[n++] = v;
+        } else {
+            int lit = c + 1;
+            if (pos + (size_t)lit * 4 > len || n + lit > count) return false;
+            memcpy(&px[n], in + pos, lit * 4);
+            pos += lit * 4;
+            n += lit;
+        }
+    }
+    return n == count;
+}
+
+// Per-byte difference of two pixels (row prediction), and its inverse.
+// Bytes are subtracted independently so no borrow crosses channels.
+inline uint32_t pixel_sub(uint32_t a, uint32_t b) {
+    return (((a | 0x80808080u) - (b & 0x7f7f7f7fu)) ^ ((a ^ ~b) & 0x80808080u));
+}
+
+inline uint32_t pixel_add(uint32_t a, uint32_t b) {
+    return ((a & 0x7f7f7f7fu) + (b & 0x7f7f7f7fu)) ^ ((a ^ b) & 0x80808080u);
+}
+
+// TILE_CODEC_ROWS over w x h row-major pixels. Transparent and repeated rows
+// cost one byte; other rows are RLE'd as they are or as their difference
+// from the row above (gradients, soft brush edges), whichever is smaller.
+inline void rows_encode_pixels(const uint32_t* px, int w, int h, std::vector<uint8_t>& out) {
+    uint32_t delta[TILE_SIZE];
+    std::vector<uint8_t> diff;
+    for (int y = 0; y < h; y++) {
+        const uint32_t* row = px + y * w;
+        const uint32_t* up = row - w;
+        bool clear = true;
+        for (int x = 0; x < w && clear; x++) clear = row[x] == 0;
+        if (clear) {
+            out.push_back(ROW_CLEAR);
+            continue;
+        }
+        if (y > 0 && memcmp(row, up, w * 4) == 0) {
+            out.push_back(ROW_REPEAT);
+            continue;
+        }
+        
+        size_t mode_pos = out.size();
+        out.push_back(ROW_RLE);
+        rle_encode_pixels(row, w, out);
+        size_t plain_len = out.size() - mode_pos - 1;
+        if (y == 0 || plain_len <= 5) continue; // A single run can't get smaller
+        
+        diff.clear();
+        for (int x = 0; x < w; x++) delta[x] = pixel_sub(row[x], up[x]);
+        rle_encode_pixels(delta, w, diff);
+        if (diff.size() < plain_len) {
+            out.resize(mode_pos);
+            out.push_back(ROW_DELTA);
+            out.insert(out.end(), diff.begin(), diff.end());
+        }
+    }
+}
+
+inline bool rows_decode_pixels(const uint8_t* in, size_t len, uint32_t* px, int w, int h) {
+    size_t pos = 0;
+    for (int y = 0; y < h; y++) {
+        if (pos >= len) return false;
+        uint32_t* row = px + y * w;
+        const uint32_t* up = row - w;
+        uint8_t mode = in[pos++];
+        if (mode == ROW_CLEAR) {
+            memset(row, 0, w * 4);
+        } else if (mode == ROW_RLE) {
+            if (!rle_decode_some(in, len, &pos, row, w)) return false;
+        } else if (y > 0 && mode == ROW_REPEAT) {
+            memcpy(row, up, w * 4);
+        } else if (y > 0 && mode == ROW_DELTA) {
+            if (!rle_decode_some(in, len, &pos, row, w)) return false;
+            for (int x = 0; x < w; x++) row[x] = pixel_add(row[x], up[x]);
+        } else {
+            return false;
+        }
+    }
+    return pos == len;
+}
+
+// Append the payload of a non-uniform tile (w x h pixels) in the given codec
+inline void encode_tile_pixels(const uint32_t* px, int w, int h, uint8_t codec, std::vector<uint8_t>& out) {
+    if (codec == TILE_CODEC_ROWS) rows_encode_pixels(px, w, h, out);
+    else rle_encode_pixels(px, w * h, out);
+}
+
+// Append one tile of a row-major RGBA image (width img_w) to a tile list,
+// as TILE_CODEC_FILL when uniform, otherwise TILE_CODEC_ROWS.
+// (x0, y0, w, h) is the tile's clipped rectangle.
+inline void encode_snapshot_tile(const uint8_t* img, int img_w, int tx, int ty,
+                                 int x0, int y0, int w, int h, std::vector<uint8_t>& out) {
+    uint32_t px[TILE_PIXELS];
+    bool uniform = true;
+    for (int y = 0; y < h; y++) {
+        memcpy(&px[y * w], img + ((size_t)(y0 + y) * img_w + x0) * 4, w * 4);
+    }
+    for (int i = 1; i < w * h && uniform; i++) uniform = px[i] == px[0];
+
+    SnapshotTileHeader th;
+    th.tx = tx;
+    th.ty = ty;
+    th.reserved = 0;
+    size_t hdr_pos = out.size();
+    out.resize(hdr_pos + sizeof(th));
+    if (uniform) {
+        th.codec = TILE_CODEC_FILL;
+        const uint8_t* p = (const uint8_t*)&px[0];
+        out.insert(out.end(), p, p + 4);
+    } else {
+        th.codec = TILE_CODEC_ROWS;
+        rows_encode_pixels(px, w, h, out);
+    }
+    th.len = out.size() - hdr_pos - sizeof(th);
+    memcpy(&out[hdr_pos], &th, sizeof(th));
+}
+
+// Decode one snapshot tile into a row-major RGBA image of width img_w.
+// (x0, y0, w, h) is the tile's clipped rectangle.
+inline bool decode_snapshot_tile(const SnapshotTileHeader& th, const uint8_t* payload,
+                                 uint8_t* img, int img_w, int x0, int y0, int w, int h) {
+    uint32_t px[TILE_PIXELS];
+    if (th.codec == TILE_CODEC_FILL) {
+        if (th.len != 4) return false;
+        uint32_t v;
+        memcpy(&v, payload, 4);
+        for (int i = 0; i < w; i++) px[i] = v;
+        for (int y = 0; y < h; y++) {
+            memcpy(img + ((size_t)(y0 + y) * img_w + x0) * 4, px, w * 4);
+        }
+        return true;
+    }
+    if (th.codec == TILE_CODEC_RLE || th.codec == TILE_CODEC_ROWS) {
+        bool ok = th.codec == TILE_CODEC_RLE ? rle_decode_pixels(payload, th.len, px, w * h)
+                                             : rows_decode_pixels(payload, th.len, px, w, h);
+        if (!ok) return false;
+        for (int y = 0; y < h; y++) {
+            memcpy(img + ((size_t)(y0 + y) * img_w + x0) * 4, &px[y * w], w * 4);
+        }
+        return true;
+    }
+    return false;
+}
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef SEQWIN_H
+#define SEQWIN_H
+
+// Per-sender sequence tracking for the UDP stroke stream (server and client).
+// Draw/line ops carry the author's 16-bit sender_seq; a SeqWindow per author
+// drops duplicates and reports the ops that never arrived so they can be
+// NACKed.
+
+#include <cstdint>
+
+#define SEQ_WINDOW 64      // Ops behind the newest that can still be repaired
+#define SEQ_MAX_RUNS 8     // Missing runs reported per missing() call
+
+struct SeqWindow {
+    bool     started;
+    uint16_t max_seq;  // Newest sequence seen
+    uint64_t seen;     // Bit i set: (max_seq - i) has arrived
+
+    SeqWindow() : started(false), max_seq(0), seen(0) {}
+
+    void reset() { started = false; }
+
+    // Record an arriving op. Returns false for a duplicate or an op too old
+    // to track. If seq skips ahead, the skipped ops are [gap_first, +gap_count).
+    bool accept(uint16_t seq, uint16_t* gap_first, int* gap_count) {
+        *gap_count = 0;
+        if (!started) {
+            // Nothing before the first op we see can be asked for
+            started = true;
+            max_seq = seq;
+            seen = ~0ull;
+            return true;
+        }
+
+        int d = (int16_t)(uint16_t)(seq - max_seq);
+        if (d > 0) {
+            seen = d >= SEQ_WINDOW ? 0 : seen << d;
+            seen |= 1;
+            int missing = d - 1;
+            if (missing > SEQ_WINDOW - 1) missing = SEQ_WINDOW - 1;
+            *gap_first = (uint16_t)(seq - missing);
+            *gap_count = missing;
+            max_seq = seq;
+            return true;
+        }
+
+        int back = -d;
+        if (back >= SEQ_WINDOW) return false;
+        uint64_t bit = 1ull << back;
+        if (seen & bit) return false;
+        seen |= bit;
+        return true;
+    }
+
+    // The author says its newest op is `last` (sent with MSG_CURSOR). Lists
+    // the runs still missing up to it, oldest first. Returns the run count.
+    int missing(uint16_t last, uint16_t* firsts, int* counts) const {
+        if (!started) return 0;
+        int runs = 0;
+        int run_len = 0;
+        uint16_t run_first = 0;
+
+        int ahead = (int16_t)(uint16_t)(last - max_seq);
+        if (ahead < 0) ahead = 0;
+        if (ahead > SEQ_WINDOW - 1) ahead = SEQ_WINDOW - 1;
+
+        // Walk from the oldest tracked op up to `last`
+        for (int i = SEQ_WINDOW - 1; i >= -ahead; i--) {
+            bool have = i >= 0 && (seen & (1ull << i));
+            uint16_t seq = (uint16_t)(max_seq - i);
+            if (!have) {
+                if (run_len == 0) run_first = seq;
+                run_len++;
+            } else if (run_len > 0) {
+                firsts[runs] = run_first;
+                counts[runs] = run_len;
+                run_len = 0;
+                if (++runs == SEQ_MAX_RUNS) return runs;
+            }
+        }
+        if (run_len > 0) {
+            firsts[runs] = run_first;
+            counts[runs] = run_len;
+            runs++;
+        }
+        return runs;
+    }
+};
+
+#endif
@@ -10,23 +10,60 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <vector>
 #include <string>
 #include <map>
 #include <algorithm>
+#include <functional>
 #include <stdint.h>
+#include <atomic>
+#include <memory>
 
 #ifndef SERVER_SIDE
 #define SERVER_SIDE
 #endif
 #include "brushes.h"
+#include "blend.h"
+#include "codec.h"
+#include "base64.h"
+#include "seqwin.h"
 
 using namespace std;
 
 #define PORT 6769
+#define UDP_PORT (PORT + 1)   // Shared by every canvas; rooms are told apart by UDPMessage::canvas_id
+#define MAX_CANVASES 256      // canvas_id is a uint8_t on the wire
+#define MAX_UDP_WORKERS 16
 #define WIDTH 1280
 #define HEIGHT 720
 #define MAX_LAYERS 15
+#define LAYER_BYTES (WIDTH * HEIGHT * 4)
+#define TILES_X ((WIDTH + TILE_SIZE - 1) / TILE_SIZE)
+#define TILES_Y ((HEIGHT + TILE_SIZE - 1) / TILE_SIZE)
+#define MAX_DELTA_BYTES (sizeof(uint32_t) + TILES_X * TILES_Y * (sizeof(SnapshotTileHeader) + TILE_MAX_PAYLOAD))
+#define MAX_TCP_SHARDS 16
+#define CONN_WBUF_MAX ((size_t)MAX_LAYERS * LAYER_BYTES + (1u << 20)) // Unsent bytes before a peer is dropped as too slow
+#define RASTER_QUEUE_SIZE 4096  // Pending ops per room (power of two)
+#define RASTER_BATCH 256        // Ops applied per room lock
+#define RETX_RING_SIZE 4096     // Forwarded ops kept per room for NACK repair
+#define RETX_INDEX_SIZE 256     // Newest ops per author findable by sender_seq (> SEQ_WINDOW)
+#define NACK_INTERVAL_NS 50000000ull // Min gap between cursor-driven NACKs to one author
+#define DEFAULT_TICK_HZ 120     // Broadcast ticks per second (0 = forward on arrival)
+#define UDP_TICK_PAYLOAD 1400   // Max bytes per coalesced datagram (fits a 1500 MTU)
+#define WAL_DIR "wal"           // Per-canvas op logs (see WRITE-AHEAD LOG)
+#define WAL_FLUSH_MS 20         // Group commit interval of the log writer
+#define WAL_SNAPSHOT_BYTES (4u << 20) // Log size that triggers a canvas.bin snapshot
+#define DEFAULT_ROOM_IDLE_SEC 300 // Time with no users before a room is evicted
+#define ROOM_MIN_IDLE_SEC 5       // Even over the memory budget, rooms stay this long
 
 extern int errno;
 
@@ -49,7 +86,10 @@ enum MsgType {
     MSG_LAYER_SYNC = 13,   // Full layer data sync (for undo/redo)
     MSG_LAYER_REORDER = 14, // Swap layers
     MSG_SIGNATURE = 15,      // New signature message
-    MSG_LAYER_MOVE = 17
+    MSG_LAYER_MOVE = 17,
+    MSG_LAYER_DELTA = 18,   // Changed tiles of one layer (length in data[0..3])
+    MSG_NACK = 19,          // UDP: resend sender_uid's ops [sender_seq, +size)
+    MSG_LAYER_RESYNC = 20   // Ask for / reply with a whole layer as a tile list
 };
 
 #define SIGNATURE_WIDTH 450
@@ -67,6 +107,9 @@ struct TCPMessage {
     char     data[256]; // Reverted payload size
 } __attribute__((packed));
 
+// MSG_WELCOME data[0]
+#define WELCOME_PREMULTIPLIED 0x01 // Layers (snapshot, deltas, syncs) are premultiplied RGBA
+
 // Specialized packet for login with signature
 struct LoginPacket {
     uint8_t  type;        // MSG_LOGIN
@@ -81,6 +124,7 @@ struct LoginPacket {
 // UDP Message (packed for network)
 struct UDPMessage {
     uint8_t  type;
+    uint8_t  canvas_id; // Room this op belongs to (all rooms share UDP_PORT)
     uint8_t  brush_id;
     uint8_t  layer_id;
     int16_t  x;
@@ -89,42 +133,608 @@ struct UDPMessage {
     uint8_t  r, g, b, a;
     uint8_t  size;
     uint8_t  pressure;  // 0-255 representing 0.0-1.0 pressure (for pen tablets)
+    uint8_t  sender_uid; // Author's room UID (0 = unsequenced)
+    uint16_t sender_seq; // Author's op counter; MSG_CURSOR: last op sent
+    uint8_t  opacity;    // Brush opacity, 0-255, applied on top of the colour's alpha
 } __attribute__((packed));
 
 /*****************************************************************************
    LAYER STRUCTURE
  *****************************************************************************/
 
+static_assert(sizeof(Pixel) == 4, "Pixel must be packed RGBA");
+
+static inline bool pixel_eq(Pixel a, Pixel b) {
+    return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+// Pixels of an allocated tile. A buffer can be shared between a live layer
+// and the snapshot a background save is encoding (Layer::share); whoever
+// writes to a shared buffer first makes its own copy.
+// `enc` caches the tile_codec payload of px. Whichever side encodes it first
+// (a join, or the save) publishes it for both; the owner drops it on its
+// next write, which only happens once nobody else holds the buffer.
+struct TileBuffer {
+    std::atomic<uint32_t> refs;
+    std::atomic<const vector<uint8_t>*> enc{nullptr};
+    Pixel px[TILE_PIXELS];
+
+    ~TileBuffer() { delete enc.load(); }
+};
+
+static inline void release_tile_buffer(TileBuffer* b) {
+    if (b && b->refs.fetch_sub(1) == 1) delete b;
+}
+
+// Codec of non-uniform tiles in join snapshots and canvas.bin (--tile-codec).
+// Readers accept every TileCodec, so this can change between runs.
+uint8_t tile_codec = TILE_CODEC_ROWS;
+
+// Layers hold premultiplied RGBA (--premultiplied). Clients are told in
+// WELCOME; canvas.bin chunks and logged tile lists record the form they
+// were written in and are converted on the way in if it differs.
+bool premultiplied_layers = false;
+
+// How stored pixels are converted to the form layers use
+enum AlphaConvert {
+    ALPHA_AS_IS,
+    ALPHA_PREMULTIPLY,
+    ALPHA_UNPREMULTIPLY
+};
+
+static AlphaConvert alpha_convert_from(bool stored_premultiplied) {
+    if (stored_premultiplied == premultiplied_layers) return ALPHA_AS_IS;
+    return stored_premultiplied ? ALPHA_UNPREMULTIPLY : ALPHA_PREMULTIPLY;
+}
+
+// A TILE_SIZE x TILE_SIZE block of a layer. Until something different is
+// written into it, every pixel is `fill` and no buffer exists.
+// Edge tiles are allocated full size; pixels past WIDTH/HEIGHT are unused.
+struct Tile {
+    TileBuffer* buf; // Row-major TILE_SIZE*TILE_SIZE, or nullptr when uniform
+    Pixel fill;      // Colour of every pixel while buf is null
+
+    bool empty() const { return !buf && fill.a == 0; }
+};
+
+// A tile a save's snapshot found uniform. Holds a reference to buf, so
+// finish_save can tell whether the live layer still has that exact buffer.
+struct CollapsedTile {
+    int tx, ty;
+    TileBuffer* buf;
+    Pixel fill;
+};
+
 struct Layer {
-    Pixel pixels[WIDTH][HEIGHT];
+    Tile tiles[TILES_Y][TILES_X];
     bool dirty;
-    string cached_b64;
+    shared_ptr<vector<uint8_t>> cached_chunk; // Tile list last written to canvas.bin (set under room->mutex)
+    uint32_t version;             // Bumped each time a save re-encodes the layer
+    
+    // Kept up to date by every tile write. Tiles outside [bx0, bx1) x
+    // [by0, by1) are empty; the box only shrinks when the layer empties or
+    // collapse_uniform_tiles runs, so it can hold empty tiles too. An
+    // allocated tile counts as occupied until collapse_uniform_tiles finds
+    // it erased back to transparent.
+    int occupied;                 // Non-empty tiles
+    int bx0, by0, bx1, by1;       // Tile box holding them (empty when occupied == 0)
+
+    Layer() : dirty(true), version(0) {
+        for (int ty = 0; ty < TILES_Y; ty++) {
+            for (int tx = 0; tx < TILES_X; tx++) {
+                tiles[ty][tx].buf = nullptr;
+                tiles[ty][tx].fill = {0, 0, 0, 0};
+            }
+        }
+        reset_bounds(false);
+    }
 
-    Layer() : dirty(true) {}
+    ~Layer() {
+        fill_all({0, 0, 0, 0});
+    }
 
-    void init_transparent() {
-        for (int x = 0; x < WIDTH; x++) {
-            for (int y = 0; y < HEIGHT; y++) {
-                pixels[x][y] = {0, 0, 0, 0};
+    // Drop every tile buffer and make the whole layer one colour
+    void fill_all(Pixel c) {
+        for (int ty = 0; ty < TILES_Y; ty++) {
+            for (int tx = 0; tx < TILES_X; tx++) {
+                release_tile_buffer(tiles[ty][tx].buf);
+                tiles[ty][tx].buf = nullptr;
+                tiles[ty][tx].fill = c;
             }
         }
+        reset_bounds(c.a > 0);
         dirty = true;
     }
+
+    void reset_bounds(bool full) {
+        occupied = full ? TILES_X * TILES_Y : 0;
+        bx0 = by0 = 0;
+        bx1 = full ? TILES_X : 0;
+        by1 = full ? TILES_Y : 0;
+    }
+
+    // Account for tile (tx, ty) after a write that may have changed whether
+    // it is empty
+    void note_tile(int tx, int ty, bool was_empty) {
+        bool is_empty = tiles[ty][tx].empty();
+        if (is_empty == was_empty) return;
+        if (is_empty) {
+            if (--occupied == 0) reset_bounds(false);
+            return;
+        }
+        if (occupied++ == 0) {
+            bx0 = tx; bx1 = tx + 1;
+            by0 = ty; by1 = ty + 1;
+            return;
+        }
+        bx0 = min(bx0, tx); bx1 = max(bx1, tx + 1);
+        by0 = min(by0, ty); by1 = max(by1, ty + 1);
+    }
+
+    void init_transparent() {
+        fill_all({0, 0, 0, 0});
+    }
     
     void init_white() {
-        for (int x = 0; x < WIDTH; x++) {
-            for (int y = 0; y < HEIGHT; y++) {
-                pixels[x][y] = {255, 255, 255, 255};
+        fill_all({255, 255, 255, 255});
+    }
+
+    Tile& tile_at(int x, int y) {
+        return tiles[y / TILE_SIZE][x / TILE_SIZE];
+    }
+
+    Pixel get(int x, int y) const {
+        const Tile& t = tiles[y / TILE_SIZE][x / TILE_SIZE];
+        if (!t.buf) return t.fill;
+        return t.buf->px[(y % TILE_SIZE) * TILE_SIZE + (x % TILE_SIZE)];
+    }
+
+    static void alloc_tile(Tile& t) {
+        t.buf = new TileBuffer;
+        t.buf->refs = 1;
+        for (int i = 0; i < TILE_PIXELS; i++) t.buf->px[i] = t.fill;
+    }
+
+    // Make t's buffer private before writing to it: allocate a uniform tile,
+    // copy one a snapshot still shares, drop the cached encoding
+    static void own_tile(Tile& t) {
+        if (!t.buf) {
+            alloc_tile(t);
+        } else if (t.buf->refs.load() > 1) {
+            TileBuffer* copy = new TileBuffer;
+            copy->refs = 1;
+            memcpy(copy->px, t.buf->px, sizeof(copy->px));
+            release_tile_buffer(t.buf);
+            t.buf = copy;
+        } else if (t.buf->enc.load(std::memory_order_relaxed)) {
+            delete t.buf->enc.exchange(nullptr);
+        }
+    }
+
+    // Writable pixel; allocates the tile on first write
+    Pixel& at(int x, int y) {
+        Tile& t = tile_at(x, y);
+        bool was_empty = t.empty();
+        own_tile(t);
+        if (was_empty) note_tile(x / TILE_SIZE, y / TILE_SIZE, true);
+        return t.buf->px[(y % TILE_SIZE) * TILE_SIZE + (x % TILE_SIZE)];
+    }
+
+    // Like at() = c, but writing a uniform tile's own colour allocates nothing
+    void set(int x, int y, Pixel c) {
+        Tile& t = tile_at(x, y);
+        if (!t.buf && pixel_eq(t.fill, c)) return;
+        at(x, y) = c;
+    }
+
+    // Pixel rectangle covered by tile (tx, ty), clipped to the canvas
+    static void tile_bounds(int tx, int ty, int& x0, int& y0, int& x1, int& y1) {
+        x0 = tx * TILE_SIZE;
+        y0 = ty * TILE_SIZE;
+        x1 = min(x0 + TILE_SIZE, WIDTH);
+        y1 = min(y0 + TILE_SIZE, HEIGHT);
+    }
+
+    // Export as row-major RGBA (WIDTH * HEIGHT * 4 bytes, the wire layout):
+    // one memcpy per tile row, uniform tiles are filled without reading
+    void read_rgba(uint8_t* dst) const {
+        for (int ty = 0; ty < TILES_Y; ty++) {
+            for (int tx = 0; tx < TILES_X; tx++) {
+                const Tile& t = tiles[ty][tx];
+                int x0, y0, x1, y1;
+                tile_bounds(tx, ty, x0, y0, x1, y1);
+                size_t row_bytes = (x1 - x0) * sizeof(Pixel);
+                for (int y = y0; y < y1; y++) {
+                    Pixel* row = (Pixel*)(dst + ((size_t)y * WIDTH + x0) * sizeof(Pixel));
+                    if (t.buf) {
+                        memcpy(row, &t.buf->px[(y - y0) * TILE_SIZE], row_bytes);
+                    } else if (t.empty() && t.fill.r == 0 && t.fill.g == 0 && t.fill.b == 0) {
+                        memset(row, 0, row_bytes);
+                    } else {
+                        for (int x = 0; x < x1 - x0; x++) row[x] = t.fill;
+                    }
+                }
+            }
+        }
+    }
+
+    // Replace one tile from RGBA rows (src = its top-left pixel, stride in
+    // bytes). A tile whose rows all match its first pixel becomes uniform
+    // and releases its buffer.
+    void store_tile(int tx, int ty, const uint8_t* src, size_t stride) {
+        Tile& t = tiles[ty][tx];
+        bool was_empty = t.empty();
+        int x0, y0, x1, y1;
+        tile_bounds(tx, ty, x0, y0, x1, y1);
+        size_t row_bytes = (x1 - x0) * sizeof(Pixel);
+        
+        Pixel fill_row[TILE_SIZE];
+        Pixel c = {src[0], src[1], src[2], src[3]};
+        for (int x = 0; x < x1 - x0; x++) fill_row[x] = c;
+        bool uniform = true;
+        for (int y = 0; y < y1 - y0 && uniform; y++) {
+            uniform = memcmp(src + y * stride, fill_row, row_bytes) == 0;
+        }
+        
+        if (uniform) {
+            release_tile_buffer(t.buf);
+            t.buf = nullptr;
+            t.fill = c;
+            note_tile(tx, ty, was_empty);
+            return;
+        }
+        if (t.buf && t.buf->refs.load() > 1) {
+            // Every pixel is about to be replaced; no need to copy
+            release_tile_buffer(t.buf);
+            t.buf = nullptr;
+        }
+        own_tile(t);
+        for (int y = 0; y < y1 - y0; y++) {
+            memcpy(&t.buf->px[y * TILE_SIZE], src + y * stride, row_bytes);
+        }
+        note_tile(tx, ty, was_empty);
+    }
+
+    // Turn an allocated tile back into a uniform one if every pixel is the
+    // same colour, or fully transparent (the colour of alpha 0 pixels never
+    // shows or blends). Returns whether the buffer was released. With
+    // `found`, the collapse is also recorded there (see CollapsedTile).
+    bool collapse_tile(int tx, int ty, vector<CollapsedTile>* found = nullptr) {
+        Tile& t = tiles[ty][tx];
+        if (!t.buf) return false;
+        int x0, y0, x1, y1;
+        tile_bounds(tx, ty, x0, y0, x1, y1);
+        Pixel first = t.buf->px[0];
+        bool same = true, clear = true;
+        for (int y = 0; y < y1 - y0 && (same || clear); y++) {
+            const Pixel* row = &t.buf->px[y * TILE_SIZE];
+            for (int x = 0; x < x1 - x0; x++) {
+                same = same && pixel_eq(row[x], first);
+                clear = clear && row[x].a == 0;
+            }
+        }
+        if (!same && !clear) return false;
+        Pixel fill = clear ? Pixel{0, 0, 0, 0} : first;
+        if (found) {
+            t.buf->refs++;
+            found->push_back({tx, ty, t.buf, fill});
+        }
+        set_uniform(tx, ty, fill);
+        return true;
+    }
+
+    // Make tile (tx, ty) one colour, dropping its buffer
+    void set_uniform(int tx, int ty, Pixel c) {
+        Tile& t = tiles[ty][tx];
+        bool was_empty = t.empty();
+        release_tile_buffer(t.buf);
+        t.buf = nullptr;
+        t.fill = c;
+        note_tile(tx, ty, was_empty);
+    }
+
+    // collapse_tile every tile written since it was last encoded (encoded
+    // tiles were already checked). Run before saving or sending the layer
+    // so erased areas free their memory and an erased layer reads as empty.
+    int collapse_uniform_tiles(vector<CollapsedTile>* found = nullptr) {
+        int collapsed = 0;
+        for (int ty = by0; ty < by1; ty++) {
+            for (int tx = bx0; tx < bx1; tx++) {
+                const Tile& t = tiles[ty][tx];
+                if (t.buf && !t.buf->enc.load() && collapse_tile(tx, ty, found)) collapsed++;
+            }
+        }
+        if (collapsed && occupied > 0) shrink_bounds();
+        return collapsed;
+    }
+
+    // Apply a snapshot's collapse_uniform_tiles to this layer: tiles that
+    // still hold the buffer the snapshot collapsed get its colour. A tile
+    // written since was cloned first (the buffer was shared), so it keeps
+    // its own pixels. Drops the references `found` held.
+    void adopt_collapsed(const vector<CollapsedTile>& found) {
+        int collapsed = 0;
+        for (const CollapsedTile& ct : found) {
+            if (tiles[ct.ty][ct.tx].buf == ct.buf) {
+                set_uniform(ct.tx, ct.ty, ct.fill);
+                collapsed++;
+            }
+            release_tile_buffer(ct.buf);
+        }
+        if (collapsed && occupied > 0) shrink_bounds();
+    }
+
+    // Fit the tile box to the non-empty tiles inside it
+    void shrink_bounds() {
+        int nx0 = bx1, ny0 = by1, nx1 = bx0, ny1 = by0;
+        for (int ty = by0; ty < by1; ty++) {
+            for (int tx = bx0; tx < bx1; tx++) {
+                if (tiles[ty][tx].empty()) continue;
+                nx0 = min(nx0, tx); nx1 = max(nx1, tx + 1);
+                ny0 = min(ny0, ty); ny1 = max(ny1, ty + 1);
+            }
+        }
+        bx0 = nx0; bx1 = nx1;
+        by0 = ny0; by1 = ny1;
+    }
+
+    // Replace the whole layer from row-major RGBA (WIDTH * HEIGHT * 4 bytes)
+    void write_rgba(const uint8_t* src) {
+        for (int ty = 0; ty < TILES_Y; ty++) {
+            for (int tx = 0; tx < TILES_X; tx++) {
+                size_t offset = ((size_t)ty * TILE_SIZE * WIDTH + tx * TILE_SIZE) * sizeof(Pixel);
+                store_tile(tx, ty, src + offset, WIDTH * sizeof(Pixel));
+            }
+        }
+        dirty = true;
+    }
+
+    // tile_codec payload of an allocated tile, encoded on first use after a
+    // write. A layer and its snapshot may encode a shared buffer at the same
+    // time; the first to publish wins and the other's copy is dropped.
+    const vector<uint8_t>& encoded_tile(int tx, int ty, bool* cache_hit) {
+        const Tile& t = tiles[ty][tx];
+        const vector<uint8_t>* enc = t.buf->enc.load(std::memory_order_acquire);
+        *cache_hit = enc != nullptr;
+        if (!enc) {
+            int x0, y0, x1, y1;
+            tile_bounds(tx, ty, x0, y0, x1, y1);
+            int w = x1 - x0, h = y1 - y0;
+            uint32_t px[TILE_PIXELS];
+            for (int y = 0; y < h; y++) {
+                memcpy(&px[y * w], &t.buf->px[y * TILE_SIZE], w * sizeof(Pixel));
+            }
+            vector<uint8_t>* fresh = new vector<uint8_t>();
+            encode_tile_pixels(px, w, h, tile_codec, *fresh);
+            if (t.buf->enc.compare_exchange_strong(enc, fresh, std::memory_order_acq_rel)) {
+                enc = fresh;
+            } else {
+                delete fresh;
+            }
+        }
+        return *enc;
+    }
+
+    // Append the layer as a tile list (codec.h): transparent tiles are left
+    // out, uniform tiles are one pixel, the rest use their cached payload.
+    // Returns the tile count; *cached counts tiles whose payload was reused.
+    uint32_t encode_tile_list(vector<uint8_t>& out, size_t* cached) {
+        size_t count_pos = out.size();
+        out.resize(count_pos + sizeof(uint32_t));
+        uint32_t tile_count = 0;
+        for (int ty = by0; ty < by1; ty++) {
+            for (int tx = bx0; tx < bx1; tx++) {
+                Tile& t = tiles[ty][tx];
+                if (t.empty()) continue;
+                
+                SnapshotTileHeader th;
+                th.tx = tx;
+                th.ty = ty;
+                th.reserved = 0;
+                const uint8_t* payload;
+                if (!t.buf) {
+                    th.codec = TILE_CODEC_FILL;
+                    th.len = sizeof(Pixel);
+                    payload = (const uint8_t*)&t.fill;
+                } else {
+                    bool hit;
+                    const vector<uint8_t>& enc = encoded_tile(tx, ty, &hit);
+                    if (hit && cached) (*cached)++;
+                    th.codec = tile_codec;
+                    th.len = enc.size();
+                    payload = enc.data();
+                }
+                const uint8_t* hdr = (const uint8_t*)&th;
+                out.insert(out.end(), hdr, hdr + sizeof(th));
+                out.insert(out.end(), payload, payload + th.len);
+                tile_count++;
             }
         }
+        memcpy(&out[count_pos], &tile_count, sizeof(uint32_t));
+        return tile_count;
+    }
+
+    // Replace the tiles listed in a tile list; unlisted tiles are kept.
+    // Returns the number of tiles replaced, or -1 if the list is malformed.
+    int decode_tile_list(const uint8_t* data, size_t len, AlphaConvert convert = ALPHA_AS_IS) {
+        uint32_t tile_count;
+        if (len < sizeof(tile_count)) return -1;
+        memcpy(&tile_count, data, sizeof(tile_count));
+        size_t pos = sizeof(tile_count);
+        uint32_t px[TILE_PIXELS];
+        
+        for (uint32_t i = 0; i < tile_count; i++) {
+            SnapshotTileHeader th;
+            if (pos + sizeof(th) > len) return -1;
+            memcpy(&th, data + pos, sizeof(th));
+            pos += sizeof(th);
+            if (th.len > len - pos || th.tx >= TILES_X || th.ty >= TILES_Y) return -1;
+            
+            int x0, y0, x1, y1;
+            tile_bounds(th.tx, th.ty, x0, y0, x1, y1);
+            int w = x1 - x0, h = y1 - y0;
+            if (!decode_snapshot_tile(th, data + pos, (uint8_t*)px, w, 0, 0, w, h)) return -1;
+            if (convert == ALPHA_PREMULTIPLY) premultiply_row((uint8_t*)px, w * h);
+            else if (convert == ALPHA_UNPREMULTIPLY) unpremultiply_row((uint8_t*)px, w * h);
+            store_tile(th.tx, th.ty, (const uint8_t*)px, w * sizeof(Pixel));
+            pos += th.len;
+        }
         dirty = true;
+        return tile_count;
+    }
+
+    bool has_content() const {
+        return occupied > 0;
+    }
+
+    size_t allocated_tiles() const {
+        size_t n = 0;
+        for (int ty = 0; ty < TILES_Y; ty++) {
+            for (int tx = 0; tx < TILES_X; tx++) {
+                if (tiles[ty][tx].buf) n++;
+            }
+        }
+        return n;
+    }
+
+    // Heap held by the layer: tile buffers, cached encodings, last chunk
+    size_t resident_bytes() const {
+        size_t n = sizeof(Layer);
+        for (int ty = 0; ty < TILES_Y; ty++) {
+            for (int tx = 0; tx < TILES_X; tx++) {
+                const Tile& t = tiles[ty][tx];
+                if (!t.buf) continue;
+                n += sizeof(TileBuffer);
+                if (const vector<uint8_t>* enc = t.buf->enc.load()) n += enc->capacity();
+            }
+        }
+        if (cached_chunk) n += cached_chunk->capacity();
+        return n;
+    }
+
+    // Exchange tiles and tile box with `other` (the caller deletes whichever
+    // it no longer wants, releasing its buffers)
+    void swap_tiles(Layer* other) {
+        swap(tiles, other->tiles);
+        swap(occupied, other->occupied);
+        swap(bx0, other->bx0); swap(by0, other->by0);
+        swap(bx1, other->bx1); swap(by1, other->by1);
+    }
+
+    // A copy that shares this layer's tile buffers (and so their cached
+    // encodings) instead of copying them; the next write to a shared tile,
+    // on either side, clones it first. Cheap enough to take under room->mutex.
+    Layer* share() const {
+        Layer* copy = new Layer();
+        for (int ty = 0; ty < TILES_Y; ty++) {
+            for (int tx = 0; tx < TILES_X; tx++) {
+                const Tile& t = tiles[ty][tx];
+                copy->tiles[ty][tx].buf = t.buf;
+                copy->tiles[ty][tx].fill = t.fill;
+                if (t.buf) t.buf->refs++;
+            }
+        }
+        copy->occupied = occupied;
+        copy->bx0 = bx0; copy->by0 = by0;
+        copy->bx1 = bx1; copy->by1 = by1;
+        copy->version = version;
+        return copy;
+    }
+};
+
+/*****************************************************************************
+   RASTER OP QUEUE (lock-free MPSC)
+ *****************************************************************************/
+
+// Bounded ring in the style of Vyukov's MPMC queue: each cell carries a
+// sequence number that says whose turn it is, so producers only contend on
+// one CAS and the single consumer never locks. push() fails when full.
+template <typename T, size_t N>
+struct MpscQueue {
+    static_assert((N & (N - 1)) == 0, "MpscQueue size must be a power of two");
+
+    struct Cell {
+        std::atomic<size_t> seq;
+        T data;
+    };
+
+    Cell cells[N];
+    alignas(64) std::atomic<size_t> head; // Next slot to claim (producers)
+    alignas(64) std::atomic<size_t> tail; // Next slot to read (consumer)
+
+    MpscQueue() : head(0), tail(0) {
+        for (size_t i = 0; i < N; i++) cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    bool push(const T& v) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        while (1) {
+            Cell& c = cells[pos & (N - 1)];
+            size_t seq = c.seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+            if (dif == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    c.data = v;
+                    c.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (dif < 0) {
+                return false; // Full
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Single consumer only
+    bool pop(T& out) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        Cell& c = cells[pos & (N - 1)];
+        size_t seq = c.seq.load(std::memory_order_acquire);
+        if ((intptr_t)seq - (intptr_t)(pos + 1) < 0) return false; // Empty
+        out = c.data;
+        c.seq.store(pos + N, std::memory_order_release);
+        tail.store(pos + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    size_t depth() const {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_relaxed);
+        return h > t ? h - t : 0;
     }
 };
 
+// A draw/line op waiting for the room's raster thread
+struct RasterOp {
+    UDPMessage msg;
+    uint64_t enqueued_ns; // For apply-latency stats
+};
+
+static inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 /*****************************************************************************
    CANVAS ROOM STRUCTURE
  *****************************************************************************/
 
+// Forwarded packet held until the next broadcast tick
+struct TickOp {
+    UDPMessage msg;
+    struct sockaddr_in from;
+    uint64_t queued_ns;
+};
+
+// A forwarded op kept for retransmission
+struct RetxEntry {
+    UDPMessage msg;
+    uint16_t epoch = 0; // sender_epoch of the author when it was stored
+    bool used = false;
+};
+
 struct ConnectedUser {
     int socket_fd;
     char username[32];
@@ -141,28 +751,91 @@ struct ConnectedUser {
     }
 };
 
+struct Connection; // TCP socket state owned by a reactor shard
+
+// Datagram / syscall counters for a UDP worker (read by stats_thread)
+struct UdpStats {
+    std::atomic<uint64_t> rx_packets{0}, rx_syscalls{0};
+    std::atomic<uint64_t> tx_packets{0}, tx_syscalls{0};
+    std::atomic<uint64_t> tx_dropped{0}; // Fan-out datagrams the kernel refused (EAGAIN, errors)
+    uint64_t last_rx_packets = 0, last_rx_syscalls = 0;
+    uint64_t last_tx_packets = 0, last_tx_syscalls = 0, last_tx_dropped = 0;
+};
+
 struct CanvasRoom {
     int id;
     vector<Layer*> layers;
     
-    int udp_socket;
-    int udp_port;
-    pthread_t thread;
-    bool active;
+    bool active;              // Reachable over UDP (someone has logged in)
     
     vector<struct sockaddr_in> udp_clients;
-    vector<int> tcp_clients;
+    vector<Connection*> tcp_clients;
     map<int, ConnectedUser*> users; // Map socket_fd -> User info
-    pthread_mutex_t mutex;
+    pthread_mutex_t mutex;          // Layers, users, tcp_clients
+    pthread_mutex_t peers_mutex;    // udp_clients, drawing (UDP ingest only)
     bool dirty;
+    map<string, bool> drawing; // Per-client stroke state for less spammy logs
+    std::atomic<uint64_t> udp_packets{0};
+    uint64_t last_udp_packets = 0;
+    
+    // Draw/line ops forwarded by the UDP workers, applied by raster_thread
+    MpscQueue<RasterOp, RASTER_QUEUE_SIZE> raster_queue;
+    pthread_t raster_thread;
+    std::atomic<bool> raster_sleeping{false};
+    pthread_mutex_t raster_wait_mutex;
+    pthread_cond_t raster_cond;
+    
+    // Sequenced stroke stream (peers_mutex)
+    SeqWindow sender_windows[256];   // Per author room_uid
+    uint16_t sender_epoch[256];      // Bumped when a room_uid is handed out again
+    uint64_t last_nack_ns[256];
+    uint32_t retx_next;              // Ring slot for the next forwarded op
+    RetxEntry retx_ring[RETX_RING_SIZE];
+    uint16_t retx_slot[256][RETX_INDEX_SIZE]; // Author's sender_seq -> ring slot
+    std::atomic<uint64_t> nacks_sent{0}, nacks_received{0}, retransmits{0}, duplicates{0};
+    
+    // Broadcast tick (peers_mutex): ops in arrival order, latest cursor per user
+    vector<TickOp> tick_ops;
+    TickOp tick_cursors[256];
+    bool tick_cursor_set[256];
+    
+    // Fan-out stats (reset by stats_thread)
+    std::atomic<uint64_t> fanout_records{0}, fanout_datagrams{0}, cursors_merged{0};
+    std::atomic<uint64_t> tick_held{0}, tick_hold_sum_ns{0}, tick_hold_max_ns{0};
+    
+    // Write-ahead log (wal_gen under mutex)
+    uint32_t wal_gen;                  // Generation new records go to
+    uint32_t stored_gen;               // Last generation folded into the loaded snapshot
+    std::atomic<uint64_t> wal_bytes{0}; // Logged since the last snapshot
+    bool old_logs;                     // Generations before wal_gen may still have logs on disk (mutex)
+    
+    // Residency (see ROOM EVICTION)
+    uint64_t idle_since_ns;            // Last seen in use: eviction pass or logout (mutex)
+    std::atomic<int> joining{0};       // Logins between activate_canvas and add_user
+    std::atomic<bool> raster_stop{false};
+    
+    // Raster stats (reset by stats_thread)
+    std::atomic<uint64_t> raster_ops{0}, raster_batches{0};
+    std::atomic<uint64_t> raster_latency_sum_ns{0}, raster_latency_max_ns{0};
+    std::atomic<uint64_t> raster_depth_max{0}, raster_full_stalls{0};
     
     void init(int canvas_id) {
         id = canvas_id;
         active = false;
         dirty = true;
-        udp_socket = -1;
-        udp_port = PORT + 1 + canvas_id;
         pthread_mutex_init(&mutex, NULL);
+        pthread_mutex_init(&peers_mutex, NULL);
+        pthread_mutex_init(&raster_wait_mutex, NULL);
+        pthread_cond_init(&raster_cond, NULL);
+        retx_next = 0;
+        wal_gen = 1;
+        stored_gen = 0;
+        old_logs = false;
+        idle_since_ns = now_ns();
+        memset(sender_epoch, 0, sizeof(sender_epoch));
+        memset(retx_slot, 0, sizeof(retx_slot));
+        memset(last_nack_ns, 0, sizeof(last_nack_ns));
+        memset(tick_cursor_set, 0, sizeof(tick_cursor_set));
         
         Layer* paper = new Layer();
         paper->init_white();
@@ -175,6 +848,22 @@ struct CanvasRoom {
         printf("[Server][Canvas %d] Initialized with %zu layers (paper + 1 drawable)\n", id, layers.size());
     }
     
+    // Only for evicted rooms: no users, raster thread stopped, unreachable
+    ~CanvasRoom() {
+        for (Layer* layer : layers) delete layer;
+        for (auto& pair : users) delete pair.second;
+        pthread_mutex_destroy(&mutex);
+        pthread_mutex_destroy(&peers_mutex);
+        pthread_mutex_destroy(&raster_wait_mutex);
+        pthread_cond_destroy(&raster_cond);
+    }
+    
+    size_t resident_bytes() const {
+        size_t n = sizeof(CanvasRoom);
+        for (Layer* layer : layers) n += layer->resident_bytes();
+        return n;
+    }
+    
     void add_user(int fd, const char* name, const uint8_t* sig_data, int sig_len) {
         ConnectedUser* u = new ConnectedUser();
         u->socket_fd = fd;
@@ -202,6 +891,13 @@ struct CanvasRoom {
         printf("[Server][Canvas %d] User %s added with signature (%d bytes), UID=%d\n", id, name, sig_len, u->room_uid);
     }
     
+    // A room_uid starts a new op stream (login). Caller holds peers_mutex.
+    void reset_sender(int uid) {
+        sender_windows[uid].reset();
+        sender_epoch[uid]++;
+        last_nack_ns[uid] = 0;
+    }
+    
     void remove_user(int fd) {
         if (users.count(fd)) {
             delete users[fd];
@@ -259,33 +955,6 @@ struct CanvasRoom {
         layers.insert(layers.begin() + new_idx, l);
         printf("[Server][Canvas %d] Moved layer %d to %d\n", id, old_idx, new_idx);
     }
-    
-    void flatten_to_buffer(Pixel* buffer) {
-        for (int x = 0; x < WIDTH; x++) {
-            for (int y = 0; y < HEIGHT; y++) {
-                buffer[x * HEIGHT + y] = {255, 255, 255, 255};
-            }
-        }
-        for (size_t l = 1; l < layers.size(); l++) {
-            for (int x = 0; x < WIDTH; x++) {
-                for (int y = 0; y < HEIGHT; y++) {
-                    Pixel src = layers[l]->pixels[x][y];
-                    if (src.a > 0) {
-                        Pixel& dst = buffer[x * HEIGHT + y];
-                        float srcA = src.a / 255.0f;
-                        float dstA = dst.a / 255.0f;
-                        float outA = srcA + dstA * (1 - srcA);
-                        if (outA > 0) {
-                            dst.r = (src.r * srcA + dst.r * dstA * (1 - srcA)) / outA;
-                            dst.g = (src.g * srcA + dst.g * dstA * (1 - srcA)) / outA;
-                            dst.b = (src.b * srcA + dst.b * dstA * (1 - srcA)) / outA;
-                            dst.a = outA * 255;
-                        }
-                    }
-                }
-            }
-        }
-    }
 };
 
 /*****************************************************************************
@@ -294,10 +963,32 @@ struct CanvasRoom {
 
 map<int, CanvasRoom*> canvases;  // On-demand canvas creation
 pthread_mutex_t canvases_mutex = PTHREAD_MUTEX_INITIALIZER;
-vector<Brush*> availableBrushes;
-
-// Track drawing state per client for less spammy logs
-map<string, bool> client_drawing;
+vector<const Brush*> availableBrushes; // Immutable; shared by every raster thread
+
+// Lock-free canvas_id -> room lookup for the UDP workers (set on activation)
+std::atomic<CanvasRoom*> active_rooms[MAX_CANVASES];
+
+// Set while evict_idle_rooms has a room out of `canvases` but may still put
+// it back, or while get_or_create_canvas decodes a room that is not in
+// `canvases` yet (canvases_mutex). Creating the canvas waits on unload_cond
+// meanwhile.
+bool canvas_unloading[MAX_CANVASES];
+bool canvas_loading[MAX_CANVASES];
+pthread_cond_t unload_cond = PTHREAD_COND_INITIALIZER;
+
+// Threads that use rooms found in active_rooms (UDP workers, then the
+// broadcast tick) make their counter odd while they do; an evicted room is
+// only freed after every reader that was inside has left (see
+// wait_for_room_readers).
+#define ROOM_READERS (MAX_UDP_WORKERS + 1)
+#define TICK_ROOM_READER MAX_UDP_WORKERS
+std::atomic<uint32_t> room_reader_epoch[ROOM_READERS];
+
+// Room residency (see ROOM EVICTION)
+int room_idle_sec = DEFAULT_ROOM_IDLE_SEC; // --room-idle-sec (0 = never by time)
+size_t room_budget_bytes = 0;              // --room-budget-mb (0 = no limit)
+std::atomic<uint64_t> rooms_evicted{0};
+std::atomic<uint64_t> rooms_loaded{0};      // Decoded from canvas.bin on join
 
 /*****************************************************************************
    HELPER FUNCTIONS
@@ -313,25 +1004,95 @@ string addr_to_key(struct sockaddr_in addr) {
     return string(buf);
 }
 
-// Helper: Write all data to socket (handles partial writes)
-bool write_all(int sock, const void* data, size_t len) {
-    const uint8_t* ptr = (const uint8_t*)data;
-    size_t sent = 0;
-    while (sent < len) {
-        ssize_t w = write(sock, ptr + sent, len - sent);
-        if (w <= 0) return false;
-        sent += w;
+/*****************************************************************************
+   TCP CONNECTION BUFFERS
+ *****************************************************************************/
+
+// One per accepted socket. The owning reactor shard is the only thread that
+// reads from it or closes it; any thread holding the room mutex may queue
+// output (broadcasts), so the write side has its own lock.
+struct Connection {
+    int fd;
+    int shard;
+    int canvas_id;            // -1 until MSG_LOGIN
+    vector<uint8_t> rbuf;     // Received bytes not yet parsed into a frame
+    vector<uint8_t> wbuf;     // Queued output
+    size_t woff;              // Bytes of wbuf already written
+    pthread_mutex_t wmutex;
+    bool dead;                // Write failed; owner closes on next event
+
+    Connection(int sock, int shard_id) : fd(sock), shard(shard_id), canvas_id(-1), woff(0), dead(false) {
+        pthread_mutex_init(&wmutex, NULL);
+    }
+
+    ~Connection() {
+        pthread_mutex_destroy(&wmutex);
+    }
+};
+
+std::atomic<uint64_t> conn_overflows{0}; // Peers dropped at CONN_WBUF_MAX (reset by stats_thread)
+
+// Write as much of wbuf as the socket accepts. Caller holds wmutex.
+// Leaves data queued on EAGAIN; the owner shard retries on EPOLLOUT.
+bool conn_flush_locked(Connection* c) {
+    while (c->woff < c->wbuf.size()) {
+        ssize_t w = send(c->fd, c->wbuf.data() + c->woff, c->wbuf.size() - c->woff, MSG_NOSIGNAL);
+        if (w > 0) {
+            c->woff += w;
+            continue;
+        }
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        return false;
+    }
+    if (c->woff == c->wbuf.size()) {
+        c->wbuf.clear();
+        c->woff = 0;
+    } else if (c->woff > (1 << 20) && c->woff * 2 > c->wbuf.size()) {
+        c->wbuf.erase(c->wbuf.begin(), c->wbuf.begin() + c->woff);
+        c->woff = 0;
     }
     return true;
 }
 
+// Helper: Queue data for a connection and push out what the socket takes now.
+// A dead connection is shut down so its shard wakes up and cleans it up.
+// A peer that lets more than CONN_WBUF_MAX pile up (a full snapshot of raw
+// layers) is disconnected rather than queued for; it resyncs on rejoin.
+bool conn_send(Connection* c, const void* data, size_t len) {
+    pthread_mutex_lock(&c->wmutex);
+    if (c->dead) {
+        pthread_mutex_unlock(&c->wmutex);
+        return false;
+    }
+    if (c->wbuf.size() - c->woff + len > CONN_WBUF_MAX) {
+        printf("[Server][TCP] Socket %d has %zu bytes unsent, dropping slow peer\n", c->fd, c->wbuf.size() - c->woff);
+        vector<uint8_t>().swap(c->wbuf);
+        c->woff = 0;
+        c->dead = true;
+        shutdown(c->fd, SHUT_RDWR);
+        conn_overflows++;
+        pthread_mutex_unlock(&c->wmutex);
+        return false;
+    }
+    const uint8_t* ptr = (const uint8_t*)data;
+    c->wbuf.insert(c->wbuf.end(), ptr, ptr + len);
+    if (!conn_flush_locked(c)) {
+        c->dead = true;
+        shutdown(c->fd, SHUT_RDWR);
+    }
+    bool ok = !c->dead;
+    pthread_mutex_unlock(&c->wmutex);
+    return ok;
+}
+
 // Helper: Broadcast TCPMessage to all clients in a room (optionally exclude one)
+// Caller holds room->mutex.
 void broadcast_tcp(CanvasRoom* room, const TCPMessage& msg, int exclude_sock = -1) {
-    for (int sock : room->tcp_clients) {
-        if (sock != exclude_sock) {
-            if (!write_all(sock, &msg, sizeof(TCPMessage))) {
-                perror("Broadcast failed: closing dead socket"); 
-                close(sock); 
+    for (Connection* c : room->tcp_clients) {
+        if (c->fd != exclude_sock) {
+            if (!conn_send(c, &msg, sizeof(TCPMessage))) {
+                printf("[Server][TCP] Broadcast failed: socket %d is dead\n", c->fd);
             }
         }
     }
@@ -339,455 +1100,1480 @@ void broadcast_tcp(CanvasRoom* room, const TCPMessage& msg, int exclude_sock = -
 
 // Forward declaration
 CanvasRoom* get_or_create_canvas(int canvas_id);
+CanvasRoom* get_or_create_canvas_locked(int canvas_id);
+vector<uint32_t> wal_list_logs(int canvas_id);
+CanvasRoom* load_canvas_room(int canvas_id);
+void wal_append_ops(CanvasRoom* room, const RasterOp* ops, int n);
 
 /*****************************************************************************
    UDP MESSAGE HANDLERS
  *****************************************************************************/
 
-// Broadcast UDP message to all clients except sender
-int broadcast_udp(CanvasRoom* room, const UDPMessage& msg, const sockaddr_in& sender_addr) {
-    int count = 0;
-    for (const auto& client : room->udp_clients) {
-        if (!is_same_address(client, sender_addr)) {
-            sendto(room->udp_socket, &msg, sizeof(UDPMessage), 0,
-                   (struct sockaddr*)&client, sizeof(client));
-            count++;
+#define UDP_BATCH 64            // Datagrams drained per recvmmsg
+#define UDP_MAX_GSO_SEGS 64     // Kernel limit on segments per GSO send
+#define UDP_MAX_MMSG 1024       // Kernel limit on messages per sendmmsg
+
+std::atomic<bool> udp_gso_enabled(false); // Probed on the first worker socket
+int udp_tick_hz = DEFAULT_TICK_HZ;         // --tick-hz
+
+// Reusable scratch for one fan-out pass (owned by a UDP worker)
+struct UdpFanout {
+    vector<struct mmsghdr> hdrs;
+    vector<struct iovec> iovs;
+    vector<char> ctrl;
+};
+
+// Send a prepared set of messages with as few sendmmsg calls as possible.
+// If the kernel rejects a GSO message, GSO is switched off and that message's
+// segments are sent one by one. Counts only what the kernel accepted as
+// stats.tx_packets (a GSO message is one packet per segment) and the rest as
+// stats.tx_dropped. Returns the packets accepted; *records (if given) gets
+// the records (iovecs) they carried.
+size_t send_fanout(int sock, UdpStats& stats, UdpFanout& f, size_t count, size_t* records_out = nullptr) {
+    size_t off = 0, records = 0, packets = 0, dropped = 0;
+    while (off < count) {
+        unsigned int chunk = (unsigned int)min(count - off, (size_t)UDP_MAX_MMSG);
+        int sent = sendmmsg(sock, &f.hdrs[off], chunk, 0);
+        stats.tx_syscalls++;
+        if (sent > 0) {
+            for (int k = 0; k < sent; k++) {
+                const struct msghdr& mh = f.hdrs[off + k].msg_hdr;
+                records += mh.msg_iovlen;
+                packets += mh.msg_controllen > 0 ? mh.msg_iovlen : 1;
+            }
+            off += sent;
+            continue;
+        }
+        if (sent < 0 && errno == EINTR) continue;
+
+        struct msghdr& bad = f.hdrs[off].msg_hdr;
+        if (bad.msg_controllen > 0) {
+            if (udp_gso_enabled.exchange(false)) {
+                printf("[Server][UDP] GSO send failed (%s), falling back to sendmmsg\n", strerror(errno));
+            }
+            for (size_t k = 0; k < bad.msg_iovlen; k++) {
+                bool ok = sendto(sock, bad.msg_iov[k].iov_base, bad.msg_iov[k].iov_len, 0,
+                                 (struct sockaddr*)bad.msg_name, bad.msg_namelen) >= 0;
+                stats.tx_syscalls++;
+                records += ok;
+                packets += ok;
+                dropped += !ok;
+            }
+        } else {
+            dropped++;
         }
+        off++; // Drop the failing datagram rather than spin on it
     }
-    return count;
+    stats.tx_packets += packets;
+    stats.tx_dropped += dropped;
+    if (records_out) *records_out = records;
+    return packets;
 }
 
-void handle_draw(CanvasRoom* room, const UDPMessage& msg, const sockaddr_in& sender_addr,
-                 int canvas_id, const string& client_key) {
-    int layer_idx = msg.layer_id;
-    if (layer_idx <= 0 || layer_idx >= (int)room->layers.size()) {
-        layer_idx = 1;
-    }
-    
-    Pixel col = {msg.r, msg.g, msg.b, msg.a};
-    
-    // Only log when drawing starts
-    if (!client_drawing[client_key]) {
-        client_drawing[client_key] = true;
-        printf("[Server][Canvas %d][UDP] DRAW START: client=%s layer=%d brush=%d size=%d color=RGBA(%d,%d,%d,%d)\n",
-               canvas_id, client_key.c_str(), layer_idx, msg.brush_id, msg.size, msg.r, msg.g, msg.b, msg.a);
+// Broadcast a received batch to every client except each packet's sender.
+// Each peer gets one GSO message carrying all its packets when the kernel
+// supports UDP_SEGMENT, otherwise one sendmmsg entry per packet.
+// Sent from the worker's own socket (same UDP_PORT, so clients see one peer).
+// Caller holds room->peers_mutex (udp_clients).
+int broadcast_udp(CanvasRoom* room, int sock, UdpStats& stats, UdpFanout& f, const UDPMessage* msgs,
+                  const sockaddr_in* senders, const bool* forward, int count) {
+    size_t peers = room->udp_clients.size();
+    size_t max_msgs = peers * count;
+    f.hdrs.resize(max_msgs);
+    f.iovs.resize(max_msgs);
+    f.ctrl.assign(max_msgs * CMSG_SPACE(sizeof(uint16_t)), 0);
+
+    size_t nhdr = 0, niov = 0;
+    int delivered = 0;
+    for (size_t p = 0; p < peers; p++) {
+        sockaddr_in* client = &room->udp_clients[p];
+        size_t first_iov = niov;
+        for (int i = 0; i < count; i++) {
+            if (!forward[i] || is_same_address(*client, senders[i])) continue;
+            f.iovs[niov].iov_base = (void*)&msgs[i];
+            f.iovs[niov].iov_len = sizeof(UDPMessage);
+            niov++;
+        }
+        size_t n = niov - first_iov;
+        if (n == 0) continue;
+        delivered += n;
+
+        if (udp_gso_enabled && n > 1) {
+            for (size_t s = first_iov; s < niov; s += UDP_MAX_GSO_SEGS) {
+                struct msghdr& mh = f.hdrs[nhdr].msg_hdr;
+                memset(&mh, 0, sizeof(mh));
+                mh.msg_name = client;
+                mh.msg_namelen = sizeof(*client);
+                mh.msg_iov = &f.iovs[s];
+                mh.msg_iovlen = min(niov - s, (size_t)UDP_MAX_GSO_SEGS);
+                if (mh.msg_iovlen > 1) {
+                    mh.msg_control = &f.ctrl[nhdr * CMSG_SPACE(sizeof(uint16_t))];
+                    mh.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+                    struct cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+                    cm->cmsg_level = SOL_UDP;
+                    cm->cmsg_type = UDP_SEGMENT;
+                    cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                    uint16_t seg = sizeof(UDPMessage);
+                    memcpy(CMSG_DATA(cm), &seg, sizeof(seg));
+                }
+                nhdr++;
+            }
+        } else {
+            for (size_t s = first_iov; s < niov; s++) {
+                struct msghdr& mh = f.hdrs[nhdr].msg_hdr;
+                memset(&mh, 0, sizeof(mh));
+                mh.msg_name = client;
+                mh.msg_namelen = sizeof(*client);
+                mh.msg_iov = &f.iovs[s];
+                mh.msg_iovlen = 1;
+                nhdr++;
+            }
+        }
     }
-    
-    pthread_mutex_lock(&room->mutex);
-    room->dirty = true;
-    
-    bool isSoftEraser = (msg.brush_id == 3); // 3 is Soft Eraser
-
-    auto setPixel = [&](int px, int py, Pixel c) {
-        if (px >= 0 && px < WIDTH && py >= 0 && py < HEIGHT) {
-            if (isSoftEraser) {
-                // Soft Eraser Logic: Subtract Alpha
-                Pixel& current = room->layers[layer_idx]->pixels[px][py];
-                int currentAlpha = current.a;
-                int eraseStrength = c.a; // Brush passes strength in alpha
-                int newAlpha = currentAlpha - eraseStrength;
-                if (newAlpha < 0) newAlpha = 0;
-                current.a = (uint8_t)newAlpha;
+
+    size_t sent = nhdr > 0 ? send_fanout(sock, stats, f, nhdr) : 0;
+    room->fanout_records += sent; // One record per packet here
+    room->fanout_datagrams += sent;
+    return delivered;
+}
+
+// Tick mode: hold a batch's forwarded packets for broadcast_tick_thread.
+// A newer cursor from the same user replaces the held one.
+// Caller holds room->peers_mutex.
+void hold_for_tick(CanvasRoom* room, const UDPMessage* msgs, const sockaddr_in* senders,
+                   const bool* forward, int count) {
+    uint64_t now = now_ns();
+    for (int i = 0; i < count; i++) {
+        if (!forward[i]) continue;
+        if (msgs[i].type == MSG_CURSOR) {
+            uint8_t uid = msgs[i].brush_id; // Cursors carry the room_uid in brush_id
+            TickOp& held = room->tick_cursors[uid];
+            if (room->tick_cursor_set[uid]) {
+                room->cursors_merged++;
             } else {
-                // Normal Paint / Hard Eraser
-                room->layers[layer_idx]->pixels[px][py] = c;
+                held.queued_ns = now;
+                room->tick_cursor_set[uid] = true;
             }
-            room->layers[layer_idx]->dirty = true;
+            held.msg = msgs[i];
+            held.from = senders[i];
+            continue;
         }
-    };
-    if (msg.brush_id < (int)availableBrushes.size()) {
-        int angle = msg.ex;
-        availableBrushes[msg.brush_id]->paint(msg.x, msg.y, col, msg.size, msg.pressure, angle, setPixel);
+        room->tick_ops.push_back({msgs[i], senders[i], now});
     }
-    broadcast_udp(room, msg, sender_addr);
-    pthread_mutex_unlock(&room->mutex);
 }
 
-void handle_cursor(CanvasRoom* room, const UDPMessage& msg, const sockaddr_in& sender_addr,
-                   int canvas_id, const string& client_key) {
-    // Cursor also marks end of drawing
-    if (client_drawing[client_key]) {
-        client_drawing[client_key] = false;
-        printf("[Server][Canvas %d][UDP] DRAW END: client=%s\n", canvas_id, client_key.c_str());
+// Writes clipped dab runs (brushes.h) into a layer, one tile row segment at
+// a time, combined as the brush's DabMode says. A uniform tile the run
+// would not change stays unallocated, like Layer::set. Premul layers get
+// the run's straight colour premultiplied.
+template<DabMode Mode, bool Premul>
+struct LayerSink {
+    typedef Layer* Target;
+    typedef bool Result; // Whether any run landed on the canvas
+    static const int width = WIDTH, height = HEIGHT;
+
+    Layer* layer;
+    bool touched;
+
+    explicit LayerSink(Layer* l) : layer(l), touched(false) {}
+    bool result() const { return touched; }
+
+    void span(int y, int x0, int x1, Pixel c) { write(y, x0, x1, c, nullptr); }
+    void cover(int y, int x0, int x1, Pixel c, const uint8_t* alpha) { write(y, x0, x1, c, alpha); }
+
+    static Pixel apply(Pixel d, Pixel s) {
+        if (Premul && Mode != DAB_SUBTRACT) premultiply_pixel((uint8_t*)&s, (const uint8_t*)&s, s.a);
+        if (Mode == DAB_ERASE) return s;
+        if (Mode == DAB_SUBTRACT) {
+            uint8_t a = d.a > s.a ? d.a - s.a : 0;
+            if (Premul && d.a) {
+                // Same straight colour at the lower alpha
+                d.r = (d.r * a + d.a / 2) / d.a;
+                d.g = (d.g * a + d.a / 2) / d.a;
+                d.b = (d.b * a + d.a / 2) / d.a;
+            }
+            d.a = a;
+            return d;
+        }
+        if (Premul) blend_pixel_pm((uint8_t*)&d, (const uint8_t*)&s);
+        else blend_pixel((uint8_t*)&d, (const uint8_t*)&s);
+        return d;
     }
-    
-    // Inject room_uid into brush_id field for cursor tracking
-    UDPMessage fwd = msg;
-    pthread_mutex_lock(&room->mutex);
-    broadcast_udp(room, fwd, sender_addr);
-    pthread_mutex_unlock(&room->mutex);
+
+    // Would writing n pixels into a uniform tile of colour fill change it?
+    static bool changes(Pixel fill, Pixel c, const uint8_t* alpha, int n) {
+        if (!alpha) return !pixel_eq(apply(fill, c), fill);
+        for (int k = 0; k < n; k++) {
+            if (!alpha[k]) continue;
+            Pixel s = c;
+            s.a = alpha[k];
+            if (!pixel_eq(apply(fill, s), fill)) return true;
+        }
+        return false;
+    }
+
+    void write(int y, int x0, int x1, Pixel c, const uint8_t* alpha) {
+        touched = true;
+        int ty = y / TILE_SIZE;
+        for (int sx = x0; sx <= x1;) {
+            int tx = sx / TILE_SIZE;
+            int ex = min(x1, tx * TILE_SIZE + TILE_SIZE - 1);
+            int n = ex - sx + 1;
+            const uint8_t* a = alpha ? alpha + (sx - x0) : nullptr;
+            Tile& t = layer->tiles[ty][tx];
+            if (t.buf || changes(t.fill, c, a, n)) {
+                Pixel* px = &layer->at(sx, y); // Tile rows are contiguous
+                if (Mode == DAB_OVER) {
+                    if (Premul) blend_span_pm((uint8_t*)px, n, (const uint8_t*)&c, a);
+                    else blend_span((uint8_t*)px, n, (const uint8_t*)&c, a);
+                } else {
+                    for (int k = 0; k < n; k++) {
+                        if (a && !a[k]) continue;
+                        Pixel s = c;
+                        if (a) s.a = a[k];
+                        px[k] = apply(px[k], s);
+                    }
+                }
+            }
+            sx = ex + 1;
+        }
+    }
+};
+
+template<DabMode Mode> using StraightLayerSink = LayerSink<Mode, false>;
+template<DabMode Mode> using PremulLayerSink = LayerSink<Mode, true>;
+
+// Paint op on a layer with the kernel for its brush and DabMode
+static void paint_layer(Layer* layer, const Brush* brush, const DabOp& op) {
+    bool touched = premultiplied_layers ? DabKernels<PremulLayerSink>::run(brush, layer, op)
+                                        : DabKernels<StraightLayerSink>::run(brush, layer, op);
+    if (touched) layer->dirty = true;
 }
 
-void handle_line(CanvasRoom* room, const UDPMessage& msg, const sockaddr_in& sender_addr,
-                 int canvas_id, const string& client_key) {
+// Rasterize one dab. Runs on the room's raster thread; caller holds room->mutex.
+void apply_draw(CanvasRoom* room, const UDPMessage& msg) {
     int layer_idx = msg.layer_id;
     if (layer_idx <= 0 || layer_idx >= (int)room->layers.size()) {
         layer_idx = 1;
     }
     
     Pixel col = {msg.r, msg.g, msg.b, msg.a};
-    // printf("[Server][Canvas %d][UDP] LINE: client=%s from=(%d,%d) to=(%d,%d) layer=%d brush=%d\n",
-    //        canvas_id, client_key.c_str(), msg.x, msg.y, msg.ex, msg.ey, layer_idx, msg.brush_id);
-    
-    pthread_mutex_lock(&room->mutex);
     room->dirty = true;
+    if (msg.brush_id >= (int)availableBrushes.size()) return;
+    const Brush* brush = availableBrushes[msg.brush_id];
     
-    int x0 = msg.x, y0 = msg.y;
-    int x1 = msg.ex, y1 = msg.ey;
-    int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
-    int dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
-    int err = dx + dy, e2;
+    int angle = msg.ex;
+    DabOp op = {msg.x, msg.y, msg.x, msg.y, false, {col, msg.size, msg.pressure, angle, msg.opacity}};
+    paint_layer(room->layers[layer_idx], brush, op);
+}
+
+// Rasterize a line segment (see paint_op). Runs on the room's raster
+// thread; caller holds room->mutex.
+void apply_line(CanvasRoom* room, const UDPMessage& msg) {
+    int layer_idx = msg.layer_id;
+    if (layer_idx <= 0 || layer_idx >= (int)room->layers.size()) {
+        layer_idx = 1;
+    }
     
-    // Calculate angle for the line
-    int angle = (int)(atan2(msg.ey - msg.y, msg.ex - msg.x) * 180.0 / M_PI);
+    Pixel col = {msg.r, msg.g, msg.b, msg.a};
+    room->dirty = true;
+    if (msg.brush_id >= (int)availableBrushes.size()) return;
+    const Brush* brush = availableBrushes[msg.brush_id];
     
-    bool isSoftEraser = (msg.brush_id == 3); // 3 is Soft Eraser
-
-    auto setPixel = [&](int px, int py, Pixel c) {
-        if (px >= 0 && px < WIDTH && py >= 0 && py < HEIGHT) {
-            if (isSoftEraser) {
-                // Soft Eraser Logic: Subtract Alpha
-                Pixel& current = room->layers[layer_idx]->pixels[px][py];
-                int currentAlpha = current.a;
-                int eraseStrength = c.a; // Brush passes strength in alpha
-                int newAlpha = currentAlpha - eraseStrength;
-                if (newAlpha < 0) newAlpha = 0;
-                current.a = (uint8_t)newAlpha;
-            } else {
-                room->layers[layer_idx]->pixels[px][py] = c;
-            }
-            room->layers[layer_idx]->dirty = true;
-        }
-    };
+    // Calculate angle for the line
+    int angle = (int)(atan2(msg.ey - msg.y, msg.ex - msg.x) * 180.0 / M_PI);
+    
+    DabOp op = {msg.x, msg.y, msg.ex, msg.ey, true, {col, msg.size, msg.pressure, angle, msg.opacity}};
+    paint_layer(room->layers[layer_idx], brush, op);
+}
 
-    while (true) {
-        if (msg.brush_id < (int)availableBrushes.size()) {
-            availableBrushes[msg.brush_id]->paint(x0, y0, col, msg.size, msg.pressure, angle, setPixel);
+// Stroke start/end logging. Caller holds room->peers_mutex.
+void log_stroke_state(CanvasRoom* room, const UDPMessage& msg, const string& client_key) {
+    if (msg.type == MSG_DRAW || msg.type == MSG_LINE) {
+        // Only log when drawing starts
+        if (!room->drawing[client_key]) {
+            room->drawing[client_key] = true;
+            printf("[Server][Canvas %d][UDP] DRAW START: client=%s layer=%d brush=%d size=%d color=RGBA(%d,%d,%d,%d)\n",
+                   room->id, client_key.c_str(), msg.layer_id, msg.brush_id, msg.size, msg.r, msg.g, msg.b, msg.a);
+        }
+    } else if (msg.type == MSG_CURSOR) {
+        // Cursor also marks end of drawing
+        if (room->drawing[client_key]) {
+            room->drawing[client_key] = false;
+            printf("[Server][Canvas %d][UDP] DRAW END: client=%s\n", room->id, client_key.c_str());
         }
-        if (x0 == x1 && y0 == y1) break;
-        e2 = 2 * err;
-        if (e2 >= dy) { err += dy; x0 += sx; }
-        if (e2 <= dx) { err += dx; y0 += sy; }
     }
-    
-    int bc = broadcast_udp(room, msg, sender_addr);
-    pthread_mutex_unlock(&room->mutex);
-    // printf("[Server][Canvas %d][UDP] LINE broadcast to %d clients\n", canvas_id, bc);
 }
 
-/*****************************************************************************
-   CANVAS UDP THREAD
- *****************************************************************************/
-
-void* canvas_udp_thread(void* arg) {
-    int canvas_id = *((int*)arg);
-    free(arg);
-    
-    CanvasRoom* room = get_or_create_canvas(canvas_id);
-    
-    printf("[Server][Canvas %d][UDP] Thread started on port %d\n", canvas_id, room->udp_port);
+// Hand an op to the room's raster thread. Spins (yielding) while the queue is
+// full so a flood backs up into the socket buffer instead of dropping strokes.
+void enqueue_raster_op(CanvasRoom* room, const UDPMessage& msg) {
+    RasterOp op;
+    op.msg = msg;
+    op.enqueued_ns = now_ns();
+    if (!room->raster_queue.push(op)) {
+        room->raster_full_stalls++;
+        while (!room->raster_queue.push(op)) sched_yield();
+    }
     
-    UDPMessage msg;
-    struct sockaddr_in sender_addr;
-    socklen_t len = sizeof(sender_addr);
+    uint64_t depth = room->raster_queue.depth();
+    uint64_t prev = room->raster_depth_max.load(std::memory_order_relaxed);
+    while (depth > prev && !room->raster_depth_max.compare_exchange_weak(prev, depth)) {}
+    
+    // Pairs with the fence in raster_thread: either we see it asleep, or it
+    // sees our op before going to sleep.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (room->raster_sleeping.load()) {
+        pthread_mutex_lock(&room->raster_wait_mutex);
+        pthread_cond_signal(&room->raster_cond);
+        pthread_mutex_unlock(&room->raster_wait_mutex);
+    }
+}
+
+// Per-room consumer: drains queued ops in batches and applies each batch
+// under a single room->mutex acquisition.
+void* raster_thread(void* arg) {
+    CanvasRoom* room = (CanvasRoom*)arg;
+    RasterOp batch[RASTER_BATCH];
     
-    while (room->active) {
-        struct timeval tv;
-        tv.tv_sec = 1;
-        tv.tv_usec = 0;
-        setsockopt(room->udp_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-        
-        int bytes = recvfrom(room->udp_socket, &msg, sizeof(UDPMessage), 0, 
-                             (struct sockaddr*)&sender_addr, &len);
+    while (1) {
+        int n = 0;
+        while (n < RASTER_BATCH && room->raster_queue.pop(batch[n])) n++;
         
-        if (bytes <= 0) continue;
+        if (n == 0) {
+            if (room->raster_stop) break; // Evicted, queue drained
+            pthread_mutex_lock(&room->raster_wait_mutex);
+            room->raster_sleeping = true;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (room->raster_queue.depth() == 0) {
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec += 1;
+                pthread_cond_timedwait(&room->raster_cond, &room->raster_wait_mutex, &ts);
+            }
+            room->raster_sleeping = false;
+            pthread_mutex_unlock(&room->raster_wait_mutex);
+            continue;
+        }
         
+        pthread_mutex_lock(&room->mutex);
+        for (int i = 0; i < n; i++) {
+            if (batch[i].msg.type == MSG_DRAW) apply_draw(room, batch[i].msg);
+            else apply_line(room, batch[i].msg);
+        }
+        wal_append_ops(room, batch, n);
+        pthread_mutex_unlock(&room->mutex);
         
-        string client_key = addr_to_key(sender_addr);
+        uint64_t done = now_ns();
+        uint64_t sum = 0, max_lat = 0;
+        for (int i = 0; i < n; i++) {
+            uint64_t lat = done - batch[i].enqueued_ns;
+            sum += lat;
+            if (lat > max_lat) max_lat = lat;
+        }
+        room->raster_ops += n;
+        room->raster_batches++;
+        room->raster_latency_sum_ns += sum;
+        uint64_t prev = room->raster_latency_max_ns.load(std::memory_order_relaxed);
+        while (max_lat > prev && !room->raster_latency_max_ns.compare_exchange_weak(prev, max_lat)) {}
+    }
+    return NULL;
+}
+
+/*****************************************************************************
+   UDP WORKERS (shared port, SO_REUSEPORT)
+ *****************************************************************************/
+
+// Every worker binds its own socket to UDP_PORT with SO_REUSEPORT; the kernel
+// hashes each client address to one socket, so a sender's packets always
+// reach the same worker in order. Workers serve whatever rooms their clients
+// belong to.
+struct UdpWorker {
+    int id;
+    int sock;
+    pthread_t thread;
+    UdpStats stats;
+};
+
+UdpWorker udp_workers[MAX_UDP_WORKERS];
+int udp_worker_count = 0;
+
+// Ask an author to resend [first, first + count) of its ops
+void send_nack(UdpWorker* w, CanvasRoom* room, const sockaddr_in& to, uint8_t uid, uint16_t first, int count) {
+    UDPMessage nack;
+    memset(&nack, 0, sizeof(nack));
+    nack.type = MSG_NACK;
+    nack.canvas_id = room->id;
+    nack.sender_uid = uid;
+    nack.sender_seq = first;
+    nack.size = count;
+    sendto(w->sock, &nack, sizeof(nack), 0, (const struct sockaddr*)&to, sizeof(to));
+    w->stats.tx_syscalls++;
+    w->stats.tx_packets++;
+    room->nacks_sent++;
+}
+
+// A receiver missed some of uid's ops: resend whatever the ring still has.
+// Receivers only ask for ops within SEQ_WINDOW of the newest they have seen,
+// so each one is a retx_slot lookup. Caller holds room->peers_mutex.
+void answer_nack(UdpWorker* w, CanvasRoom* room, const sockaddr_in& to, const UDPMessage& nack) {
+    room->nacks_received++;
+    uint8_t uid = nack.sender_uid;
+    int count = min((int)nack.size, RETX_INDEX_SIZE);
+    for (int k = 0; k < count; k++) {
+        uint16_t seq = nack.sender_seq + k;
+        const RetxEntry& e = room->retx_ring[room->retx_slot[uid][seq % RETX_INDEX_SIZE]];
+        // The slot may have been reused since: check it still holds this op
+        if (!e.used || e.msg.sender_uid != uid || e.msg.sender_seq != seq ||
+            e.epoch != room->sender_epoch[uid]) continue;
+        sendto(w->sock, &e.msg, sizeof(UDPMessage), 0, (const struct sockaddr*)&to, sizeof(to));
+        w->stats.tx_syscalls++;
+        w->stats.tx_packets++;
+        room->retransmits++;
+    }
+}
+
+// Sequence bookkeeping for one incoming packet. Drops duplicates, NACKs the
+// author for gaps and keeps a copy of each new op.
+// Returns false if the packet must not be forwarded. Caller holds peers_mutex.
+bool sequence_packet(UdpWorker* w, CanvasRoom* room, UDPMessage& msg, const sockaddr_in& from) {
+    uint8_t uid = msg.sender_uid;
+    if (uid == 0) return true; // Unsequenced sender
+    SeqWindow& win = room->sender_windows[uid];
+    
+    if (msg.type == MSG_CURSOR) {
+        // Cursor carries the author's newest op: catches lost stroke tails
+        if (msg.sender_seq == 0) return true;
+        uint64_t now = now_ns();
+        if (now - room->last_nack_ns[uid] < NACK_INTERVAL_NS) return true;
+        uint16_t firsts[SEQ_MAX_RUNS];
+        int counts[SEQ_MAX_RUNS];
+        int runs = win.missing(msg.sender_seq, firsts, counts);
+        for (int r = 0; r < runs; r++) send_nack(w, room, from, uid, firsts[r], counts[r]);
+        if (runs > 0) room->last_nack_ns[uid] = now;
+        return true;
+    }
+    
+    uint16_t gap_first;
+    int gap_count;
+    if (!win.accept(msg.sender_seq, &gap_first, &gap_count)) {
+        room->duplicates++;
+        return false;
+    }
+    if (gap_count > 0) send_nack(w, room, from, uid, gap_first, gap_count);
+    
+    uint32_t slot = room->retx_next++ % RETX_RING_SIZE;
+    room->retx_slot[uid][msg.sender_seq % RETX_INDEX_SIZE] = slot;
+    RetxEntry& e = room->retx_ring[slot];
+    e.msg = msg;
+    e.epoch = room->sender_epoch[uid];
+    e.used = true;
+    return true;
+}
+
+// Register senders and fan one room's share of a batch out (right away, or
+// at the next broadcast tick); draw and line ops are then queued for the
+// room's raster thread, so peers never wait on rasterization or on TCP work
+// holding room->mutex.
+void process_room_batch(UdpWorker* w, CanvasRoom* room, UdpFanout& fanout, UDPMessage* msgs,
+                        struct sockaddr_in* senders, bool* forward, int count) {
+    room->udp_packets += count;
+    
+    pthread_mutex_lock(&room->peers_mutex);
+    for (int i = 0; i < count; i++) {
+        if (!forward[i]) continue;
+        UDPMessage& msg = msgs[i];
+        if (msg.type == MSG_NACK) {
+            answer_nack(w, room, senders[i], msg);
+            forward[i] = false;
+            continue;
+        }
+        if (msg.type != MSG_DRAW && msg.type != MSG_LINE && msg.type != MSG_CURSOR) {
+            forward[i] = false;
+            continue;
+        }
         
-        pthread_mutex_lock(&room->mutex);
         bool found = false;
         for (const auto& addr : room->udp_clients) {
-            if (is_same_address(addr, sender_addr)) {
+            if (is_same_address(addr, senders[i])) {
                 found = true;
                 break;
             }
         }
         if (!found) {
-            room->udp_clients.push_back(sender_addr);
+            room->udp_clients.push_back(senders[i]);
             printf("[Server][Canvas %d][UDP] New client: %s (total: %zu)\n", 
-                   canvas_id, client_key.c_str(), room->udp_clients.size());
+                   room->id, addr_to_key(senders[i]).c_str(), room->udp_clients.size());
         }
-        pthread_mutex_unlock(&room->mutex);
+        log_stroke_state(room, msg, addr_to_key(senders[i]));
+        forward[i] = sequence_packet(w, room, msg, senders[i]);
+    }
+    
+    if (udp_tick_hz > 0) hold_for_tick(room, msgs, senders, forward, count);
+    else broadcast_udp(room, w->sock, w->stats, fanout, msgs, senders, forward, count);
+    pthread_mutex_unlock(&room->peers_mutex);
+    
+    for (int i = 0; i < count; i++) {
+        if (forward[i] && (msgs[i].type == MSG_DRAW || msgs[i].type == MSG_LINE)) {
+            enqueue_raster_op(room, msgs[i]);
+        }
+    }
+}
+
+void* udp_worker_thread(void* arg) {
+    UdpWorker* w = (UdpWorker*)arg;
+    printf("[Server][UDP] Worker %d started on port %d\n", w->id, UDP_PORT);
+    
+    // recvmmsg batch: block for the first datagram, then take whatever else
+    // is already queued (up to UDP_BATCH) in the same syscall.
+    UDPMessage msgs[UDP_BATCH];
+    struct sockaddr_in senders[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH];
+    struct mmsghdr hdrs[UDP_BATCH];
+    
+    // Packets regrouped by room, keeping per-sender order
+    UDPMessage room_msgs[UDP_BATCH];
+    struct sockaddr_in room_senders[UDP_BATCH];
+    bool forward[UDP_BATCH];
+    bool taken[UDP_BATCH];
+    UdpFanout fanout;
+    
+    while (1) {
+        for (int i = 0; i < UDP_BATCH; i++) {
+            iovs[i].iov_base = &msgs[i];
+            iovs[i].iov_len = sizeof(UDPMessage);
+            memset(&hdrs[i].msg_hdr, 0, sizeof(hdrs[i].msg_hdr));
+            hdrs[i].msg_hdr.msg_name = &senders[i];
+            hdrs[i].msg_hdr.msg_namelen = sizeof(senders[i]);
+            hdrs[i].msg_hdr.msg_iov = &iovs[i];
+            hdrs[i].msg_hdr.msg_iovlen = 1;
+        }
+        
+        int count = recvmmsg(w->sock, hdrs, UDP_BATCH, MSG_WAITFORONE, NULL);
+        if (count <= 0) continue;
+        w->stats.rx_syscalls++;
+        w->stats.rx_packets += count;
         
-        if (msg.type == MSG_DRAW) {
-            handle_draw(room, msg, sender_addr, canvas_id, client_key);
+        for (int i = 0; i < count; i++) {
+            taken[i] = hdrs[i].msg_len < sizeof(UDPMessage); // Runt datagrams are dropped
+        }
+        
+        room_reader_epoch[w->id]++;
+        for (int i = 0; i < count; i++) {
+            if (taken[i]) continue;
+            int canvas_id = msgs[i].canvas_id;
+            CanvasRoom* room = active_rooms[canvas_id].load();
+            
+            int n = 0;
+            for (int j = i; j < count; j++) {
+                if (taken[j] || msgs[j].canvas_id != canvas_id) continue;
+                taken[j] = true;
+                room_msgs[n] = msgs[j];
+                room_senders[n] = senders[j];
+                forward[n] = true;
+                n++;
+            }
+            
+            if (!room) continue; // Nobody has logged into this canvas
+            process_room_batch(w, room, fanout, room_msgs, room_senders, forward, n);
         }
-        else if (msg.type == MSG_CURSOR) {
-            handle_cursor(room, msg, sender_addr, canvas_id, client_key);
+        room_reader_epoch[w->id]++;
+    }
+    return NULL;
+}
+
+bool start_udp_workers(int count) {
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) cpus = 1;
+    
+    for (int i = 0; i < count; i++) {
+        UdpWorker* w = &udp_workers[i];
+        w->id = i;
+        w->sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (w->sock < 0) {
+            perror("[Server] UDP socket failed");
+            return false;
         }
-        else if (msg.type == MSG_LINE) {
-            handle_line(room, msg, sender_addr, canvas_id, client_key);
+        
+        int on = 1;
+        setsockopt(w->sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+        
+        struct sockaddr_in addr;
+        bzero(&addr, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(UDP_PORT);
+        
+        if (bind(w->sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            printf("[Server] ERROR: UDP bind failed for port %d\n", UDP_PORT);
+            close(w->sock);
+            return false;
+        }
+        
+        // Probe UDP GSO once: if the kernel accepts a segment size we can pack a
+        // peer's whole batch into one send. Reset to 0 so plain sends stay plain.
+        if (i == 0) {
+            int seg = sizeof(UDPMessage);
+            if (setsockopt(w->sock, SOL_UDP, UDP_SEGMENT, &seg, sizeof(seg)) == 0) {
+                seg = 0;
+                setsockopt(w->sock, SOL_UDP, UDP_SEGMENT, &seg, sizeof(seg));
+                udp_gso_enabled = true;
+            }
+            printf("[Server][Init] UDP GSO %s\n", udp_gso_enabled ? "available" : "not supported, using sendmmsg");
+        }
+        
+        pthread_create(&w->thread, NULL, udp_worker_thread, w);
+        
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(i % cpus, &cpuset);
+        pthread_setaffinity_np(w->thread, sizeof(cpuset), &cpuset);
+    }
+    udp_worker_count = count;
+    printf("[Server][Init] %d UDP workers on port %d (SO_REUSEPORT, pinned over %d cores)\n", count, UDP_PORT, cpus);
+    return true;
+}
+
+/*****************************************************************************
+   BROADCAST TICK
+ *****************************************************************************/
+
+UdpStats tick_stats; // Datagrams sent by broadcast_tick_thread
+
+// Send one tick's worth of held packets: each peer gets its packets (minus
+// its own) packed back to back, UDP_TICK_PAYLOAD bytes per datagram, all in
+// one sendmmsg pass. Any worker socket shows clients UDP_PORT as the source;
+// rooms are spread over them so the tick doesn't queue every room's
+// datagrams behind one socket's send lock.
+void flush_tick(CanvasRoom* room, UdpFanout& f, const vector<TickOp>& ops,
+                vector<struct sockaddr_in>& peers) {
+    const size_t per_datagram = UDP_TICK_PAYLOAD / sizeof(UDPMessage);
+    size_t max_iov = peers.size() * ops.size();
+    f.hdrs.resize(max_iov);
+    f.iovs.resize(max_iov);
+    
+    size_t nhdr = 0, niov = 0;
+    for (size_t p = 0; p < peers.size(); p++) {
+        struct msghdr* mh = NULL;
+        for (const TickOp& op : ops) {
+            if (is_same_address(peers[p], op.from)) continue;
+            if (!mh || mh->msg_iovlen == per_datagram) {
+                mh = &f.hdrs[nhdr++].msg_hdr;
+                memset(mh, 0, sizeof(*mh));
+                mh->msg_name = &peers[p];
+                mh->msg_namelen = sizeof(peers[p]);
+                mh->msg_iov = &f.iovs[niov];
+            }
+            f.iovs[niov].iov_base = (void*)&op.msg;
+            f.iovs[niov].iov_len = sizeof(UDPMessage);
+            niov++;
+            mh->msg_iovlen++;
         }
     }
     
-    printf("[Server][Canvas %d][UDP] Thread stopped\n", canvas_id);
-    close(room->udp_socket);
+    size_t sent = 0, records = 0;
+    if (nhdr > 0) sent = send_fanout(udp_workers[room->id % udp_worker_count].sock, tick_stats, f, nhdr, &records);
+    room->fanout_records += records;
+    room->fanout_datagrams += sent;
+    
+    uint64_t now = now_ns(), sum = 0, max_hold = 0;
+    for (const TickOp& op : ops) {
+        uint64_t hold = now - op.queued_ns;
+        sum += hold;
+        if (hold > max_hold) max_hold = hold;
+    }
+    room->tick_held += ops.size();
+    room->tick_hold_sum_ns += sum;
+    uint64_t prev = room->tick_hold_max_ns.load(std::memory_order_relaxed);
+    while (max_hold > prev && !room->tick_hold_max_ns.compare_exchange_weak(prev, max_hold)) {}
+}
+
+// Every 1/udp_tick_hz seconds, take what each active room has held and fan
+// it out. Ops keep their arrival order; held cursors go last so each one's
+// sender_seq covers the ops in front of it.
+void* broadcast_tick_thread(void* arg) {
+    (void)arg;
+    uint64_t interval = 1000000000ull / udp_tick_hz;
+    uint64_t next = now_ns();
+    vector<TickOp> ops;
+    vector<struct sockaddr_in> peers;
+    UdpFanout fanout;
+    
+    while (1) {
+        next += interval;
+        uint64_t now = now_ns();
+        if (next < now) next = now; // Fell behind: don't burst to catch up
+        struct timespec ts;
+        ts.tv_sec = next / 1000000000ull;
+        ts.tv_nsec = next % 1000000000ull;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+        
+        room_reader_epoch[TICK_ROOM_READER]++;
+        for (int c = 0; c < MAX_CANVASES; c++) {
+            CanvasRoom* room = active_rooms[c].load();
+            if (!room) continue;
+            
+            ops.clear();
+            pthread_mutex_lock(&room->peers_mutex);
+            ops.swap(room->tick_ops);
+            for (int uid = 0; uid < 256; uid++) {
+                if (!room->tick_cursor_set[uid]) continue;
+                ops.push_back(room->tick_cursors[uid]);
+                room->tick_cursor_set[uid] = false;
+            }
+            if (!ops.empty()) peers = room->udp_clients;
+            pthread_mutex_unlock(&room->peers_mutex);
+            
+            if (!ops.empty()) flush_tick(room, fanout, ops, peers);
+        }
+        room_reader_epoch[TICK_ROOM_READER]++;
+    }
     return NULL;
 }
 
+void start_broadcast_tick() {
+    if (udp_tick_hz <= 0) {
+        printf("[Server][Init] Broadcast tick off: packets are forwarded on arrival\n");
+        return;
+    }
+    pthread_t tick_th;
+    pthread_create(&tick_th, NULL, broadcast_tick_thread, NULL);
+    printf("[Server][Init] Broadcast tick %d Hz, up to %zu ops per datagram\n",
+           udp_tick_hz, UDP_TICK_PAYLOAD / sizeof(UDPMessage));
+}
+
 /*****************************************************************************
-   START/STOP CANVAS THREAD
+   CANVAS ACTIVATION
  *****************************************************************************/
 
+// Caller holds canvases_mutex. Creating a room drops it while the canvas is
+// decoded and its logs are listed (canvas_loading), so other canvases are
+// not held up by a cold load.
+CanvasRoom* get_or_create_canvas_locked(int canvas_id) {
+    // A room being unloaded may hold edits the store doesn't have yet: wait
+    // until it is either freed or put back instead of loading a stale copy.
+    // One being loaded is about to appear.
+    while (canvas_unloading[canvas_id] || canvas_loading[canvas_id]) {
+        pthread_cond_wait(&unload_cond, &canvases_mutex);
+    }
+    auto found = canvases.find(canvas_id);
+    if (found != canvases.end()) return found->second;
+    
+    printf("[Server] Creating new canvas #%d on demand\n", canvas_id);
+    canvas_loading[canvas_id] = true;
+    CanvasRoom* room = load_canvas_room(canvas_id);
+    canvases[canvas_id] = room;
+    canvas_loading[canvas_id] = false;
+    pthread_cond_broadcast(&unload_cond);
+    return room;
+}
+
 CanvasRoom* get_or_create_canvas(int canvas_id) {
     pthread_mutex_lock(&canvases_mutex);
-    
-    if (canvases.find(canvas_id) == canvases.end()) {
-        printf("[Server] Creating new canvas #%d on demand\n", canvas_id);
-        CanvasRoom* room = new CanvasRoom();
-        room->init(canvas_id);
-        canvases[canvas_id] = room;
-    }
-    
-    CanvasRoom* room = canvases[canvas_id];
+    CanvasRoom* room = get_or_create_canvas_locked(canvas_id);
     pthread_mutex_unlock(&canvases_mutex);
     return room;
 }
 
-bool start_canvas_thread(int canvas_id) {
-    if (canvas_id < 0) {
+// Make a room reachable by the UDP workers and start its raster thread.
+// The room is counted in `joining` (it cannot be evicted) until the caller
+// has added its user and decremented it.
+CanvasRoom* activate_canvas(int canvas_id) {
+    if (canvas_id < 0 || canvas_id >= MAX_CANVASES) {
         printf("[Server] ERROR: Invalid canvas_id %d\n", canvas_id);
-        return false;
+        return nullptr;
     }
     
-    CanvasRoom* room = get_or_create_canvas(canvas_id);
-    
     pthread_mutex_lock(&canvases_mutex);
-    
-    if (room->active) {
-        printf("[Server][Canvas %d] Thread already running\n", canvas_id);
-        pthread_mutex_unlock(&canvases_mutex);
-        return true;
-    }
-    
-    room->udp_socket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (room->udp_socket < 0) {
-        perror("[Server] UDP socket failed");
-        pthread_mutex_unlock(&canvases_mutex);
-        return false;
-    }
-    
-    struct sockaddr_in addr;
-    bzero(&addr, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(room->udp_port);
-    
-    if (bind(room->udp_socket, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        printf("[Server] ERROR: UDP bind failed for port %d\n", room->udp_port);
-        close(room->udp_socket);
-        pthread_mutex_unlock(&canvases_mutex);
-        return false;
+    CanvasRoom* room = get_or_create_canvas_locked(canvas_id);
+    room->joining++;
+    if (!room->active) {
+        room->active = true;
+        room->raster_stop = false;
+        pthread_create(&room->raster_thread, NULL, raster_thread, room);
+        active_rooms[canvas_id] = room;
+        printf("[Server][Canvas %d] ACTIVE on shared UDP port %d\n", canvas_id, UDP_PORT);
     }
-    
-    room->active = true;
-    
-    int* arg = (int*)malloc(sizeof(int));
-    *arg = canvas_id;
-    pthread_create(&room->thread, NULL, canvas_udp_thread, arg);
-    
-    printf("[Server][Canvas %d] Thread STARTED on UDP port %d\n", canvas_id, room->udp_port);
-    
     pthread_mutex_unlock(&canvases_mutex);
-    return true;
+    return room;
 }
 
 /*****************************************************************************
-   PERSISTENCE - Single canvas.json with all canvases and layers
+   WRITE-AHEAD LOG
  *****************************************************************************/
 
-static const string b64_chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+// Every op that changes a canvas is appended, under room->mutex and in the
+// order it was applied, to wal/canvas_<id>_<gen>.wal. wal_writer_thread
+// writes and fdatasyncs whatever is pending every WAL_FLUSH_MS, so a crash
+// loses at most that much. A save moves each room it writes to a new
+// generation at the moment its layers are captured; once canvas.bin is in
+// place the generations it covers are deleted. Recovery decodes the snapshot
+// and replays the generations after the one recorded in its chunks.
+
+enum WalRecordType {
+    WAL_DRAW = 1,       // Payload: UDPMessage (MSG_DRAW / MSG_LINE)
+    WAL_LAYER_ADD,      // a: index the layer was inserted at
+    WAL_LAYER_DEL,      // layer
+    WAL_LAYER_REORDER,  // a: old index, b: new index
+    WAL_LAYER_MOVE,     // layer, a: dx, b: dy
+    WAL_LAYER_TILES,    // layer, payload: tile list replacing the listed tiles
+    WAL_LAYER_REPLACE   // layer, payload: tile list replacing the whole layer
+};
 
-// PackBits Compression 
-// Header N:
-// [0, 127]   -> (N+1) literal bytes follow
-// [-127, -1] -> Repeat next byte (1-N) times (2 to 128 times)
-// -128       -> No-op
-vector<uint8_t> packbits_compress(const uint8_t* data, size_t len) {
-    vector<uint8_t> out;
-    size_t i = 0;
-    while (i < len) {
-        // Look for run
-        size_t run_start = i;
-        while (i + 1 < len && data[i] == data[i+1] && (i - run_start) < 127) {
-            i++;
-        }
+struct WalRecordHeader {
+    uint32_t len;       // Payload bytes
+    uint32_t checksum;  // FNV-1a of this header (checksum = 0) and the payload
+    uint8_t  type;      // WalRecordType
+    uint8_t  layer;
+    uint16_t flags;     // WAL_PREMULTIPLIED
+    int32_t  a, b;
+} __attribute__((packed));
+
+#define WAL_PREMULTIPLIED 0x0001 // Tile list payload holds premultiplied pixels
+
+// Records waiting for the writer, grouped by canvas and generation
+struct WalChunk {
+    int canvas_id;
+    uint32_t gen;
+    vector<uint8_t> bytes;
+};
+
+pthread_mutex_t wal_mutex = PTHREAD_MUTEX_INITIALIZER;
+vector<WalChunk> wal_pending;
+
+// Writer stats (reset by stats_thread)
+std::atomic<uint64_t> wal_records{0}, wal_bytes_written{0}, wal_flushes{0};
+std::atomic<uint64_t> wal_sync_sum_ns{0}, wal_sync_max_ns{0};
+
+void move_layer_buffer(Layer* layer, int dx, int dy);
+
+uint32_t wal_checksum(const WalRecordHeader& h, const uint8_t* payload) {
+    WalRecordHeader tmp = h;
+    tmp.checksum = 0;
+    uint32_t hash = 2166136261u;
+    const uint8_t* p = (const uint8_t*)&tmp;
+    for (size_t i = 0; i < sizeof(tmp); i++) hash = (hash ^ p[i]) * 16777619u;
+    for (size_t i = 0; i < h.len; i++) hash = (hash ^ payload[i]) * 16777619u;
+    return hash;
+}
+
+string wal_path(int canvas_id, uint32_t gen) {
+    char path[64];
+    snprintf(path, sizeof(path), WAL_DIR "/canvas_%d_%u.wal", canvas_id, gen);
+    return path;
+}
+
+// Caller holds room->mutex and wal_mutex
+static void wal_put(CanvasRoom* room, uint8_t type, int layer, int a, int b,
+                    const uint8_t* payload, size_t len) {
+    if (wal_pending.empty() || wal_pending.back().canvas_id != room->id ||
+        wal_pending.back().gen != room->wal_gen) {
+        wal_pending.push_back({room->id, room->wal_gen, {}});
+    }
+    WalRecordHeader h;
+    memset(&h, 0, sizeof(h));
+    h.len = len;
+    h.type = type;
+    h.layer = layer;
+    h.a = a;
+    h.b = b;
+    if (premultiplied_layers && (type == WAL_LAYER_TILES || type == WAL_LAYER_REPLACE)) h.flags = WAL_PREMULTIPLIED;
+    h.checksum = wal_checksum(h, payload);
+    
+    vector<uint8_t>& out = wal_pending.back().bytes;
+    const uint8_t* hdr = (const uint8_t*)&h;
+    out.insert(out.end(), hdr, hdr + sizeof(h));
+    out.insert(out.end(), payload, payload + len);
+    room->wal_bytes += sizeof(h) + len;
+    wal_records++;
+}
+
+// Log one applied change. Caller holds room->mutex.
+void wal_log(CanvasRoom* room, uint8_t type, int layer, int a, int b,
+             const uint8_t* payload = nullptr, size_t len = 0) {
+    pthread_mutex_lock(&wal_mutex);
+    wal_put(room, type, layer, a, b, payload, len);
+    pthread_mutex_unlock(&wal_mutex);
+}
+
+// Log a batch of applied draw/line ops. Caller holds room->mutex.
+void wal_append_ops(CanvasRoom* room, const RasterOp* ops, int n) {
+    pthread_mutex_lock(&wal_mutex);
+    for (int i = 0; i < n; i++) {
+        wal_put(room, WAL_DRAW, ops[i].msg.layer_id, 0, 0, (const uint8_t*)&ops[i].msg, sizeof(UDPMessage));
+    }
+    pthread_mutex_unlock(&wal_mutex);
+}
+
+// Make a file created, renamed or removed in `dir` survive a crash
+static void fsync_dir(const char* dir) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+}
+
+static bool write_all(int fd, const uint8_t* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Group commit: take everything pending, append it to each canvas's current
+// log file and sync every file touched once.
+void* wal_writer_thread(void* arg) {
+    (void)arg;
+    map<int, pair<uint32_t, int>> files; // canvas -> (generation, fd)
+    vector<WalChunk> batch;
+    vector<int> touched;
+    
+    while (1) {
+        usleep(WAL_FLUSH_MS * 1000);
+        pthread_mutex_lock(&wal_mutex);
+        batch.swap(wal_pending);
+        pthread_mutex_unlock(&wal_mutex);
+        if (batch.empty()) continue;
         
-        if (i > run_start) {
-            // We have a run of (i - run_start + 1) bytes
-            // Length is at least 2
-            int count = (i - run_start + 1);
-            out.push_back((uint8_t)(257 - count)); // -count + 1 + 256 = 257 - count
-            out.push_back(data[run_start]);
-            i++;
-        } else {
-            // Literal Run (Non-repeating sequence)
-            size_t j = i;
-            
-            // Advance j until we hit a run of 3 identical bytes OR max literal length (128)
-            while (j < len && (j - i) < 128) {
-                if (j + 2 < len && data[j] == data[j+1] && data[j] == data[j+2]) {
-                    break; // Found a run of 3, stop literal here
+        touched.clear();
+        size_t bytes = 0;
+        for (WalChunk& chunk : batch) {
+            auto it = files.find(chunk.canvas_id);
+            if (it != files.end() && it->second.first != chunk.gen) {
+                // Generation moved on (snapshot): finish the old file
+                fdatasync(it->second.second);
+                close(it->second.second);
+                touched.erase(remove(touched.begin(), touched.end(), it->second.second), touched.end());
+                files.erase(it);
+                it = files.end();
+            }
+            if (it == files.end()) {
+                string path = wal_path(chunk.canvas_id, chunk.gen);
+                int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+                if (fd < 0) {
+                    printf("[Server][WAL] ERROR: Cannot open %s (%s)\n", path.c_str(), strerror(errno));
+                    continue;
                 }
-                j++;
+                fsync_dir(WAL_DIR); // The new file's directory entry
+                it = files.insert({chunk.canvas_id, {chunk.gen, fd}}).first;
             }
-            
-            int count = (j - i);
-            out.push_back((uint8_t)(count - 1)); // 0 means 1 literal byte
-            
-            for (size_t k = 0; k < (size_t)count; k++) {
-                out.push_back(data[i + k]);
+            int fd = it->second.second;
+            if (!write_all(fd, chunk.bytes.data(), chunk.bytes.size())) {
+                printf("[Server][WAL] ERROR: Write to canvas #%d log failed (%s)\n", chunk.canvas_id, strerror(errno));
+                continue;
             }
-            
-            i = j;
+            bytes += chunk.bytes.size();
+            if (find(touched.begin(), touched.end(), fd) == touched.end()) touched.push_back(fd);
         }
+        
+        uint64_t sync_start = now_ns();
+        for (int fd : touched) fdatasync(fd);
+        uint64_t sync_ns = now_ns() - sync_start;
+        
+        wal_bytes_written += bytes;
+        wal_flushes++;
+        wal_sync_sum_ns += sync_ns;
+        uint64_t prev = wal_sync_max_ns.load(std::memory_order_relaxed);
+        while (sync_ns > prev && !wal_sync_max_ns.compare_exchange_weak(prev, sync_ns)) {}
+        batch.clear();
     }
-    return out;
+    return NULL;
 }
 
-vector<uint8_t> packbits_decompress(const vector<uint8_t>& in) {
-    vector<uint8_t> out;
-    size_t i = 0;
-    while (i < in.size()) {
-        int8_t n = (int8_t)in[i++];
-        if (n == -128) continue; // No-op
+// Log generations of a canvas, oldest first
+vector<uint32_t> wal_list_logs(int canvas_id) {
+    vector<uint32_t> gens;
+    DIR* dir = opendir(WAL_DIR);
+    if (!dir) return gens;
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != NULL) {
+        int id;
+        uint32_t gen;
+        if (sscanf(ent->d_name, "canvas_%d_%u.wal", &id, &gen) == 2 && id == canvas_id) gens.push_back(gen);
+    }
+    closedir(dir);
+    sort(gens.begin(), gens.end());
+    return gens;
+}
+
+// Drop the logs a durable snapshot already contains
+void wal_remove_logs(int canvas_id, uint32_t up_to_gen) {
+    for (uint32_t gen : wal_list_logs(canvas_id)) {
+        if (gen <= up_to_gen) unlink(wal_path(canvas_id, gen).c_str());
+    }
+}
+
+// Re-apply one log file. Stops at the first torn or corrupt record (the tail
+// of a write cut short by a crash). Caller holds room->mutex.
+long wal_replay_file(CanvasRoom* room, const string& path, size_t* bytes) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return -1;
+    vector<uint8_t> data;
+    uint8_t buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) data.insert(data.end(), buf, buf + n);
+    fclose(f);
+    *bytes += data.size();
+    
+    long records = 0;
+    size_t pos = 0;
+    while (pos < data.size()) {
+        WalRecordHeader h;
+        if (data.size() - pos < sizeof(h)) break;
+        memcpy(&h, &data[pos], sizeof(h));
+        const uint8_t* payload = &data[pos + sizeof(h)];
+        if (h.len > data.size() - pos - sizeof(h) || wal_checksum(h, payload) != h.checksum) break;
+        pos += sizeof(h) + h.len;
+        records++;
         
-        if (n >= 0) {
-            // 0 to 127: Copy N+1 bytes
-            int count = n + 1;
-            for (int k = 0; k < count && i < in.size(); k++) {
-                out.push_back(in[i++]);
+        bool layer_ok = h.layer > 0 && h.layer < room->layers.size();
+        switch (h.type) {
+            case WAL_DRAW: {
+                if (h.len != sizeof(UDPMessage)) break;
+                UDPMessage msg;
+                memcpy(&msg, payload, sizeof(msg));
+                if (msg.type == MSG_DRAW) apply_draw(room, msg);
+                else if (msg.type == MSG_LINE) apply_line(room, msg);
+                break;
             }
-        } else {
-            // -1 to -127: Repeat next byte (1-N) times
-            int count = 1 - n;
-            if (i < in.size()) {
-                uint8_t val = in[i++];
-                for (int k = 0; k < count; k++) {
-                    out.push_back(val);
+            case WAL_LAYER_ADD:
+                room->insert_layer(h.a);
+                break;
+            case WAL_LAYER_DEL:
+                room->delete_layer(h.layer);
+                break;
+            case WAL_LAYER_REORDER:
+                room->reorder_layer(h.a, h.b);
+                break;
+            case WAL_LAYER_MOVE:
+                if (layer_ok) move_layer_buffer(room->layers[h.layer], h.a, h.b);
+                break;
+            case WAL_LAYER_REPLACE:
+                if (layer_ok) room->layers[h.layer]->init_transparent();
+                // fall through
+            case WAL_LAYER_TILES:
+                if (layer_ok) {
+                    room->layers[h.layer]->decode_tile_list(payload, h.len,
+                                                            alpha_convert_from(h.flags & WAL_PREMULTIPLIED));
                 }
+                break;
+        }
+    }
+    if (pos < data.size()) {
+        printf("[Server][Recover] %s: ignoring %zu bytes of torn or corrupt tail\n", path.c_str(), data.size() - pos);
+    }
+    return records;
+}
+
+// Startup: bring every canvas that has logs up to date (snapshot + log
+// tail). Returns true if anything was replayed.
+bool recover_from_wal() {
+    mkdir(WAL_DIR, 0755);
+    vector<int> ids;
+    DIR* dir = opendir(WAL_DIR);
+    if (!dir) {
+        printf("[Server][Recover] ERROR: Cannot open %s/ (%s), ops will not be logged\n", WAL_DIR, strerror(errno));
+        return false;
+    }
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != NULL) {
+        int id;
+        uint32_t gen;
+        if (sscanf(ent->d_name, "canvas_%d_%u.wal", &id, &gen) != 2) continue;
+        if (id < 0 || id >= MAX_CANVASES) continue;
+        if (find(ids.begin(), ids.end(), id) == ids.end()) ids.push_back(id);
+    }
+    closedir(dir);
+    if (ids.empty()) return false;
+    
+    sort(ids.begin(), ids.end());
+    uint64_t start_ns = now_ns();
+    long total_records = 0;
+    bool replayed = false;
+    for (int id : ids) {
+        uint64_t canvas_start = now_ns();
+        CanvasRoom* room = get_or_create_canvas(id); // Decodes its snapshot, if any
+        pthread_mutex_lock(&room->mutex);
+        uint32_t snap_gen = room->stored_gen;
+        long records = 0;
+        size_t bytes = 0;
+        int files = 0;
+        for (uint32_t gen : wal_list_logs(id)) {
+            string path = wal_path(id, gen);
+            if (gen <= snap_gen) {
+                unlink(path.c_str()); // Already in canvas.bin
+                continue;
             }
+            long n = wal_replay_file(room, path, &bytes);
+            if (n > 0) records += n;
+            files++;
+            room->wal_gen = gen + 1;
+        }
+        if (files > 0) {
+            room->dirty = true;
+            room->old_logs = true;
+            replayed = true;
+        }
+        pthread_mutex_unlock(&room->mutex);
+        total_records += records;
+        if (files > 0) {
+            printf("[Server][Recover] Canvas #%d: replayed %ld ops from %d logs (%.1f KB) in %.2f ms\n",
+                   id, records, files, bytes / 1024.0, (now_ns() - canvas_start) / 1e6);
         }
     }
-    return out;
+    if (replayed) {
+        printf("[Server][Recover] Replayed %ld ops in %.2f ms\n", total_records, (now_ns() - start_ns) / 1e6);
+    }
+    return replayed;
+}
+
+/*****************************************************************************
+   CODEC POOL
+ *****************************************************************************/
+
+// Worker threads for the CPU-bound halves of save and load (tile encoding,
+// chunk and canvas.json decoding). codec_parallel_for(n, fn) runs fn(0..n-1)
+// on the pool and the calling thread and returns when all are done; results
+// go to per-index slots, so output order is whatever the caller writes them
+// in. One batch runs at a time: a second caller (a join decoding its canvas
+// while the saver encodes) just runs its batch inline.
+
+int codec_threads = 0; // --codec-threads (total, caller included; 0 = one per core)
+
+struct CodecPool {
+    vector<pthread_t> threads;
+    pthread_mutex_t batch_mutex = PTHREAD_MUTEX_INITIALIZER; // Held by the running batch's caller
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+    pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+    
+    // Current batch (mutex, except next)
+    const function<void(int)>* fn = nullptr;
+    int count = 0;
+    std::atomic<int> next{0};
+    int busy = 0;           // Workers still in the batch
+    uint64_t batch_id = 0;
+};
+
+CodecPool codec_pool;
+
+static void codec_run_batch(const function<void(int)>& fn, int count) {
+    int i;
+    while ((i = codec_pool.next.fetch_add(1)) < count) fn(i);
+}
+
+void* codec_worker_thread(void* arg) {
+    (void)arg;
+    uint64_t seen = 0;
+    while (1) {
+        pthread_mutex_lock(&codec_pool.mutex);
+        while (codec_pool.batch_id == seen) pthread_cond_wait(&codec_pool.work_cond, &codec_pool.mutex);
+        seen = codec_pool.batch_id;
+        const function<void(int)>* fn = codec_pool.fn;
+        int count = codec_pool.count;
+        pthread_mutex_unlock(&codec_pool.mutex);
+        
+        codec_run_batch(*fn, count);
+        
+        pthread_mutex_lock(&codec_pool.mutex);
+        if (--codec_pool.busy == 0) pthread_cond_signal(&codec_pool.done_cond);
+        pthread_mutex_unlock(&codec_pool.mutex);
+    }
+    return NULL;
 }
 
-bool is_base64(unsigned char c) {
-    return (isalnum(c) || (c == '+') || (c == '/'));
+void start_codec_pool() {
+    if (codec_threads <= 0) codec_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (codec_threads < 1) codec_threads = 1;
+    for (int i = 1; i < codec_threads; i++) {
+        pthread_t th;
+        if (pthread_create(&th, NULL, codec_worker_thread, NULL) != 0) break;
+        codec_pool.threads.push_back(th);
+    }
+    printf("[Server][Init] Codec pool: %zu threads\n", codec_pool.threads.size() + 1);
 }
 
-string base64_encode(const unsigned char* data, size_t len) {
-    string out;
-    out.reserve(4 * ((len + 2) / 3));
-    int val = 0, valb = -6;
-    for (size_t i = 0; i < len; i++) {
-        val = (val << 8) + data[i];
-        valb += 8;
-        while (valb >= 0) {
-            out.push_back(b64_chars[(val >> valb) & 0x3F]);
-            valb -= 6;
-        }
+void codec_parallel_for(int count, const function<void(int)>& fn) {
+    if (codec_pool.threads.empty() || count < 2 || pthread_mutex_trylock(&codec_pool.batch_mutex) != 0) {
+        for (int i = 0; i < count; i++) fn(i);
+        return;
     }
-    if (valb > -6) out.push_back(b64_chars[((val << 8) >> (valb + 8)) & 0x3F]);
-    while (out.size() % 4) out.push_back('=');
-    return out;
+    pthread_mutex_lock(&codec_pool.mutex);
+    codec_pool.fn = &fn;
+    codec_pool.count = count;
+    codec_pool.next = 0;
+    codec_pool.busy = codec_pool.threads.size();
+    codec_pool.batch_id++;
+    pthread_cond_broadcast(&codec_pool.work_cond);
+    pthread_mutex_unlock(&codec_pool.mutex);
+    
+    codec_run_batch(fn, count);
+    
+    pthread_mutex_lock(&codec_pool.mutex);
+    while (codec_pool.busy > 0) pthread_cond_wait(&codec_pool.done_cond, &codec_pool.mutex);
+    pthread_mutex_unlock(&codec_pool.mutex);
+    pthread_mutex_unlock(&codec_pool.batch_mutex);
 }
 
-vector<unsigned char> base64_decode(const string& encoded_string) {
-    int in_len = encoded_string.size();
-    int i = 0, j = 0, in_ = 0;
-    unsigned char char_array_4[4], char_array_3[3];
-    vector<unsigned char> ret;
+/*****************************************************************************
+   PERSISTENCE - canvas.bin (chunked, memory-mapped)
+ *****************************************************************************/
 
-    while (in_len-- && encoded_string[in_] != '=' && is_base64(encoded_string[in_])) {
-        char_array_4[i++] = encoded_string[in_]; in_++;
-        if (i == 4) {
-            for (i = 0; i < 4; i++)
-                char_array_4[i] = b64_chars.find(char_array_4[i]);
+// canvas.bin layout:
+//   StoreHeader
+//   chunk payloads (one per drawable layer, a tile list as in codec.h)
+//   StoreChunkEntry[chunk_count] at index_offset, sorted by canvas then layer
+// The file is mapped at startup and only the index is read; a canvas is
+// decoded from the mapping when its room is first created.
 
-            char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-            char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-            char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+#define CANVAS_STORE_PATH "canvas.bin"
+#define CANVAS_STORE_MAGIC 0x42564343 // "CCVB"
+#define CANVAS_STORE_FORMAT 1
+#define LEGACY_JSON_PATH "canvas.json"
 
-            for (i = 0; i < 3; i++)
-                ret.push_back(char_array_3[i]);
-            i = 0;
-        }
-    }
+enum StoreCodec {
+    STORE_CODEC_TILES = 0 // Tile list (codec.h)
+};
 
-    if (i) {
-        for (j = i; j < 4; j++) char_array_4[j] = 0;
-        for (j = 0; j < 4; j++) char_array_4[j] = b64_chars.find(char_array_4[j]);
+#define STORE_CHUNK_PREMULTIPLIED 0x01 // Pixels are premultiplied (else straight)
 
-        char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-        char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-        char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+struct StoreHeader {
+    uint32_t magic;
+    uint16_t format;
+    uint16_t width, height;
+    uint16_t reserved;
+    uint32_t chunk_count;
+    uint64_t index_offset;
+} __attribute__((packed));
 
-        for (j = 0; j < i - 1; j++) ret.push_back(char_array_3[j]);
+struct StoreChunkEntry {
+    int32_t  canvas_id;
+    uint16_t layer;       // Drawable layer index (1-based)
+    uint8_t  codec;       // StoreCodec
+    uint8_t  flags;       // STORE_CHUNK_PREMULTIPLIED
+    uint32_t version;     // Layer::version when encoded
+    uint64_t offset;      // From the start of the file
+    uint64_t length;
+    uint32_t wal_gen;     // Last log generation folded into this chunk
+} __attribute__((packed));
+
+// One mapping of canvas.bin, unmapped once nothing uses it
+struct StoreMapping {
+    int fd;
+    const uint8_t* base;
+    size_t size;
+    ~StoreMapping() {
+        munmap((void*)base, size);
+        close(fd);
     }
+};
 
-    return ret;
+// The mapped canvas.bin (canvases_mutex). index only lists canvases that
+// have no room yet; once a room is created it owns its layers. A canvas
+// being loaded keeps its own reference to the mapping it was indexed from,
+// so a save can map the next file meanwhile.
+struct CanvasStore {
+    shared_ptr<StoreMapping> mapping;
+    const uint8_t* base = nullptr;
+    size_t size = 0;
+    uint64_t index_offset = 0;
+    uint32_t chunk_count = 0;
+    map<int, vector<StoreChunkEntry>> index;
+};
+
+CanvasStore store;
+
+void close_canvas_store() {
+    store.mapping.reset();
+    store.base = nullptr;
+    store.size = 0;
+    store.index_offset = 0;
+    store.chunk_count = 0;
+    store.index.clear();
+}
+
+// Add the mapped index's chunks of canvas `only` (-1: every canvas) to
+// store.index. Canvases that have a room are left out. Caller holds
+// canvases_mutex.
+void index_store_chunks(int only) {
+    for (uint32_t i = 0; i < store.chunk_count; i++) {
+        StoreChunkEntry e;
+        memcpy(&e, store.base + store.index_offset + i * sizeof(e), sizeof(e));
+        if (only >= 0 && e.canvas_id != only) continue;
+        if (e.offset > store.size || e.length > store.size - e.offset ||
+            e.canvas_id < 0 || e.canvas_id >= MAX_CANVASES || e.layer < 1 || e.layer >= MAX_LAYERS) {
+            printf("[Server][Load] Skipping bad chunk %u in %s\n", i, CANVAS_STORE_PATH);
+            continue;
+        }
+        if (canvases.count(e.canvas_id)) continue;
+        store.index[e.canvas_id].push_back(e);
+    }
 }
 
-string encode_layer(Layer* layer) {
-    vector<uint32_t> buffer;
-    buffer.reserve(WIDTH * HEIGHT);
+// Map canvas.bin and read its index. Canvases that already have a room are
+// left out. Caller holds canvases_mutex (or is single-threaded at startup).
+bool open_canvas_store() {
+    close_canvas_store();
+    int fd = open(CANVAS_STORE_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(StoreHeader)) {
+        printf("[Server][Load] ERROR: %s is truncated\n", CANVAS_STORE_PATH);
+        close(fd);
+        return false;
+    }
+    void* map_base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map_base == MAP_FAILED) {
+        perror("[Server][Load] mmap");
+        close(fd);
+        return false;
+    }
+    store.mapping.reset(new StoreMapping{fd, (const uint8_t*)map_base, (size_t)st.st_size});
+    store.base = store.mapping->base;
+    store.size = store.mapping->size;
+    
+    StoreHeader hdr;
+    memcpy(&hdr, store.base, sizeof(hdr));
+    if (hdr.magic != CANVAS_STORE_MAGIC || hdr.format != CANVAS_STORE_FORMAT) {
+        printf("[Server][Load] ERROR: %s has an unknown format\n", CANVAS_STORE_PATH);
+        close_canvas_store();
+        return false;
+    }
+    if (hdr.width != WIDTH || hdr.height != HEIGHT) {
+        printf("[Server][Load] ERROR: %s is %dx%d, server is %dx%d\n",
+               CANVAS_STORE_PATH, hdr.width, hdr.height, WIDTH, HEIGHT);
+        close_canvas_store();
+        return false;
+    }
+    if (hdr.index_offset > store.size ||
+        (store.size - hdr.index_offset) / sizeof(StoreChunkEntry) < hdr.chunk_count) {
+        printf("[Server][Load] ERROR: %s index is out of bounds\n", CANVAS_STORE_PATH);
+        close_canvas_store();
+        return false;
+    }
     
-    for (int y = 0; y < HEIGHT; y++) {
-        for (int x = 0; x < WIDTH; x++) {
-            Pixel p = layer->pixels[x][y];
-            uint32_t packed = (p.r << 24) | (p.g << 16) | (p.b << 8) | p.a;
-            buffer.push_back(packed);
+    store.index_offset = hdr.index_offset;
+    store.chunk_count = hdr.chunk_count;
+    index_store_chunks(-1);
+    return true;
+}
+
+// Fill a freshly created room from its chunks in the mapping base. The
+// layers are decoded in parallel on the codec pool. Runs without
+// canvases_mutex: nothing else can reach the room yet.
+void load_stored_canvas(CanvasRoom* room, const vector<StoreChunkEntry>& entries, const uint8_t* base) {
+    if (entries.empty()) return;
+    uint64_t start_ns = now_ns();
+    
+    for (const StoreChunkEntry& e : entries) {
+        while (room->layers.size() <= e.layer) {
+            Layer* newLayer = new Layer();
+            newLayer->init_transparent();
+            room->layers.push_back(newLayer);
         }
     }
     
-    // Compress using PackBits
-    vector<uint8_t> compressed = packbits_compress((const uint8_t*)buffer.data(), buffer.size() * sizeof(uint32_t));
+    vector<char> decoded(entries.size());
+    codec_parallel_for(entries.size(), [&](int i) {
+        const StoreChunkEntry& e = entries[i];
+        AlphaConvert convert = alpha_convert_from(e.flags & STORE_CHUNK_PREMULTIPLIED);
+        decoded[i] = e.codec == STORE_CODEC_TILES &&
+                     room->layers[e.layer]->decode_tile_list(base + e.offset, e.length, convert) >= 0;
+    });
+    
+    size_t bytes = 0;
+    int converted = 0;
+    for (size_t i = 0; i < entries.size(); i++) {
+        const StoreChunkEntry& e = entries[i];
+        Layer* layer = room->layers[e.layer];
+        if (!decoded[i]) {
+            printf("[Server][Load] ERROR: Canvas #%d layer %d chunk is corrupt, left empty\n", room->id, e.layer);
+            layer->init_transparent();
+            continue;
+        }
+        layer->version = e.version;
+        bytes += e.length;
+        room->stored_gen = e.wal_gen;
+        room->wal_gen = e.wal_gen + 1;
+        if (alpha_convert_from(e.flags & STORE_CHUNK_PREMULTIPLIED) != ALPHA_AS_IS) {
+            converted++;
+            continue; // Stays dirty: the next save writes it in this server's form
+        }
+        // Unchanged layers are written back from this copy
+        const uint8_t* chunk = base + e.offset;
+        layer->cached_chunk = make_shared<vector<uint8_t>>(chunk, chunk + e.length);
+        layer->dirty = false;
+    }
+    room->dirty = converted > 0;
     
-    return base64_encode(compressed.data(), compressed.size());
+    printf("[Server][Load] Canvas #%d: %zu layers decoded from %s (%zu bytes, %.2f ms)\n",
+           room->id, entries.size(), CANVAS_STORE_PATH, bytes, (now_ns() - start_ns) / 1e6);
+    if (converted) {
+        printf("[Server][Load] Canvas #%d: %d layers converted to %s alpha\n",
+               room->id, converted, premultiplied_layers ? "premultiplied" : "straight");
+    }
+    rooms_loaded++;
 }
 
-void decode_layer(Layer* layer, const string& b64, int json_width, int json_height) {
-    vector<unsigned char> compressed = base64_decode(b64);
-    
-    // Decompress using PackBits
-    vector<uint8_t> data = packbits_decompress(compressed);
+// A new room for canvas_id, filled from canvas.bin if it has the canvas.
+// Caller holds canvases_mutex and has set canvas_loading; the lock is
+// dropped while the layers are decoded and the logs listed. The canvas stays
+// in store.index until then, so a save meanwhile still writes its chunks.
+CanvasRoom* load_canvas_room(int canvas_id) {
+    vector<StoreChunkEntry> entries;
+    auto it = store.index.find(canvas_id);
+    if (it != store.index.end()) entries = it->second;
+    shared_ptr<StoreMapping> mapping = store.mapping; // Outlives a remap by a save
+    pthread_mutex_unlock(&canvases_mutex);
     
-    uint32_t* pixels = (uint32_t*)data.data();
-    int count = 0;
-    int max_pixels = data.size() / sizeof(uint32_t);
+    CanvasRoom* room = new CanvasRoom();
+    room->init(canvas_id);
+    if (mapping) load_stored_canvas(room, entries, mapping->base);
+    // Never log into a generation already on disk: recovery replays in
+    // generation order, so new records must sort after any leftovers
+    vector<uint32_t> gens = wal_list_logs(canvas_id);
+    if (!gens.empty() && gens.back() >= room->wal_gen) room->wal_gen = gens.back() + 1;
+    room->old_logs = !gens.empty();
+    mapping.reset();
     
-    // Iterate over the stored dimensions to consume the stream correctly
-    for (int y = 0; y < json_height; y++) {
-        for (int x = 0; x < json_width; x++) {
-            if (count < max_pixels) {
-                uint32_t p = pixels[count++];
-                
-                // Only copy if within current bounds
-                if (x < WIDTH && y < HEIGHT) {
-                    layer->pixels[x][y].r = (p >> 24) & 0xFF;
-                    layer->pixels[x][y].g = (p >> 16) & 0xFF;
-                    layer->pixels[x][y].b = (p >> 8) & 0xFF;
-                    layer->pixels[x][y].a = p & 0xFF;
-                }
-            }
-        }
-    }
+    pthread_mutex_lock(&canvases_mutex);
+    store.index.erase(canvas_id); // The room owns its layers now
+    return room;
 }
 
-void save_all_canvases() {
-    // 1. Global Optimization: Check if ANYTHING is dirty
+// One chunk of the next canvas.bin. Exactly one of snapshot / stored is set
+// until the writer has produced the bytes.
+struct SaveChunk {
+    StoreChunkEntry entry;              // offset/length filled in by the writer
+    shared_ptr<vector<uint8_t>> chunk;  // Encoded tile list (room layers)
+    Layer* snapshot;                    // Shared tiles still to be encoded into chunk
+    Layer* layer;                       // Live layer that gets chunk back (finish_save), if re-encoded
+    vector<CollapsedTile> collapsed;    // Snapshot tiles the writer collapsed, for layer too
+    const uint8_t* stored;              // Bytes in the current mapping (stored-only canvases)
+};
+
+// Everything a save needs, captured under the locks and written without them
+struct SaveJob {
+    vector<SaveChunk> chunks;
+    vector<pair<int, uint32_t>> folded_logs; // Canvas, last generation in this file
+    int saved_count = 0;
+    int encoded = 0;
+    uint64_t pause_sum_ns = 0, pause_max_ns = 0; // room->mutex hold per saved room
+    int pause_max_room = -1;
+};
+
+// Collect what to write, in canvas id order. Each saved room is locked just
+// long enough to share its dirty layers' tiles (Layer::share) and to move it
+// to the next log generation; clean layers reuse their last chunk and
+// canvases nobody has joined point into the current mapping. Nothing here
+// scans pixels or touches the disk. Returns false if nothing changed.
+// Caller holds canvases_mutex.
+bool capture_save(SaveJob& job) {
     bool any_dirty = false;
     for (auto& pair : canvases) {
         if (pair.second->dirty) {
@@ -795,86 +2581,322 @@ void save_all_canvases() {
             break;
         }
     }
-    if (!any_dirty) return; // Silent return if nothing changed
-
-    printf("\n[Server][Save] ========== SAVING DIRTY CANVASES ==========\n");
-    
-    FILE* f = fopen("canvas.json", "w");
-    if (!f) {
-        printf("[Server][Save] ERROR: Cannot open canvas.json\n");
-        return;
-    }
-    
-    fprintf(f, "{\n  \"version\": 2,\n  \"width\": %d,\n  \"height\": %d,\n  \"canvases\": [\n", WIDTH, HEIGHT);
-    
-    bool first_canvas = true;
-    int saved_count = 0;
-    
-    for (auto& pair : canvases) {
-        int c = pair.first;
-        CanvasRoom* room = pair.second;
+    if (!any_dirty) return false; // Silent return if nothing changed
+
+    // Walk loaded rooms and stored-only canvases together, in id order
+    auto room_it = canvases.begin();
+    auto stored_it = store.index.begin();
+    while (room_it != canvases.end() || stored_it != store.index.end()) {
+        bool take_room = stored_it == store.index.end() ||
+                         (room_it != canvases.end() && room_it->first < stored_it->first);
         
-        // Check if has content
-        bool has_content = false;
-        for (size_t l = 1; l < room->layers.size() && !has_content; l++) {
-            for (int x = 0; x < WIDTH && !has_content; x++) {
-                for (int y = 0; y < HEIGHT && !has_content; y++) {
-                    if (room->layers[l]->pixels[x][y].a > 0) has_content = true;
-                }
+        if (!take_room) {
+            for (const StoreChunkEntry& e : stored_it->second) {
+                SaveChunk sc;
+                sc.entry = e;
+                sc.snapshot = nullptr;
+                sc.layer = nullptr;
+                sc.stored = store.base + e.offset;
+                job.chunks.push_back(sc);
             }
+            ++stored_it;
+            job.saved_count++;
+            continue;
         }
-        if (!has_content && !room->active) continue;
         
-        if (!first_canvas) fprintf(f, ",\n");
-        first_canvas = false;
+        int c = room_it->first;
+        CanvasRoom* room = room_it->second;
+        ++room_it;
         
         pthread_mutex_lock(&room->mutex);
+        uint64_t lock_ns = now_ns();
         
-        // Log only if this specific room changed
-        if (room->dirty) {
-            printf("[Server][Save] Saving Canvas #%d...\n", c);
+        // Check if has content. Erased tiles still count until a save (or a
+        // join) collapses them; the save hands its collapses back to the
+        // layer in finish_save, so the next one sees the room as empty.
+        bool has_content = room->active;
+        for (size_t l = 1; l < room->layers.size() && !has_content; l++) {
+            has_content = room->layers[l]->has_content();
+        }
+        // An empty room is left out of canvas.bin unless it has logs: then its
+        // empty layers are written so the file records the generations it
+        // covers, and the logs are folded like any other room's
+        if (!has_content && room->wal_bytes == 0 && !room->old_logs) {
+            room->dirty = false; // Nothing worth writing; a reload starts the same
+            pthread_mutex_unlock(&room->mutex);
+            continue;
         }
+        bool was_dirty = room->dirty;
         
-        fprintf(f, "    {\n      \"id\": %d,\n      \"layer_count\": %zu,\n      \"layers\": [\n", c, room->layers.size() - 1);
+        // Ops applied from here on belong to the next log generation
+        uint32_t snap_gen = room->wal_gen++;
+        room->wal_bytes = 0;
+        job.folded_logs.push_back({c, snap_gen});
         
+        int shared = 0;
         for (size_t l = 1; l < room->layers.size(); l++) {
             Layer* layer = room->layers[l];
+            SaveChunk sc;
+            sc.snapshot = nullptr;
+            sc.layer = nullptr;
+            sc.stored = nullptr;
             
             // CACHING LOGIC
-            if (layer->dirty || layer->cached_b64.empty()) {
-                // Re-encode only if dirty
-                layer->cached_b64 = encode_layer(layer);
+            if (layer->dirty || !layer->cached_chunk) {
+                // Re-encode only if dirty, from a copy-on-write snapshot into
+                // a chunk of the save's own; finish_save hands it back
+                sc.snapshot = layer->share();
+                sc.layer = layer;
+                sc.chunk = make_shared<vector<uint8_t>>();
+                layer->cached_chunk.reset();
+                layer->version++;
                 layer->dirty = false;
+                shared++;
+            } else {
+                sc.chunk = layer->cached_chunk;
             }
             
-            fprintf(f, "        {\"index\": %zu, \"data\": \"%s\"}%s\n", l, layer->cached_b64.c_str(), (l < room->layers.size() - 1) ? "," : "");
+            memset(&sc.entry, 0, sizeof(sc.entry));
+            sc.entry.canvas_id = c;
+            sc.entry.layer = l;
+            sc.entry.codec = STORE_CODEC_TILES;
+            sc.entry.flags = premultiplied_layers ? STORE_CHUNK_PREMULTIPLIED : 0;
+            sc.entry.version = layer->version;
+            sc.entry.wal_gen = snap_gen;
+            job.chunks.push_back(sc);
         }
         
-        fprintf(f, "      ]\n    }");
-        
         room->dirty = false; // Reset room dirty flag
         pthread_mutex_unlock(&room->mutex);
-        saved_count++;
+        uint64_t pause_ns = now_ns() - lock_ns;
+        
+        job.saved_count++;
+        job.encoded += shared;
+        job.pause_sum_ns += pause_ns;
+        if (pause_ns > job.pause_max_ns) {
+            job.pause_max_ns = pause_ns;
+            job.pause_max_room = c;
+        }
+        // Log only if this specific room changed
+        if (was_dirty) {
+            printf("[Server][Save] Canvas #%d captured (%d layers shared), paused %.1f us\n",
+                   c, shared, pause_ns / 1e3);
+        }
     }
+    return true;
+}
+
+// Encode the captured snapshots and write canvas.bin.tmp, then rename it
+// over canvas.bin. Takes no locks: the tiles it reads are shared
+// copy-on-write and the mapping is only replaced by finish_save.
+bool write_save(SaveJob& job) {
+    uint64_t start_ns = now_ns();
+    
+    // Collapse the snapshot tiles erased back to one colour, encode the ones
+    // written since they were last encoded on the codec pool, then assemble
+    // each layer's tile list from the cached payloads in order
+    vector<pair<Layer*, int>> tiles;
+    for (SaveChunk& sc : job.chunks) {
+        if (!sc.snapshot) continue;
+        Layer* snap = sc.snapshot;
+        snap->collapse_uniform_tiles(&sc.collapsed);
+        for (int ty = snap->by0; ty < snap->by1; ty++) {
+            for (int tx = snap->bx0; tx < snap->bx1; tx++) {
+                const Tile& t = snap->tiles[ty][tx];
+                if (t.buf && !t.buf->enc.load()) tiles.push_back({snap, ty * TILES_X + tx});
+            }
+        }
+    }
+    codec_parallel_for(tiles.size(), [&](int i) {
+        bool hit;
+        tiles[i].first->encoded_tile(tiles[i].second % TILES_X, tiles[i].second / TILES_X, &hit);
+    });
+    for (SaveChunk& sc : job.chunks) {
+        if (!sc.snapshot) continue;
+        sc.snapshot->encode_tile_list(*sc.chunk, nullptr);
+        delete sc.snapshot; // Releases the shared tiles
+        sc.snapshot = nullptr;
+    }
+    uint64_t encode_ns = now_ns() - start_ns;
     
-    fprintf(f, "\n  ]\n}\n");
-    fclose(f);
+    const char* tmp_path = CANVAS_STORE_PATH ".tmp";
+    FILE* f = fopen(tmp_path, "wb");
+    if (!f) {
+        printf("[Server][Save] ERROR: Cannot open %s\n", tmp_path);
+        return false;
+    }
+    
+    StoreHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = CANVAS_STORE_MAGIC;
+    hdr.format = CANVAS_STORE_FORMAT;
+    hdr.width = WIDTH;
+    hdr.height = HEIGHT;
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    
+    vector<StoreChunkEntry> entries;
+    uint64_t offset = sizeof(hdr);
+    for (SaveChunk& sc : job.chunks) {
+        StoreChunkEntry e = sc.entry;
+        const uint8_t* data = sc.stored;
+        if (!data) {
+            data = sc.chunk->data();
+            e.length = sc.chunk->size();
+        }
+        fwrite(data, 1, e.length, f);
+        e.offset = offset;
+        offset += e.length;
+        entries.push_back(e);
+    }
     
-    printf("[Server][Save] Saved %d canvases\n", saved_count);
+    hdr.chunk_count = entries.size();
+    hdr.index_offset = offset;
+    fwrite(entries.data(), sizeof(StoreChunkEntry), entries.size(), f);
+    fseek(f, 0, SEEK_SET);
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    
+    bool ok = fflush(f) == 0 && fsync(fileno(f)) == 0 && !ferror(f);
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp_path, CANVAS_STORE_PATH) != 0) {
+        printf("[Server][Save] ERROR: Writing %s failed (%s), keeping the previous file\n",
+               CANVAS_STORE_PATH, strerror(errno));
+        unlink(tmp_path);
+        return false;
+    }
+    fsync_dir("."); // The rename itself
+    
+    printf("[Server][Save] Saved %d canvases (%zu chunks, %d re-encoded, %llu bytes): encode %.2f ms (%zu tiles encoded, %d threads), write %.2f ms\n",
+           job.saved_count, entries.size(), job.encoded,
+           (unsigned long long)(offset + entries.size() * sizeof(StoreChunkEntry)),
+           encode_ns / 1e6, tiles.size(), codec_threads, (now_ns() - start_ns - encode_ns) / 1e6);
+    if (!job.folded_logs.empty()) {
+        printf("[Server][Save] Room pause: avg %.1f us, max %.1f us (canvas #%d) over %zu rooms\n",
+               job.pause_sum_ns / 1e3 / job.folded_logs.size(), job.pause_max_ns / 1e3,
+               job.pause_max_room, job.folded_logs.size());
+    }
+    return true;
+}
+
+// Caller holds canvases_mutex. The re-encoded chunks become their layers'
+// cached_chunk (written or not, they hold what was captured), and the tiles
+// the writer collapsed are collapsed in the layer too, unless the layer was
+// deleted meanwhile. On success the new file is mapped and the logs it
+// covers are deleted; on failure the rooms are marked dirty so the next save
+// retries (their logs are still on disk).
+void finish_save(SaveJob& job, bool ok) {
+    for (SaveChunk& sc : job.chunks) {
+        if (!sc.layer) continue;
+        auto it = canvases.find(sc.entry.canvas_id);
+        if (it != canvases.end()) {
+            CanvasRoom* room = it->second;
+            pthread_mutex_lock(&room->mutex);
+            for (Layer* layer : room->layers) {
+                if (layer == sc.layer && layer->version == sc.entry.version) {
+                    layer->cached_chunk = sc.chunk;
+                    layer->adopt_collapsed(sc.collapsed);
+                    sc.collapsed.clear();
+                }
+            }
+            pthread_mutex_unlock(&room->mutex);
+        }
+        for (const CollapsedTile& ct : sc.collapsed) release_tile_buffer(ct.buf); // Layer is gone
+    }
+    for (auto& folded : job.folded_logs) {
+        auto it = canvases.find(folded.first);
+        if (it == canvases.end()) continue;
+        CanvasRoom* room = it->second;
+        pthread_mutex_lock(&room->mutex);
+        if (ok) {
+            room->old_logs = false; // Deleted below; later ones are in wal_bytes
+        } else {
+            room->dirty = true;
+            room->old_logs = true;
+        }
+        pthread_mutex_unlock(&room->mutex);
+    }
+    if (!ok) return;
+    // Offsets of stored-only canvases moved: map the new file
+    open_canvas_store();
+    for (auto& folded : job.folded_logs) wal_remove_logs(folded.first, folded.second);
+}
+
+// Synchronous save, used at startup. Caller holds canvases_mutex.
+void save_all_canvases() {
+    SaveJob job;
+    if (!capture_save(job)) return;
+    printf("\n[Server][Save] ========== SAVING DIRTY CANVASES ==========\n");
+    finish_save(job, write_save(job));
     printf("[Server][Save] ========== SAVE COMPLETE ==========\n\n");
 }
 
-void load_all_canvases() {
-    printf("\n[Server][Load] ========== LOADING canvas.json ==========\n");
+/*****************************************************************************
+   LEGACY canvas.json IMPORT
+ *****************************************************************************/
+
+// PackBits (canvas.json layers)
+// Header N:
+// [0, 127]   -> (N+1) literal bytes follow
+// [-127, -1] -> Repeat next byte (1-N) times (2 to 128 times)
+// -128       -> No-op
+vector<uint8_t> packbits_decompress(const vector<uint8_t>& in) {
+    vector<uint8_t> out;
+    size_t i = 0;
+    while (i < in.size()) {
+        int8_t n = (int8_t)in[i++];
+        if (n == -128) continue; // No-op
+        
+        if (n >= 0) {
+            // 0 to 127: Copy N+1 bytes
+            int count = n + 1;
+            for (int k = 0; k < count && i < in.size(); k++) {
+                out.push_back(in[i++]);
+            }
+        } else {
+            // -1 to -127: Repeat next byte (1-N) times
+            int count = 1 - n;
+            if (i < in.size()) {
+                uint8_t val = in[i++];
+                for (int k = 0; k < count; k++) {
+                    out.push_back(val);
+                }
+            }
+        }
+    }
+    return out;
+}
+
+void decode_layer(Layer* layer, const char* b64, size_t b64_len, int json_width, int json_height) {
+    vector<uint8_t> compressed(base64_decoded_size(b64_len));
+    compressed.resize(base64_decode(b64, b64_len, compressed.data()));
     
-    FILE* f = fopen("canvas.json", "r");
-    if (!f) {
-        printf("[Server][Load] No canvas.json found - creating default...\n");
-        // Create a default canvas if none exists
-        CanvasRoom* room = get_or_create_canvas(0);
-        save_all_canvases();
-        return;
+    // Decompress using PackBits
+    vector<uint8_t> data = packbits_decompress(compressed);
+    
+    // Copy the overlapping part of each stored row, swap back to RGBA and
+    // hand the result to the layer in one go
+    vector<uint32_t> rgba(WIDTH * HEIGHT, 0);
+    int copy_w = min(json_width, WIDTH);
+    size_t stored_pixels = data.size() / sizeof(uint32_t);
+    for (int y = 0; y < json_height && y < HEIGHT; y++) {
+        size_t row_start = (size_t)y * json_width;
+        if (row_start >= stored_pixels) break;
+        size_t n = min((size_t)copy_w, stored_pixels - row_start);
+        memcpy(&rgba[(size_t)y * WIDTH], data.data() + row_start * sizeof(uint32_t), n * sizeof(uint32_t));
+    }
+    for (size_t i = 0; i < rgba.size(); i++) {
+        rgba[i] = __builtin_bswap32(rgba[i]);
     }
+    // canvas.json is straight alpha
+    if (premultiplied_layers) premultiply_row((uint8_t*)rgba.data(), rgba.size());
+    layer->write_rgba((const uint8_t*)rgba.data());
+}
+
+// One-shot import of the old canvas.json (base64 PackBits per layer): every
+// canvas is decoded into a room so the next save writes it to canvas.bin.
+bool import_canvas_json() {
+    FILE* f = fopen(LEGACY_JSON_PATH, "r");
+    if (!f) return false;
+    printf("[Server][Load] Importing %s...\n", LEGACY_JSON_PATH);
     
     fseek(f, 0, SEEK_END);
     long fsize = ftell(f);
@@ -905,6 +2927,12 @@ void load_all_canvases() {
     
     printf("[Server][Load] JSON Dimensions: %dx%d (Current: %dx%d)\n", json_width, json_height, WIDTH, HEIGHT);
     
+    struct LayerJob {
+        Layer* layer;
+        size_t b64_start, b64_len;
+    };
+    vector<LayerJob> jobs;
+    
     size_t pos = 0;
     while ((pos = json.find("\"id\":", pos)) != string::npos) {
         size_t id_start = pos + 5;
@@ -938,39 +2966,374 @@ void load_all_canvases() {
             size_t data_end = json.find("\"", data_start);
             if (data_end == string::npos) break;
             
-            string b64 = json.substr(data_start, data_end - data_start);
-            
             while (room->layers.size() <= (size_t)(layer_count + 1)) {
                 Layer* newLayer = new Layer();
                 newLayer->init_transparent();
                 room->layers.push_back(newLayer);
             }
-            
-            decode_layer(room->layers[layer_count + 1], b64, json_width, json_height);
-            printf("[Server][Load] Canvas #%d Layer %d loaded\n", canvas_id, layer_count + 1);
+            jobs.push_back({room->layers[layer_count + 1], data_start, data_end - data_start});
             
             layer_count++;
             layer_pos = data_end;
         }
         
-        printf("[Server][Load] Canvas #%d: %d drawable layers loaded\n", canvas_id, layer_count);
-        pos = layers_array_end;
+        printf("[Server][Load] Canvas #%d: %d drawable layers found\n", canvas_id, layer_count);
+        pos = layers_array_end;
+    }
+    
+    // Every layer is independent: decode them all on the codec pool
+    uint64_t decode_start = now_ns();
+    codec_parallel_for(jobs.size(), [&](int i) {
+        decode_layer(jobs[i].layer, json.data() + jobs[i].b64_start, jobs[i].b64_len, json_width, json_height);
+    });
+    printf("[Server][Load] Decoded %zu layers in %.2f ms (%d threads, base64: %s)\n",
+           jobs.size(), (now_ns() - decode_start) / 1e6, codec_threads, Base64Kernel::get().name);
+    return true;
+}
+
+void load_all_canvases() {
+    printf("\n[Server][Load] ========== LOADING %s ==========\n", CANVAS_STORE_PATH);
+    uint64_t start_ns = now_ns();
+    
+    bool imported = false;
+    if (open_canvas_store()) {
+        size_t chunks = 0;
+        for (auto& pair : store.index) chunks += pair.second.size();
+        printf("[Server][Load] Indexed %zu canvases / %zu layer chunks (%zu bytes mapped) in %.2f ms, "
+               "decoded on first join\n", store.index.size(), chunks, store.size, (now_ns() - start_ns) / 1e6);
+    } else {
+        if (access(CANVAS_STORE_PATH, F_OK) == 0) {
+            // Unreadable: keep it aside rather than overwrite it on the next save
+            rename(CANVAS_STORE_PATH, CANVAS_STORE_PATH ".bad");
+            printf("[Server][Load] Moved unreadable %s to %s.bad\n", CANVAS_STORE_PATH, CANVAS_STORE_PATH);
+        }
+        imported = import_canvas_json();
+        if (!imported) {
+            printf("[Server][Load] No %s found - creating default...\n", CANVAS_STORE_PATH);
+            // Create a default canvas if none exists
+            get_or_create_canvas(0);
+        }
+    }
+    
+    // Replay op logs on top of the snapshot, then fold everything into a
+    // fresh canvas.bin so the logs can go
+    bool replayed = recover_from_wal();
+    if (replayed || !store.base) save_all_canvases();
+    
+    if (imported && access(CANVAS_STORE_PATH, F_OK) == 0) {
+        rename(LEGACY_JSON_PATH, LEGACY_JSON_PATH ".imported");
+        printf("[Server][Load] Imported %s into %s in %.2f ms (old file kept as %s.imported)\n",
+               LEGACY_JSON_PATH, CANVAS_STORE_PATH, (now_ns() - start_ns) / 1e6, LEGACY_JSON_PATH);
+    }
+    
+    printf("[Server][Load] ========== LOAD COMPLETE ==========\n\n");
+}
+
+/*****************************************************************************
+   ROOM EVICTION
+ *****************************************************************************/
+
+// Canvases are decoded on first join (load_stored_canvas). Rooms nobody has
+// used for room_idle_sec are dropped again once their edits are in
+// canvas.bin; over room_budget_bytes, the least recently used idle rooms go
+// first. An evicted canvas is served from the store index like any other
+// stored-only canvas.
+// Wait until every thread that was using rooms from active_rooms has
+// finished that pass
+void wait_for_room_readers() {
+    uint32_t seen[ROOM_READERS];
+    for (int i = 0; i < ROOM_READERS; i++) seen[i] = room_reader_epoch[i];
+    for (int i = 0; i < ROOM_READERS; i++) {
+        if (!(seen[i] & 1)) continue;
+        while (room_reader_epoch[i] == seen[i]) usleep(100);
+    }
+}
+
+struct EvictCandidate {
+    CanvasRoom* room;
+    uint64_t idle_since_ns;
+};
+
+// Called from the snapshot thread. Returns true if an idle room could not be
+// evicted because it still has unsaved edits (the caller saves first).
+bool evict_idle_rooms() {
+    if (room_idle_sec <= 0 && room_budget_bytes == 0) return false;
+    uint64_t now = now_ns();
+    bool need_save = false;
+    
+    pthread_mutex_lock(&canvases_mutex);
+    size_t resident = 0;
+    vector<EvictCandidate> idle;
+    for (auto& pair : canvases) {
+        CanvasRoom* room = pair.second;
+        pthread_mutex_lock(&room->mutex);
+        resident += room->resident_bytes();
+        if (room->users.empty() && room->tcp_clients.empty() && room->joining == 0) {
+            idle.push_back({room, room->idle_since_ns});
+        } else {
+            room->idle_since_ns = now; // In use: however it goes idle, it counts from here
+        }
+        pthread_mutex_unlock(&room->mutex);
+    }
+    sort(idle.begin(), idle.end(), [](const EvictCandidate& a, const EvictCandidate& b) {
+        return a.idle_since_ns < b.idle_since_ns;
+    });
+    
+    vector<CanvasRoom*> victims;
+    for (const EvictCandidate& cand : idle) {
+        CanvasRoom* room = cand.room;
+        uint64_t idle_ns = now - cand.idle_since_ns;
+        bool expired = room_idle_sec > 0 && idle_ns >= (uint64_t)room_idle_sec * 1000000000ull;
+        bool over_budget = room_budget_bytes > 0 && resident > room_budget_bytes &&
+                           idle_ns >= ROOM_MIN_IDLE_SEC * 1000000000ull;
+        if (!expired && !over_budget) continue;
+        
+        pthread_mutex_lock(&room->mutex);
+        bool dirty = room->dirty;
+        size_t bytes = room->resident_bytes();
+        pthread_mutex_unlock(&room->mutex);
+        if (dirty) {
+            need_save = true;
+            continue;
+        }
+        
+        printf("[Server][Evict] Canvas #%d idle %.0f s%s, unloading (%.1f MB)\n", room->id, idle_ns / 1e9,
+               expired ? "" : " and over budget", bytes / 1048576.0);
+        canvases.erase(room->id);
+        canvas_unloading[room->id] = true;
+        active_rooms[room->id] = nullptr;
+        resident -= bytes;
+        victims.push_back(room);
+    }
+    // Index the victims' chunks again: the mapped file is the last save,
+    // which holds all of them (none is dirty)
+    for (CanvasRoom* room : victims) index_store_chunks(room->id);
+    pthread_mutex_unlock(&canvases_mutex);
+    if (victims.empty()) return need_save;
+    
+    // UDP workers and the tick may still hold the rooms they looked up
+    wait_for_room_readers();
+    
+    for (CanvasRoom* room : victims) {
+        if (room->active) {
+            room->raster_stop = true;
+            pthread_mutex_lock(&room->raster_wait_mutex);
+            pthread_cond_signal(&room->raster_cond);
+            pthread_mutex_unlock(&room->raster_wait_mutex);
+            pthread_join(room->raster_thread, NULL);
+            room->active = false;
+        }
+        
+        // Ops that were already queued landed after the save: keep the room
+        // (inactive) so the next save writes them. Nobody can have loaded the
+        // canvas again meanwhile (canvas_unloading).
+        pthread_mutex_lock(&canvases_mutex);
+        bool keep = room->dirty;
+        if (keep) {
+            store.index.erase(room->id);
+            canvases[room->id] = room;
+            need_save = true;
+            printf("[Server][Evict] Canvas #%d changed while unloading, kept until saved\n", room->id);
+        }
+        canvas_unloading[room->id] = false;
+        pthread_cond_broadcast(&unload_cond);
+        pthread_mutex_unlock(&canvases_mutex);
+        if (keep) continue;
+        delete room;
+        rooms_evicted++;
+    }
+    return need_save;
+}
+
+/*****************************************************************************
+   SNAPSHOT THREAD
+ *****************************************************************************/
+
+// Edits are already durable in the op log; canvas.bin is only rewritten once
+// some canvas has logged WAL_SNAPSHOT_BYTES since its last snapshot (which
+// keeps replay at startup short) or a client asks with MSG_SAVE. Rooms and
+// canvases_mutex are only held while the save is captured; encoding and
+// writing happen here, off every lock.
+pthread_mutex_t save_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t save_cond = PTHREAD_COND_INITIALIZER;
+bool save_requested = false;
+
+void request_save() {
+    pthread_mutex_lock(&save_mutex);
+    save_requested = true;
+    pthread_cond_signal(&save_cond);
+    pthread_mutex_unlock(&save_mutex);
+}
+
+void* snapshot_thread(void* arg) {
+    (void)arg;
+    printf("[Server][Snapshot] Thread started (every %u KB of log per canvas)\n", WAL_SNAPSHOT_BYTES / 1024);
+    while (1) {
+        pthread_mutex_lock(&save_mutex);
+        if (!save_requested) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&save_cond, &save_mutex, &deadline);
+        }
+        bool requested = save_requested;
+        save_requested = false;
+        pthread_mutex_unlock(&save_mutex);
+        
+        bool evict_blocked = evict_idle_rooms();
+        
+        SaveJob job;
+        bool captured = false;
+        pthread_mutex_lock(&canvases_mutex);
+        bool due = requested || evict_blocked;
+        for (auto& pair : canvases) {
+            if (due) break;
+            if (pair.second->wal_bytes < WAL_SNAPSHOT_BYTES) continue;
+            printf("[Server][Snapshot] Canvas #%d logged %llu KB, writing snapshot\n",
+                   pair.first, (unsigned long long)(pair.second->wal_bytes / 1024));
+            due = true;
+        }
+        if (due) captured = capture_save(job);
+        pthread_mutex_unlock(&canvases_mutex);
+        if (!captured) continue;
+        
+        bool ok = write_save(job);
+        pthread_mutex_lock(&canvases_mutex);
+        finish_save(job, ok);
+        pthread_mutex_unlock(&canvases_mutex);
     }
-    
-    printf("[Server][Load] ========== LOAD COMPLETE ==========\n\n");
+    return NULL;
 }
 
 /*****************************************************************************
-   AUTOSAVE THREAD
+   STATS THREAD
  *****************************************************************************/
 
-void* autosave_thread(void* arg) {
-    printf("[Server][Autosave] Thread started (interval: 60s)\n");
+#define STATS_INTERVAL 10
+
+// Periodically log UDP batching efficiency (packets per syscall) per worker
+// and packet volume per room.
+void* stats_thread(void* arg) {
+    (void)arg;
     while (1) {
-        sleep(60);
-        printf("[Server][Autosave] Timer triggered\n");
+        sleep(STATS_INTERVAL);
+        for (int i = 0; i < udp_worker_count; i++) {
+            UdpStats& st = udp_workers[i].stats;
+            uint64_t rxp = st.rx_packets, rxs = st.rx_syscalls;
+            uint64_t txp = st.tx_packets, txs = st.tx_syscalls, txd = st.tx_dropped;
+            uint64_t d_rxp = rxp - st.last_rx_packets, d_rxs = rxs - st.last_rx_syscalls;
+            uint64_t d_txp = txp - st.last_tx_packets, d_txs = txs - st.last_tx_syscalls;
+            uint64_t d_txd = txd - st.last_tx_dropped;
+            st.last_rx_packets = rxp; st.last_rx_syscalls = rxs;
+            st.last_tx_packets = txp; st.last_tx_syscalls = txs; st.last_tx_dropped = txd;
+            if (d_rxs == 0) continue;
+            
+            printf("[Server][Stats][UDP %d] rx %llu pkts / %llu calls (%.1f per call), "
+                   "tx %llu pkts / %llu calls (%.1f per call), %llu dropped%s\n",
+                   i,
+                   (unsigned long long)d_rxp, (unsigned long long)d_rxs, (double)d_rxp / d_rxs,
+                   (unsigned long long)d_txp, (unsigned long long)d_txs, d_txs ? (double)d_txp / d_txs : 0.0,
+                   (unsigned long long)d_txd, udp_gso_enabled ? " [GSO]" : "");
+        }
+        
+        uint64_t tick_txp = tick_stats.tx_packets, tick_txs = tick_stats.tx_syscalls, tick_txd = tick_stats.tx_dropped;
+        uint64_t d_tick_txp = tick_txp - tick_stats.last_tx_packets, d_tick_txs = tick_txs - tick_stats.last_tx_syscalls;
+        uint64_t d_tick_txd = tick_txd - tick_stats.last_tx_dropped;
+        tick_stats.last_tx_packets = tick_txp; tick_stats.last_tx_syscalls = tick_txs; tick_stats.last_tx_dropped = tick_txd;
+        if (d_tick_txs > 0) {
+            printf("[Server][Stats][UDP tick] tx %llu pkts / %llu calls (%.1f per call), %llu dropped\n",
+                   (unsigned long long)d_tick_txp, (unsigned long long)d_tick_txs, (double)d_tick_txp / d_tick_txs,
+                   (unsigned long long)d_tick_txd);
+        }
+        
+        uint64_t wal_n = wal_flushes.exchange(0), wal_b = wal_bytes_written.exchange(0), wal_r = wal_records.exchange(0);
+        uint64_t wal_sync = wal_sync_sum_ns.exchange(0), wal_sync_max = wal_sync_max_ns.exchange(0);
+        if (wal_n > 0) {
+            printf("[Server][Stats][WAL] %llu ops / %.1f KB in %llu group commits (%.1f KB each), "
+                   "fdatasync avg %.2f ms max %.2f ms\n",
+                   (unsigned long long)wal_r, wal_b / 1024.0, (unsigned long long)wal_n, wal_b / 1024.0 / wal_n,
+                   wal_sync / 1e6 / wal_n, wal_sync_max / 1e6);
+        }
+        
+        uint64_t overflows = conn_overflows.exchange(0);
+        if (overflows > 0) {
+            printf("[Server][Stats][TCP] %llu slow peers dropped (over %zu MB queued)\n",
+                   (unsigned long long)overflows, CONN_WBUF_MAX >> 20);
+        }
+        
+        uint64_t st_hits = stamp_hits.exchange(0), st_misses = stamp_misses.exchange(0);
+        uint64_t st_evicted = stamp_evictions.exchange(0);
+        if (st_hits + st_misses > 0) {
+            printf("[Server][Stats][Stamps] %.1f%% hits (%llu / %llu dabs), %llu evicted, %.1f KB cached of %u KB\n",
+                   100.0 * st_hits / (st_hits + st_misses), (unsigned long long)st_hits,
+                   (unsigned long long)(st_hits + st_misses), (unsigned long long)st_evicted,
+                   stamp_bytes.load() / 1024.0, STAMP_CACHE_BYTES >> 10);
+        }
+        
         pthread_mutex_lock(&canvases_mutex);
-        save_all_canvases();
+        size_t resident = 0;
+        for (auto& pair : canvases) {
+            pthread_mutex_lock(&pair.second->mutex);
+            resident += pair.second->resident_bytes();
+            pthread_mutex_unlock(&pair.second->mutex);
+        }
+        printf("[Server][Stats][Rooms] %zu resident (%.1f MB", canvases.size(), resident / 1048576.0);
+        if (room_budget_bytes > 0) printf(" of %zu MB budget", room_budget_bytes >> 20);
+        printf("), %zu stored only, %llu loaded, %llu evicted\n", store.index.size(),
+               (unsigned long long)rooms_loaded, (unsigned long long)rooms_evicted);
+        
+        for (auto& pair : canvases) {
+            CanvasRoom* room = pair.second;
+            uint64_t pkts = room->udp_packets;
+            uint64_t d_pkts = pkts - room->last_udp_packets;
+            room->last_udp_packets = pkts;
+            uint64_t ops = room->raster_ops.exchange(0);
+            uint64_t batches = room->raster_batches.exchange(0);
+            uint64_t lat_sum = room->raster_latency_sum_ns.exchange(0);
+            uint64_t lat_max = room->raster_latency_max_ns.exchange(0);
+            uint64_t depth_max = room->raster_depth_max.exchange(0);
+            uint64_t stalls = room->raster_full_stalls.exchange(0);
+            uint64_t nacks_tx = room->nacks_sent.exchange(0), nacks_rx = room->nacks_received.exchange(0);
+            uint64_t retx = room->retransmits.exchange(0), dups = room->duplicates.exchange(0);
+            uint64_t records = room->fanout_records.exchange(0), datagrams = room->fanout_datagrams.exchange(0);
+            uint64_t merged = room->cursors_merged.exchange(0), held = room->tick_held.exchange(0);
+            uint64_t hold_sum = room->tick_hold_sum_ns.exchange(0), hold_max = room->tick_hold_max_ns.exchange(0);
+            if (d_pkts == 0 && ops == 0) continue;
+            
+            pthread_mutex_lock(&room->peers_mutex);
+            size_t peers = room->udp_clients.size();
+            pthread_mutex_unlock(&room->peers_mutex);
+            
+            pthread_mutex_lock(&room->mutex);
+            size_t tiles = 0, layer_count = room->layers.size();
+            for (Layer* layer : room->layers) tiles += layer->allocated_tiles();
+            pthread_mutex_unlock(&room->mutex);
+            
+            printf("[Server][Stats][Canvas %d] %llu UDP pkts, %zu peers, %zu layers / %zu tiles resident (%.1f MB)\n",
+                   room->id, (unsigned long long)d_pkts, peers, layer_count, tiles,
+                   tiles * TILE_SIZE * TILE_SIZE * sizeof(Pixel) / (1024.0 * 1024.0));
+            printf("[Server][Stats][Canvas %d] raster %llu ops in %llu batches, queue depth max %llu (%llu full stalls), "
+                   "apply latency avg %.3f ms max %.3f ms\n",
+                   room->id, (unsigned long long)ops, (unsigned long long)batches,
+                   (unsigned long long)depth_max, (unsigned long long)stalls,
+                   ops ? lat_sum / 1e6 / ops : 0.0, lat_max / 1e6);
+            if (datagrams > 0 && udp_tick_hz > 0) {
+                printf("[Server][Stats][Canvas %d] fan-out (tick %d Hz): %llu records in %llu datagrams "
+                       "(%.1f per datagram), %llu cursor updates merged, hold avg %.2f ms max %.2f ms\n",
+                       room->id, udp_tick_hz, (unsigned long long)records, (unsigned long long)datagrams,
+                       (double)records / datagrams, (unsigned long long)merged,
+                       held ? hold_sum / 1e6 / held : 0.0, hold_max / 1e6);
+            } else if (datagrams > 0) {
+                printf("[Server][Stats][Canvas %d] fan-out (immediate): %llu records in %llu datagrams\n",
+                       room->id, (unsigned long long)records, (unsigned long long)datagrams);
+            }
+            if (nacks_tx || nacks_rx || retx || dups) {
+                printf("[Server][Stats][Canvas %d] repair: %llu NACKs to authors, %llu NACKs from peers, "
+                       "%llu ops resent, %llu duplicates dropped\n",
+                       room->id, (unsigned long long)nacks_tx, (unsigned long long)nacks_rx,
+                       (unsigned long long)retx, (unsigned long long)dups);
+            }
+        }
         pthread_mutex_unlock(&canvases_mutex);
     }
     return NULL;
@@ -980,45 +3343,40 @@ void* autosave_thread(void* arg) {
    TCP SESSION HANDLER
  *****************************************************************************/
 
-void send_canvas_to_client(int sock, int canvas_id) {
-    CanvasRoom* room = get_or_create_canvas(canvas_id);
-    
-    printf("[Server][TCP] Sending canvas #%d to socket %d\n", canvas_id, sock);
+// Queue the full canvas for a joining client. Caller holds room->mutex so no
+// broadcast can interleave with the layer stream.
+void send_canvas_to_client(Connection* c, CanvasRoom* room) {
+    printf("[Server][TCP] Sending canvas #%d to socket %d\n", room->id, c->fd);
+    uint64_t start_ns = now_ns();
     
     int layer_count = room->layers.size();
-    write_all(sock, &layer_count, sizeof(int));
+    conn_send(c, &layer_count, sizeof(int));
     printf("[Server][TCP] Sent layer_count: %d\n", layer_count);
     
-    pthread_mutex_lock(&room->mutex);
-    
-    // Send each layer individually (skip layer 0 which is white paper)
-    // Convert from column-major (pixels[x][y]) to row-major (y * WIDTH + x) for client
-    uint8_t* buffer = new uint8_t[WIDTH * HEIGHT * 4];
+    // Send each drawable layer (skip layer 0 which is white paper) as a
+    // tile snapshot: transparent tiles are left out, uniform tiles are one
+    // pixel, the rest use their cached tile_codec encoding (see codec.h).
+    vector<uint8_t> blob;
+    size_t total_bytes = 0, tiles_sent = 0, tiles_cached = 0;
     
     for (size_t l = 1; l < room->layers.size(); l++) {
-        // Convert to row-major RGBA format
-        for (int y = 0; y < HEIGHT; y++) {
-            for (int x = 0; x < WIDTH; x++) {
-                Pixel p = room->layers[l]->pixels[x][y];
-                int idx = (y * WIDTH + x) * 4;
-                buffer[idx + 0] = p.r;
-                buffer[idx + 1] = p.g;
-                buffer[idx + 2] = p.b;
-                buffer[idx + 3] = p.a;
-            }
-        }
+        Layer* layer = room->layers[l];
+        layer->collapse_uniform_tiles();
+        blob.clear();
+        uint32_t tile_count = layer->encode_tile_list(blob, &tiles_cached);
+        tiles_sent += tile_count;
+        total_bytes += blob.size();
         
-        if (write_all(sock, buffer, WIDTH * HEIGHT * 4)) {
-            printf("[Server][TCP] Sent layer %zu (%d bytes)\n", l, WIDTH * HEIGHT * 4);
+        if (conn_send(c, blob.data(), blob.size())) {
+            printf("[Server][TCP] Queued layer %zu (%u tiles, %zu bytes)\n", l, tile_count, blob.size());
         } else {
             printf("[Server][TCP] Failed to send layer %zu\n", l);
         }
     }
     
-    delete[] buffer;
-    pthread_mutex_unlock(&room->mutex);
-    
-    printf("[Server][TCP] Sent canvas #%d complete\n", canvas_id);
+    printf("[Server][TCP] Sent canvas #%d complete (%d layers, %zu tiles / %zu cached, %zu bytes vs %zu raw, %.2f ms)\n",
+           room->id, layer_count - 1, tiles_sent, tiles_cached, total_bytes,
+           (size_t)(layer_count - 1) * LAYER_BYTES, (now_ns() - start_ns) / 1e6);
 }
 
 void move_layer_buffer(Layer* layer, int dx, int dy) {
@@ -1026,373 +3384,633 @@ void move_layer_buffer(Layer* layer, int dx, int dy) {
     if (dx == 0 && dy == 0) return;
     layer->dirty = true;
 
-    // Use a temp buffer
-    Pixel** temp = new Pixel*[WIDTH];
-    for (int i = 0; i < WIDTH; i++) {
-        temp[i] = new Pixel[HEIGHT];
-        memset(temp[i], 0, HEIGHT * sizeof(Pixel)); // Clear to transparent
-    }
-
-    for (int x = 0; x < WIDTH; x++) {
-        for (int y = 0; y < HEIGHT; y++) {
-            // Calculate where this pixel comes FROM
-            int srcX = x - dx;
-            int srcY = y - dy;
-
-            if (srcX >= 0 && srcX < WIDTH && srcY >= 0 && srcY < HEIGHT) {
-                temp[x][y] = layer->pixels[srcX][srcY];
+    // Shift non-empty tiles into a fresh (all transparent) layer, then take
+    // over its tiles; only destination tiles that receive paint get allocated
+    Layer* temp = new Layer();
+    for (int ty = layer->by0; ty < layer->by1; ty++) {
+        for (int tx = layer->bx0; tx < layer->bx1; tx++) {
+            if (layer->tiles[ty][tx].empty()) continue;
+            int x0, y0, x1, y1;
+            Layer::tile_bounds(tx, ty, x0, y0, x1, y1);
+            for (int y = y0; y < y1; y++) {
+                int dstY = y + dy;
+                if (dstY < 0 || dstY >= HEIGHT) continue;
+                for (int x = x0; x < x1; x++) {
+                    int dstX = x + dx;
+                    if (dstX < 0 || dstX >= WIDTH) continue;
+                    temp->set(dstX, dstY, layer->get(x, y));
+                }
             }
         }
     }
 
-    // Copy back and cleanup
-    for (int i = 0; i < WIDTH; i++) {
-        for (int j = 0; j < HEIGHT; j++) {
-            layer->pixels[i][j] = temp[i][j];
-        }
-        delete[] temp[i];
+    layer->swap_tiles(temp);
+    delete temp; // Releases the old tile buffers
+}
+
+// Full size of the frame starting with this header. MSG_LAYER_SYNC carries a
+// raw layer after the TCPMessage, MSG_LAYER_DELTA a tile list whose length is
+// in data[0..3]; everything else is a bare TCPMessage. 0 means malformed.
+size_t tcp_frame_size(const TCPMessage& msg) {
+    if (msg.type == MSG_LAYER_SYNC) return sizeof(TCPMessage) + LAYER_BYTES;
+    if (msg.type == MSG_LAYER_DELTA) {
+        uint32_t len;
+        memcpy(&len, msg.data, sizeof(len));
+        if (len < sizeof(uint32_t) || len > MAX_DELTA_BYTES) return 0;
+        return sizeof(TCPMessage) + len;
     }
-    delete[] temp;
+    return sizeof(TCPMessage);
 }
 
-void* tcp_client_session(void* arg) {
-    int client_sock = *((int*)arg);
-    free(arg);
-    
-    pthread_detach(pthread_self());
-    
-    printf("[Server][TCP] ===== Client connected (socket=%d) =====\n", client_sock);
-    
-    int client_canvas_id = -1;
-    
-    TCPMessage msg;
-    while (1) {
-        int bytes = read(client_sock, &msg, sizeof(TCPMessage));
-        if (bytes <= 0) {
-            printf("[Server][TCP] Client disconnected (socket=%d)\n", client_sock);
+// Dispatch one complete frame. `payload` points at the bytes following the
+// header (MSG_LAYER_SYNC and MSG_LAYER_DELTA).
+void handle_tcp_message(Connection* conn, const TCPMessage& msg, const uint8_t* payload) {
+    int client_sock = conn->fd;
+    int client_canvas_id = conn->canvas_id;
+
+    switch (msg.type) {
+        case MSG_LOGIN: {
+            if (client_canvas_id >= 0) {
+                printf("[Server][TCP] Ignoring second LOGIN on socket %d\n", client_sock);
+                break;
+            }
+            int canvas_id = msg.canvas_id;
+            char username[32];
+            strncpy(username, msg.data, 31);
+            username[31] = '\0';
+            
+            if (canvas_id < 0) canvas_id = 0;
+            
+            printf("[Server][TCP] LOGIN: user='%s' canvas=%d\n", username, canvas_id);
+            
+            CanvasRoom* room = activate_canvas(canvas_id);
+            if (!room) {
+                printf("[Server][TCP] ERROR: Failed to activate canvas\n");
+                break;
+            }
+            
+            conn->canvas_id = canvas_id;
+            
+            pthread_mutex_lock(&room->mutex);
+            room->tcp_clients.push_back(conn);
+            room->add_user(client_sock, username, nullptr, 0);
+            room->joining--;
+            int my_uid = room->users[client_sock]->room_uid;
+            
+            // Fresh op stream for this UID (it may have been used before)
+            pthread_mutex_lock(&room->peers_mutex);
+            room->reset_sender(my_uid);
+            pthread_mutex_unlock(&room->peers_mutex);
+            
+            printf("[Server][TCP] User '%s' registered to canvas #%d (clients: %zu)\n", 
+                   username, canvas_id, room->tcp_clients.size());
+            
+            TCPMessage response;
+            memset(&response, 0, sizeof(response));
+            response.type = MSG_WELCOME;
+            response.canvas_id = canvas_id;
+            response.layer_count = room->layers.size();
+            response.user_id = my_uid;
+            response.data_len = 1;
+            response.data[0] = premultiplied_layers ? WELCOME_PREMULTIPLIED : 0;
+            
+            conn_send(conn, &response, sizeof(TCPMessage));
+            printf("[Server][TCP] Sent WELCOME (canvas=%d, layers=%d)\n", canvas_id, response.layer_count);
+            
+            // Send the actual canvas data to sync the new client
+            send_canvas_to_client(conn, room);
+            
+            // Send existing signatures to the new client
+            for (auto const& [sock, user] : room->users) {
+                if (sock != client_sock && user->signature_data) {
+                    TCPMessage sigMsg;
+                    memset(&sigMsg, 0, sizeof(sigMsg));
+                    sigMsg.type = MSG_SIGNATURE;
+                    sigMsg.canvas_id = canvas_id;
+                    sigMsg.data_len = 256;
+                    sigMsg.user_id = user->room_uid;
+                    memcpy(sigMsg.data, user->signature_data, 256);
+                    conn_send(conn, &sigMsg, sizeof(TCPMessage));
+                    printf("[Server][TCP] Sent existing signature of UID=%d to new client\n", user->room_uid);
+                }
+            }
+            pthread_mutex_unlock(&room->mutex);
+            
+            printf("[Server][TCP] User '%s' logged into canvas #%d (UDP port %d)\n", 
+                   username, canvas_id, UDP_PORT);
             break;
         }
 
-        switch (msg.type) {
-            case MSG_LOGIN: {
-                int canvas_id = msg.canvas_id;
-                char username[32];
-                strncpy(username, msg.data, 31);
-                username[31] = '\0';
+        // --- SIGNATURE IMPLEMENTATION START ---
+        case MSG_SIGNATURE: {
+            if (client_canvas_id < 0) break;
+            
+            printf("[Server][TCP] Received SIGNATURE (len=%d)\n", msg.data_len);
+            if (msg.data_len == 256) {
+                CanvasRoom* room = get_or_create_canvas(client_canvas_id);
+                pthread_mutex_lock(&room->mutex);
                 
-                if (canvas_id < 0) canvas_id = 0;
+                // Find user
+                if (room->users.count(client_sock)) {
+                    ConnectedUser* u = room->users[client_sock];
+                    if (u->signature_data) delete[] u->signature_data;
+                    u->signature_len = 256;
+                    u->signature_data = new uint8_t[256];
+                    memcpy(u->signature_data, msg.data, 256);
+                    printf("[Server][TCP] Stored signature for user '%s' (UID=%d)\n", u->username, u->room_uid);
+                    
+                    // Broadcast to ALL clients in the room (including sender, so they know their ID if needed, 
+                    // though client ignores own signature for display)
+                    TCPMessage broadcast;
+                    memset(&broadcast, 0, sizeof(broadcast));
+                    broadcast.type = MSG_SIGNATURE;
+                    broadcast.canvas_id = client_canvas_id;
+                    broadcast.data_len = 256;
+                    broadcast.user_id = u->room_uid; // Send the UID
+                    memcpy(broadcast.data, msg.data, 256);
+                    
+                    broadcast_tcp(room, broadcast);
+                }
                 
-                printf("[Server][TCP] LOGIN: user='%s' canvas=%d\n", username, canvas_id);
+                pthread_mutex_unlock(&room->mutex);
+            }
+            break;
+        }
+        // --- SIGNATURE IMPLEMENTATION END ---
+        
+        case MSG_SAVE:
+            printf("[Server][TCP] SAVE request from socket %d\n", client_sock);
+            if (client_canvas_id >= 0) request_save(); // Written by snapshot_thread
+            break;
+            
+        case MSG_LAYER_ADD:
+            printf("[Server][TCP] LAYER_ADD request: layer_id=%d\n", msg.layer_id);
+            if (client_canvas_id >= 0) {
+                CanvasRoom* room = get_or_create_canvas(client_canvas_id);
+                pthread_mutex_lock(&room->mutex);
+                room->dirty = true;
                 
-                if (!start_canvas_thread(canvas_id)) {
-                    printf("[Server][TCP] ERROR: Failed to start canvas thread\n");
-                    break;
+                int added_at_index = -1;
+                // Check if it's an insertion or append
+                if (msg.layer_id > 0 && msg.layer_id < room->layers.size()) {
+                    room->insert_layer(msg.layer_id);
+                    added_at_index = msg.layer_id;
+                } else {
+                    room->add_layer();
+                    added_at_index = room->layers.size() - 1;
                 }
+                wal_log(room, WAL_LAYER_ADD, 0, added_at_index, 0);
                 
-                client_canvas_id = canvas_id;
+                // Prepare and broadcast response
+                TCPMessage response;
+                memset(&response, 0, sizeof(response));
+                response.type = MSG_LAYER_ADD;
+                response.canvas_id = client_canvas_id;
+                response.layer_count = room->layers.size();
+                response.layer_id = added_at_index;
                 
-                CanvasRoom* room = get_or_create_canvas(canvas_id);
-                pthread_mutex_lock(&room->mutex);
-                room->tcp_clients.push_back(client_sock);
-                room->add_user(client_sock, username, nullptr, 0);
-                int my_uid = room->users[client_sock]->room_uid;
+                broadcast_tcp(room, response);
+                printf("[Server][TCP] Broadcast LAYER_ADD to %zu clients (layers=%d, added_at=%d)\n", 
+                       room->tcp_clients.size(), response.layer_count, response.layer_id);
                 
-                printf("[Server][TCP] User '%s' registered to canvas #%d (clients: %zu)\n", 
-                       username, canvas_id, room->tcp_clients.size());
                 pthread_mutex_unlock(&room->mutex);
+            }
+            break;
+            
+        case MSG_LAYER_DEL:
+            printf("[Server][TCP] LAYER_DEL request: layer=%d\n", msg.layer_id);
+            if (client_canvas_id >= 0) {
+                CanvasRoom* room = get_or_create_canvas(client_canvas_id);
+                pthread_mutex_lock(&room->mutex);
+                room->dirty = true;
+                room->delete_layer(msg.layer_id);
+                wal_log(room, WAL_LAYER_DEL, msg.layer_id, 0, 0);
                 
+                // Prepare and broadcast response
                 TCPMessage response;
                 memset(&response, 0, sizeof(response));
-                response.type = MSG_WELCOME;
-                response.canvas_id = canvas_id;
+                response.type = MSG_LAYER_DEL;
+                response.canvas_id = client_canvas_id;
                 response.layer_count = room->layers.size();
-                response.user_id = my_uid;
+                response.layer_id = msg.layer_id;
+                
+                broadcast_tcp(room, response);
+                printf("[Server][TCP] Broadcast LAYER_DEL to %zu clients (layers=%d)\n", 
+                       room->tcp_clients.size(), response.layer_count);
                 
-                write_all(client_sock, &response, sizeof(TCPMessage));
-                printf("[Server][TCP] Sent WELCOME (canvas=%d, layers=%d)\n", canvas_id, response.layer_count);
+                pthread_mutex_unlock(&room->mutex);
+            }
+            break;
+            
+        case MSG_LAYER_SYNC:
+            printf("[Server][TCP] LAYER_SYNC request: layer=%d\n", msg.layer_id);
+            if (client_canvas_id >= 0) {
+                CanvasRoom* room = get_or_create_canvas(client_canvas_id);
                 
-                // Send the actual canvas data to sync the new client
-                send_canvas_to_client(client_sock, canvas_id);
+                // Layer data arrived with the frame. Tile it and encode its
+                // log record (tiles rather than raw pixels) before taking
+                // the room lock; only the swap and the append happen under it.
+                const uint8_t* layer_data = payload;
+                size_t layer_size = LAYER_BYTES;
+                Layer* incoming = new Layer();
+                incoming->write_rgba(layer_data);
+                vector<uint8_t> tiles;
+                incoming->encode_tile_list(tiles, nullptr);
                 
-                // Send existing signatures to the new client
                 pthread_mutex_lock(&room->mutex);
-                for (auto const& [sock, user] : room->users) {
-                    if (sock != client_sock && user->signature_data) {
-                        TCPMessage sigMsg;
-                        memset(&sigMsg, 0, sizeof(sigMsg));
-                        sigMsg.type = MSG_SIGNATURE;
-                        sigMsg.canvas_id = canvas_id;
-                        sigMsg.data_len = 256;
-                        sigMsg.user_id = user->room_uid;
-                        memcpy(sigMsg.data, user->signature_data, 256);
-                        write_all(client_sock, &sigMsg, sizeof(TCPMessage));
-                        printf("[Server][TCP] Sent existing signature of UID=%d to new client\n", user->room_uid);
+                room->dirty = true;
+                
+                int layer_idx = msg.layer_id;
+                if (layer_idx > 0 && layer_idx < (int)room->layers.size()) {
+                    // Update server's layer
+                    Layer* layer = room->layers[layer_idx];
+                    layer->dirty = true;
+                    layer->swap_tiles(incoming);
+                    printf("[Server][TCP] Received layer %d data (%zu bytes)\n", layer_idx, layer_size);
+                    
+                    wal_log(room, WAL_LAYER_REPLACE, layer_idx, 0, 0, tiles.data(), tiles.size());
+                    
+                    // Broadcast to other clients
+                    TCPMessage broadcast;
+                    memset(&broadcast, 0, sizeof(broadcast));
+                    broadcast.type = MSG_LAYER_SYNC;
+                    broadcast.canvas_id = client_canvas_id;
+                    broadcast.layer_id = layer_idx;
+                    broadcast.layer_count = room->layers.size();
+                    
+                    for (Connection* c : room->tcp_clients) {
+                        if (c != conn) {  // Don't send back to sender
+                            conn_send(c, &broadcast, sizeof(TCPMessage));
+                            conn_send(c, layer_data, layer_size);
+                        }
                     }
+                    printf("[Server][TCP] Broadcast LAYER_SYNC to %zu other clients\n", 
+                           room->tcp_clients.size() - 1);
                 }
-                pthread_mutex_unlock(&room->mutex);
                 
-                printf("[Server][TCP] User '%s' logged into canvas #%d (UDP port %d)\n", 
-                       username, canvas_id, room->udp_port);
-                break;
+                pthread_mutex_unlock(&room->mutex);
+                delete incoming; // The replaced tiles, or the unused sync
             }
+            break;
 
-            // --- SIGNATURE IMPLEMENTATION START ---
-            case MSG_SIGNATURE: {
-                if (client_canvas_id < 0) break;
+        case MSG_LAYER_DELTA:
+            // Changed tiles only (undo/redo); same fan-out as LAYER_SYNC
+            if (client_canvas_id >= 0) {
+                uint32_t len;
+                memcpy(&len, msg.data, sizeof(len));
                 
-                printf("[Server][TCP] Received SIGNATURE (len=%d)\n", msg.data_len);
-                if (msg.data_len == 256) {
-                    CanvasRoom* room = get_or_create_canvas(client_canvas_id);
-                    pthread_mutex_lock(&room->mutex);
-                    
-                    // Find user
-                    if (room->users.count(client_sock)) {
-                        ConnectedUser* u = room->users[client_sock];
-                        if (u->signature_data) delete[] u->signature_data;
-                        u->signature_len = 256;
-                        u->signature_data = new uint8_t[256];
-                        memcpy(u->signature_data, msg.data, 256);
-                        printf("[Server][TCP] Stored signature for user '%s' (UID=%d)\n", u->username, u->room_uid);
+                CanvasRoom* room = get_or_create_canvas(client_canvas_id);
+                pthread_mutex_lock(&room->mutex);
+                room->dirty = true;
+                
+                int layer_idx = msg.layer_id;
+                if (layer_idx > 0 && layer_idx < (int)room->layers.size()) {
+                    int tiles = room->layers[layer_idx]->decode_tile_list(payload, len);
+                    if (tiles < 0) {
+                        printf("[Server][TCP] Dropping malformed LAYER_DELTA for layer %d\n", layer_idx);
+                    } else {
+                        printf("[Server][TCP] LAYER_DELTA: layer=%d tiles=%d (%u bytes)\n", layer_idx, tiles, len);
+                        wal_log(room, WAL_LAYER_TILES, layer_idx, 0, 0, payload, len);
                         
-                        // Broadcast to ALL clients in the room (including sender, so they know their ID if needed, 
-                        // though client ignores own signature for display)
-                        TCPMessage broadcast;
-                        memset(&broadcast, 0, sizeof(broadcast));
-                        broadcast.type = MSG_SIGNATURE;
+                        TCPMessage broadcast = msg;
                         broadcast.canvas_id = client_canvas_id;
-                        broadcast.data_len = 256;
-                        broadcast.user_id = u->room_uid; // Send the UID
-                        memcpy(broadcast.data, msg.data, 256);
-                        
-                        broadcast_tcp(room, broadcast);
+                        broadcast.layer_count = room->layers.size();
+                        for (Connection* c : room->tcp_clients) {
+                            if (c != conn) {
+                                conn_send(c, &broadcast, sizeof(TCPMessage));
+                                conn_send(c, payload, len);
+                            }
+                        }
                     }
-                    
-                    pthread_mutex_unlock(&room->mutex);
                 }
-                break;
+                
+                pthread_mutex_unlock(&room->mutex);
             }
-            // --- SIGNATURE IMPLEMENTATION END ---
-            
-            case MSG_SAVE:
-                printf("[Server][TCP] SAVE request from socket %d\n", client_sock);
-                if (client_canvas_id >= 0) {
-                    pthread_mutex_lock(&canvases_mutex);
-                    save_all_canvases();
-                    pthread_mutex_unlock(&canvases_mutex);
-                }
-                break;
+            break;
+
+        case MSG_LAYER_RESYNC:
+            // A client failed to decode one of our tiles: send it the whole
+            // layer again, framed like LAYER_DELTA. Only this client gets it.
+            if (client_canvas_id >= 0) {
+                CanvasRoom* room = get_or_create_canvas(client_canvas_id);
+                pthread_mutex_lock(&room->mutex);
                 
-            case MSG_LAYER_ADD:
-                printf("[Server][TCP] LAYER_ADD request: layer_id=%d\n", msg.layer_id);
-                if (client_canvas_id >= 0) {
-                    CanvasRoom* room = get_or_create_canvas(client_canvas_id);
-                    pthread_mutex_lock(&room->mutex);
-                    room->dirty = true;
-                    
-                    int added_at_index = -1;
-                    // Check if it's an insertion or append
-                    if (msg.layer_id > 0 && msg.layer_id < room->layers.size()) {
-                        room->insert_layer(msg.layer_id);
-                        added_at_index = msg.layer_id;
-                    } else {
-                        room->add_layer();
-                        added_at_index = room->layers.size() - 1;
-                    }
+                int layer_idx = msg.layer_id;
+                if (layer_idx > 0 && layer_idx < (int)room->layers.size()) {
+                    Layer* layer = room->layers[layer_idx];
+                    layer->collapse_uniform_tiles();
+                    vector<uint8_t> blob;
+                    uint32_t tiles = layer->encode_tile_list(blob, nullptr);
                     
-                    // Prepare and broadcast response
                     TCPMessage response;
                     memset(&response, 0, sizeof(response));
-                    response.type = MSG_LAYER_ADD;
+                    response.type = MSG_LAYER_RESYNC;
                     response.canvas_id = client_canvas_id;
+                    response.layer_id = layer_idx;
                     response.layer_count = room->layers.size();
-                    response.layer_id = added_at_index;
-                    
-                    broadcast_tcp(room, response);
-                    printf("[Server][TCP] Broadcast LAYER_ADD to %zu clients (layers=%d, added_at=%d)\n", 
-                           room->tcp_clients.size(), response.layer_count, response.layer_id);
-                    
-                    pthread_mutex_unlock(&room->mutex);
+                    uint32_t len = blob.size();
+                    memcpy(response.data, &len, sizeof(len));
+                    conn_send(conn, &response, sizeof(TCPMessage));
+                    conn_send(conn, blob.data(), blob.size());
+                    printf("[Server][TCP] LAYER_RESYNC: layer=%d tiles=%u (%u bytes) to socket %d\n",
+                           layer_idx, tiles, len, client_sock);
                 }
-                break;
                 
-            case MSG_LAYER_DEL:
-                printf("[Server][TCP] LAYER_DEL request: layer=%d\n", msg.layer_id);
-                if (client_canvas_id >= 0) {
-                    CanvasRoom* room = get_or_create_canvas(client_canvas_id);
-                    pthread_mutex_lock(&room->mutex);
-                    room->dirty = true;
-                    room->delete_layer(msg.layer_id);
-                    
-                    // Prepare and broadcast response
-                    TCPMessage response;
-                    memset(&response, 0, sizeof(response));
-                    response.type = MSG_LAYER_DEL;
-                    response.canvas_id = client_canvas_id;
-                    response.layer_count = room->layers.size();
-                    response.layer_id = msg.layer_id;
-                    
-                    broadcast_tcp(room, response);
-                    printf("[Server][TCP] Broadcast LAYER_DEL to %zu clients (layers=%d)\n", 
-                           room->tcp_clients.size(), response.layer_count);
-                    
-                    pthread_mutex_unlock(&room->mutex);
-                }
-                break;
+                pthread_mutex_unlock(&room->mutex);
+            }
+            break;
+
+        case MSG_LAYER_REORDER:
+            // data[0] = old_idx, data[1] = new_idx
+            if (client_canvas_id >= 0) {
+                int old_idx = (uint8_t)msg.data[0];
+                int new_idx = (uint8_t)msg.data[1];
                 
-            case MSG_LAYER_SYNC:
-                printf("[Server][TCP] LAYER_SYNC request: layer=%d\n", msg.layer_id);
-                if (client_canvas_id >= 0) {
-                    CanvasRoom* room = get_or_create_canvas(client_canvas_id);
-                    pthread_mutex_lock(&room->mutex);
-                    room->dirty = true;
-                    
-                    int layer_idx = msg.layer_id;
-                    if (layer_idx > 0 && layer_idx < (int)room->layers.size()) {
-                        // Receive layer data from client
-                        size_t layer_size = WIDTH * HEIGHT * 4;
-                        uint8_t* layer_data = new uint8_t[layer_size];
-                        size_t received = 0;
-                        while (received < layer_size) {
-                            ssize_t n = recv(client_sock, layer_data + received, layer_size - received, 0);
-                            if (n <= 0) break;
-                            received += n;
-                        }
-                        
-                        if (received == layer_size) {
-                            // Update server's layer
-                            Layer* layer = room->layers[layer_idx];
-                            layer->dirty = true;
-                            for (int x = 0; x < WIDTH; x++) {
-                                for (int y = 0; y < HEIGHT; y++) {
-                                    int idx = (y * WIDTH + x) * 4;
-                                    layer->pixels[x][y].r = layer_data[idx];
-                                    layer->pixels[x][y].g = layer_data[idx + 1];
-                                    layer->pixels[x][y].b = layer_data[idx + 2];
-                                    layer->pixels[x][y].a = layer_data[idx + 3];
-                                }
-                            }
-                            printf("[Server][TCP] Received layer %d data (%zu bytes)\n", layer_idx, received);
-                            
-                            // Broadcast to other clients
-                            TCPMessage broadcast;
-                            memset(&broadcast, 0, sizeof(broadcast));
-                            broadcast.type = MSG_LAYER_SYNC;
-                            broadcast.canvas_id = client_canvas_id;
-                            broadcast.layer_id = layer_idx;
-                            broadcast.layer_count = room->layers.size();
-                            
-                            for (int sock : room->tcp_clients) {
-                                if (sock != client_sock) {  // Don't send back to sender
-                                    write_all(sock, &broadcast, sizeof(TCPMessage));
-                                    write_all(sock, layer_data, layer_size);
-                                }
-                            }
-                            printf("[Server][TCP] Broadcast LAYER_SYNC to %zu other clients\n", 
-                                   room->tcp_clients.size() - 1);
-                        }
-                        delete[] layer_data;
-                    }
-                    
-                    pthread_mutex_unlock(&room->mutex);
-                }
-                break;
+                CanvasRoom* room = get_or_create_canvas(client_canvas_id);
+                pthread_mutex_lock(&room->mutex);
+                room->dirty = true;
+                room->reorder_layer(old_idx, new_idx);
+                wal_log(room, WAL_LAYER_REORDER, 0, old_idx, new_idx);
+                
+                // Broadcast
+                TCPMessage resp = msg; // Echo back
+                broadcast_tcp(room, resp);
+                
+                pthread_mutex_unlock(&room->mutex);
+            }
+            break;
 
-            case MSG_LAYER_REORDER:
-                // data[0] = old_idx, data[1] = new_idx
-                if (client_canvas_id >= 0) {
-                    int old_idx = (uint8_t)msg.data[0];
-                    int new_idx = (uint8_t)msg.data[1];
-                    
-                    CanvasRoom* room = get_or_create_canvas(client_canvas_id);
-                    pthread_mutex_lock(&room->mutex);
-                    room->dirty = true;
-                    room->reorder_layer(old_idx, new_idx);
-                    
-                    // Broadcast
-                    TCPMessage resp = msg; // Echo back
-                    broadcast_tcp(room, resp);
-                    
-                    pthread_mutex_unlock(&room->mutex);
+        case MSG_LAYER_MOVE:
+            {
+                if (client_canvas_id < 0) break;
+                CanvasRoom* room = get_or_create_canvas(client_canvas_id);
+                
+                // Extract payload
+                struct MoveData { int dx; int dy; } move;
+                memcpy(&move, msg.data, sizeof(MoveData));
+                
+                printf("[Server][TCP] LAYER_MOVE: layer=%d dx=%d dy=%d\n", msg.layer_id, move.dx, move.dy);
+
+                pthread_mutex_lock(&room->mutex);
+                room->dirty = true;
+                
+                // 1. Apply to Server's Canvas
+                if (msg.layer_id > 0 && msg.layer_id < (int)room->layers.size()) {
+                    move_layer_buffer(room->layers[msg.layer_id], move.dx, move.dy);
+                    wal_log(room, WAL_LAYER_MOVE, msg.layer_id, move.dx, move.dy);
                 }
-                break;
+                
+                // 2. Broadcast to others
+                broadcast_tcp(room, msg, client_sock); // Don't send back to sender (they already moved)
+                
+                pthread_mutex_unlock(&room->mutex);
+            }
+            break;
+    }
+}
 
-            case MSG_LAYER_MOVE:
-                {
-                    if (client_canvas_id < 0) break;
-                    CanvasRoom* room = get_or_create_canvas(client_canvas_id);
-                    
-                    // Extract payload
-                    struct MoveData { int dx; int dy; } payload;
-                    memcpy(&payload, msg.data, sizeof(MoveData));
-                    
-                    printf("[Server][TCP] LAYER_MOVE: layer=%d dx=%d dy=%d\n", msg.layer_id, payload.dx, payload.dy);
+// Detach a connection from its room and tell the others it left.
+void tcp_client_logout(Connection* conn) {
+    int client_sock = conn->fd;
+    int client_canvas_id = conn->canvas_id;
+    if (client_canvas_id < 0) return;
 
-                    pthread_mutex_lock(&room->mutex);
-                    room->dirty = true;
-                    
-                    // 1. Apply to Server's Canvas
-                    if (msg.layer_id > 0 && msg.layer_id < (int)room->layers.size()) {
-                        move_layer_buffer(room->layers[msg.layer_id], payload.dx, payload.dy);
-                    }
-                    
-                    // 2. Broadcast to others
-                    broadcast_tcp(room, msg, client_sock); // Don't send back to sender (they already moved)
-                    
-                    pthread_mutex_unlock(&room->mutex);
-                }
-                break;
+    CanvasRoom* room = get_or_create_canvas(client_canvas_id);
+    pthread_mutex_lock(&room->mutex);
+    
+    // 1. Find the user to get their UID
+    int user_uid = 0;
+    if (room->users.count(client_sock)) {
+        user_uid = room->users[client_sock]->room_uid;
+        room->remove_user(client_sock); // Clean up user data
+    }
+
+    // 2. Remove from TCP list
+    auto& clients = room->tcp_clients;
+    clients.erase(remove(clients.begin(), clients.end(), conn), clients.end());
+    if (room->users.empty()) room->idle_since_ns = now_ns();
+    
+    // 3. Broadcast LOGOUT
+    if (user_uid > 0) {
+        TCPMessage logoutMsg;
+        memset(&logoutMsg, 0, sizeof(logoutMsg));
+        logoutMsg.type = MSG_LOGOUT;
+        logoutMsg.canvas_id = client_canvas_id;
+        logoutMsg.user_id = user_uid;
+        broadcast_tcp(room, logoutMsg, client_sock);
+        printf("[Server][TCP] Broadcast LOGOUT for UID=%d\n", user_uid);
+    }
+
+    printf("[Server][TCP] Removed socket %d from canvas #%d\n", client_sock, client_canvas_id);
+    pthread_mutex_unlock(&room->mutex);
+}
+
+/*****************************************************************************
+   TCP REACTOR (edge-triggered epoll, N shards)
+ *****************************************************************************/
+
+struct ReactorShard {
+    int id;
+    int epfd;
+    int listen_fd;
+    pthread_t thread;
+    int connections;
+};
+
+ReactorShard tcp_shards[MAX_TCP_SHARDS];
+int tcp_shard_count = 1;
+
+void close_connection(ReactorShard* shard, Connection* conn) {
+    printf("[Server][TCP] Client disconnected (socket=%d)\n", conn->fd);
+    tcp_client_logout(conn);
+    
+    epoll_ctl(shard->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    shard->connections--;
+    printf("[Server][TCP] ===== Socket %d closed (shard %d) =====\n", conn->fd, shard->id);
+    delete conn;
+}
+
+// Drain the socket (edge-triggered) and dispatch every complete frame.
+// Returns false once the peer is gone.
+bool conn_read(Connection* conn) {
+    uint8_t chunk[65536];
+    bool eof = false;
+    while (1) {
+        ssize_t n = read(conn->fd, chunk, sizeof(chunk));
+        if (n > 0) {
+            conn->rbuf.insert(conn->rbuf.end(), chunk, chunk + n);
+            continue;
         }
+        if (n == 0) { eof = true; break; }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        eof = true;
+        break;
     }
 
-    if (client_canvas_id >= 0) {
-        CanvasRoom* room = get_or_create_canvas(client_canvas_id);
-        pthread_mutex_lock(&room->mutex);
-        
-        // 1. Find the user to get their UID
-        int user_uid = 0;
-        if (room->users.count(client_sock)) {
-            user_uid = room->users[client_sock]->room_uid;
-            room->remove_user(client_sock); // Clean up user data
+    size_t off = 0;
+    while (conn->rbuf.size() - off >= sizeof(TCPMessage)) {
+        TCPMessage msg;
+        memcpy(&msg, conn->rbuf.data() + off, sizeof(TCPMessage));
+        size_t frame = tcp_frame_size(msg);
+        if (frame == 0) {
+            printf("[Server][TCP] Malformed frame (type %d) on socket %d, closing\n", msg.type, conn->fd);
+            return false;
         }
+        if (conn->rbuf.size() - off < frame) break; // Partial frame, wait for more
+        handle_tcp_message(conn, msg, conn->rbuf.data() + off + sizeof(TCPMessage));
+        off += frame;
+    }
+    if (off > 0) conn->rbuf.erase(conn->rbuf.begin(), conn->rbuf.begin() + off);
+
+    return !eof;
+}
 
-        // 2. Remove from TCP list
-        auto& clients = room->tcp_clients;
-        clients.erase(remove(clients.begin(), clients.end(), client_sock), clients.end());
+void accept_connections(ReactorShard* shard) {
+    while (1) {
+        struct sockaddr_in from;
+        socklen_t length = sizeof(from);
+        int client = accept4(shard->listen_fd, (struct sockaddr*)&from, &length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("[Server] Accept");
+            return;
+        }
         
-        // 3. Broadcast LOGOUT
-        if (user_uid > 0) {
-            TCPMessage logoutMsg;
-            memset(&logoutMsg, 0, sizeof(logoutMsg));
-            logoutMsg.type = MSG_LOGOUT;
-            logoutMsg.canvas_id = client_canvas_id;
-            logoutMsg.user_id = user_uid;
-            broadcast_tcp(room, logoutMsg, client_sock);
-            printf("[Server][TCP] Broadcast LOGOUT for UID=%d\n", user_uid);
+        int on = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &from.sin_addr, client_ip, INET_ADDRSTRLEN);
+        printf("[Server] New connection: %s:%d (socket=%d, shard=%d)\n", client_ip, ntohs(from.sin_port), client, shard->id);
+        
+        Connection* conn = new Connection(client, shard->id);
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(shard->epfd, EPOLL_CTL_ADD, client, &ev) < 0) {
+            perror("[Server] epoll_ctl ADD");
+            close(client);
+            delete conn;
+            continue;
         }
-
-        printf("[Server][TCP] Removed socket %d from canvas #%d\n", client_sock, client_canvas_id);
-        pthread_mutex_unlock(&room->mutex);
+        shard->connections++;
+        printf("[Server][TCP] ===== Client connected (socket=%d) =====\n", client);
     }
+}
+
+void* reactor_thread(void* arg) {
+    ReactorShard* shard = (ReactorShard*)arg;
+    printf("[Server][TCP] Reactor shard %d started\n", shard->id);
     
-    close(client_sock);
-    printf("[Server][TCP] ===== Socket %d closed =====\n", client_sock);
+    struct epoll_event events[64];
+    while (1) {
+        int n = epoll_wait(shard->epfd, events, 64, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("[Server] epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == nullptr) {
+                accept_connections(shard);
+                continue;
+            }
+            
+            Connection* conn = (Connection*)events[i].data.ptr;
+            uint32_t ev = events[i].events;
+            bool alive = true;
+            
+            if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                alive = conn_read(conn);
+            }
+            if (alive && (ev & EPOLLOUT)) {
+                pthread_mutex_lock(&conn->wmutex);
+                if (!conn_flush_locked(conn)) conn->dead = true;
+                pthread_mutex_unlock(&conn->wmutex);
+            }
+            
+            pthread_mutex_lock(&conn->wmutex);
+            if (conn->dead) alive = false;
+            pthread_mutex_unlock(&conn->wmutex);
+            
+            if (!alive) close_connection(shard, conn);
+        }
+    }
     return NULL;
 }
 
+bool start_reactor(int listen_fd, int shard_count) {
+    tcp_shard_count = shard_count;
+    for (int i = 0; i < shard_count; i++) {
+        ReactorShard* shard = &tcp_shards[i];
+        shard->id = i;
+        shard->listen_fd = listen_fd;
+        shard->connections = 0;
+        shard->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (shard->epfd < 0) { perror("[Server] epoll_create1"); return false; }
+        
+        // Every shard waits on the listener; EPOLLEXCLUSIVE wakes just one
+        // per incoming connection and that shard keeps the socket.
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = nullptr;
+        if (epoll_ctl(shard->epfd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+            perror("[Server] epoll_ctl listener");
+            return false;
+        }
+        pthread_create(&shard->thread, NULL, reactor_thread, shard);
+    }
+    return true;
+}
+
 /*****************************************************************************
    MAIN
  *****************************************************************************/
 
-int main() {
+int main(int argc, char* argv[]) {
     signal(SIGPIPE, SIG_IGN); // Ignore SIGPIPE to prevent server crash on client disconnect
+    
+    int shard_count = 1;
+    int udp_workers_wanted = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+            shard_count = atoi(argv[++i]);
+            if (shard_count < 1) shard_count = 1;
+            if (shard_count > MAX_TCP_SHARDS) shard_count = MAX_TCP_SHARDS;
+        } else if (strcmp(argv[i], "--udp-workers") == 0 && i + 1 < argc) {
+            udp_workers_wanted = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--tick-hz") == 0 && i + 1 < argc) {
+            udp_tick_hz = atoi(argv[++i]);
+            if (udp_tick_hz < 0) udp_tick_hz = 0;
+            if (udp_tick_hz > 1000) udp_tick_hz = 1000;
+        } else if (strcmp(argv[i], "--codec-threads") == 0 && i + 1 < argc) {
+            codec_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--room-idle-sec") == 0 && i + 1 < argc) {
+            room_idle_sec = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--room-budget-mb") == 0 && i + 1 < argc) {
+            room_budget_bytes = (size_t)atoi(argv[++i]) << 20;
+        } else if (strcmp(argv[i], "--tile-codec") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "rle") == 0) tile_codec = TILE_CODEC_RLE;
+            else if (strcmp(argv[i], "rows") == 0) tile_codec = TILE_CODEC_ROWS;
+            else printf("[Server][Init] Unknown --tile-codec %s, using rows\n", argv[i]);
+        } else if (strcmp(argv[i], "--premultiplied") == 0) {
+            premultiplied_layers = true;
+        }
+    }
+    if (udp_workers_wanted < 1) udp_workers_wanted = 1;
+    if (udp_workers_wanted > MAX_UDP_WORKERS) udp_workers_wanted = MAX_UDP_WORKERS;
+    
     printf("============================================\n");
     printf("  Co-op Canvas Server\n");
     printf("============================================\n\n");
     
     printf("[Server][Init] On-demand canvas system ready\n");
+    printf("[Server][Init] Layers stored %s alpha\n", premultiplied_layers ? "premultiplied" : "straight");
     
-    load_all_canvases();
-    
+    // Brushes first: log replay during load rasterizes with them
     availableBrushes.push_back(new RoundBrush());
     availableBrushes.push_back(new SquareBrush());
     availableBrushes.push_back(new HardEraserBrush());
@@ -1401,9 +4019,12 @@ int main() {
     availableBrushes.push_back(new Airbrush());
     availableBrushes.push_back(new TexturedBrush());
     printf("[Server][Init] Loaded %zu brushes\n", availableBrushes.size());
+    
+    start_codec_pool();
+    load_all_canvases();
 
     printf("[Server][Init] Setting up TCP on port %d...\n", PORT);
-    int tcp_sd = socket(AF_INET, SOCK_STREAM, 0);
+    int tcp_sd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (tcp_sd == -1) { perror("[Server] TCP socket"); return 1; }
     
     int on = 1;
@@ -1418,32 +4039,30 @@ int main() {
     if (bind(tcp_sd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
         perror("[Server] TCP bind"); return 1;
     }
-    if (listen(tcp_sd, 5) == -1) { perror("[Server] TCP listen"); return 1; }
+    if (listen(tcp_sd, SOMAXCONN) == -1) { perror("[Server] TCP listen"); return 1; }
+    
+    if (!start_udp_workers(udp_workers_wanted)) return 1;
+    start_broadcast_tick();
 
     printf("\n[Server] ===== SERVER READY =====\n");
-    printf("[Server] TCP: %d | UDP: %d+ (on-demand) | Layers: %d\n", 
-           PORT, PORT+1, MAX_LAYERS);
+    printf("[Server] TCP: %d (%d shards) | UDP: %d (%d workers) | Layers: %d\n", 
+           PORT, shard_count, UDP_PORT, udp_workers_wanted, MAX_LAYERS);
     printf("==========================================\n\n");
 
+    pthread_t wal_th;
+    pthread_create(&wal_th, NULL, wal_writer_thread, NULL);
+    
     pthread_t save_th;
-    pthread_create(&save_th, NULL, autosave_thread, NULL);
+    pthread_create(&save_th, NULL, snapshot_thread, NULL);
+    
+    pthread_t stats_th;
+    pthread_create(&stats_th, NULL, stats_thread, NULL);
 
-    printf("[Server] Waiting for connections...\n\n");
-    while (1) {
-        struct sockaddr_in from;
-        socklen_t length = sizeof(from);
-        
-        int client = accept(tcp_sd, (struct sockaddr*)&from, &length);
-        if (client < 0) { perror("[Server] Accept"); continue; }
-        
-        char client_ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &from.sin_addr, client_ip, INET_ADDRSTRLEN);
-        printf("[Server] New connection: %s:%d (socket=%d)\n", client_ip, ntohs(from.sin_port), client);
+    if (!start_reactor(tcp_sd, shard_count)) return 1;
 
-        int* arg = (int*)malloc(sizeof(int));
-        *arg = client;
-        
-        pthread_t tcp_th;
-        pthread_create(&tcp_th, NULL, tcp_client_session, arg);
+    printf("[Server] Waiting for connections...\n\n");
+    for (int i = 0; i < shard_count; i++) {
+        pthread_join(tcp_shards[i].thread, NULL);
     }
+    return 0;
 }
@@ -0,0 +1,116 @@
+// base64.h: every kernel this CPU runs against a plain bit-accumulating
+// decoder (the one base64.h replaced), on valid input, padding and stray
+// characters anywhere.
+//
+//   g++ -std=c++17 -O2 tests/base64_test.cpp -o base64_test
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "../base64.h"
+
+static const char* ALPHABET = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static uint32_t rng = 7;
+
+static uint32_t next() {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+// Stops at the first character outside the alphabet
+static std::vector<uint8_t> reference_decode(const std::string& in) {
+    std::vector<uint8_t> out;
+    uint32_t bits = 0;
+    int nbits = 0;
+    for (char ch : in) {
+        const char* p = ch ? strchr(ALPHABET, ch) : nullptr;
+        if (!p) break;
+        bits = (bits << 6) | (uint32_t)(p - ALPHABET);
+        nbits += 6;
+        if (nbits >= 8) {
+            nbits -= 8;
+            out.push_back((uint8_t)(bits >> nbits));
+        }
+    }
+    return out;
+}
+
+static std::string encode(const std::vector<uint8_t>& data) {
+    std::string out;
+    size_t i = 0;
+    for (; i + 3 <= data.size(); i += 3) {
+        uint32_t v = data[i] << 16 | data[i + 1] << 8 | data[i + 2];
+        for (int k = 3; k >= 0; k--) out += ALPHABET[(v >> (6 * k)) & 63];
+    }
+    if (i + 1 == data.size()) {
+        uint32_t v = data[i] << 16;
+        out += ALPHABET[v >> 18];
+        out += ALPHABET[(v >> 12) & 63];
+        out += "==";
+    } else if (i + 2 == data.size()) {
+        uint32_t v = data[i] << 16 | data[i + 1] << 8;
+        out += ALPHABET[v >> 18];
+        out += ALPHABET[(v >> 12) & 63];
+        out += ALPHABET[(v >> 6) & 63];
+        out += '=';
+    }
+    return out;
+}
+
+// Encoded random bytes, sometimes with a stray character, cut short, or
+// followed by more text the way a JSON string is
+static std::string random_input() {
+    std::vector<uint8_t> data(next() % 400);
+    for (uint8_t& b : data) b = (uint8_t)next();
+    std::string s = encode(data);
+    if (next() % 4 == 0 && !s.empty()) s.resize(next() % s.size());
+    if (next() % 3 == 0) {
+        static const char stray[] = {'=', '"', '\n', ' ', '-', '_', '.', '\0', (char)0x80, (char)0xff};
+        s.insert(s.begin() + (s.empty() ? 0 : next() % s.size()), stray[next() % sizeof(stray)]);
+    }
+    if (next() % 4 == 0) s += "\",\"name\":\"x\"";
+    return s;
+}
+
+struct Kernel {
+    const char* name;
+    Base64DecodeFn fn;
+    int failed;
+};
+
+static void check(Kernel& k, const std::string& in) {
+    std::vector<uint8_t> want = reference_decode(in);
+    size_t cap = base64_decoded_size(in.size());
+    std::vector<uint8_t> out(cap + 64, 0xA5);
+    size_t n = k.fn(in.data(), in.size(), out.data());
+    bool ok = n == want.size() && memcmp(out.data(), want.data(), n) == 0;
+    for (size_t i = cap; i < out.size() && ok; i++) ok = out[i] == 0xA5; // Stayed inside the buffer
+    if (ok) return;
+    if (k.failed++ < 5) printf("  FAIL %s: %zu chars -> %zu bytes, want %zu\n", k.name, in.size(), n, want.size());
+}
+
+int main() {
+    std::vector<Kernel> kernels = {{"scalar", base64_decode_scalar, 0}};
+#ifdef BASE64_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) kernels.push_back({"ssse3", base64_decode_ssse3, 0});
+    if (__builtin_cpu_supports("avx2")) kernels.push_back({"avx2", base64_decode_avx2, 0});
+#endif
+    printf("dispatch: %s\n", Base64Kernel::get().name);
+
+    const int inputs = 200000;
+    for (int i = 0; i < inputs; i++) {
+        std::string in = random_input();
+        for (Kernel& k : kernels) check(k, in);
+    }
+
+    bool ok = true;
+    for (const Kernel& k : kernels) {
+        printf("%-6s == reference   %d/%d\n", k.name, inputs - k.failed, inputs);
+        ok &= k.failed == 0;
+    }
+    printf("%s\n", ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
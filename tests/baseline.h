@@ -0,0 +1,364 @@
+#ifndef TESTS_BASELINE_H
+#define TESTS_BASELINE_H
+
+// Code the shared headers replaced, kept as it was so bench.cpp can measure
+// against it: the PackBits layer storage codec.h's tile codecs replaced
+// (canvas.json), the string::find base64 decoder base64.h replaced, and the
+// per-pixel std::function brushes brushes.h's span sinks replaced. Not used
+// by the server or client. Build with -DSERVER_SIDE.
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cctype>
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+#include "../brushes.h" // Pixel
+
+namespace baseline {
+
+using std::string;
+using std::vector;
+
+static const string b64_chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// PackBits Compression
+// Header N:
+// [0, 127]   -> (N+1) literal bytes follow
+// [-127, -1] -> Repeat next byte (1-N) times (2 to 128 times)
+// -128       -> No-op
+inline vector<uint8_t> packbits_compress(const uint8_t* data, size_t len) {
+    vector<uint8_t> out;
+    size_t i = 0;
+    while (i < len) {
+        // Look for run
+        size_t run_start = i;
+        while (i + 1 < len && data[i] == data[i+1] && (i - run_start) < 127) {
+            i++;
+        }
+
+        if (i > run_start) {
+            // We have a run of (i - run_start + 1) bytes
+            // Length is at least 2
+            int count = (i - run_start + 1);
+            out.push_back((uint8_t)(257 - count)); // -count + 1 + 256 = 257 - count
+            out.push_back(data[run_start]);
+            i++;
+        } else {
+            // Literal Run (Non-repeating sequence)
+            size_t j = i;
+
+            // Advance j until we hit a run of 3 identical bytes OR max literal length (128)
+            while (j < len && (j - i) < 128) {
+                if (j + 2 < len && data[j] == data[j+1] && data[j] == data[j+2]) {
+                    break; // Found a run of 3, stop literal here
+                }
+                j++;
+            }
+
+            int count = (j - i);
+            out.push_back((uint8_t)(count - 1)); // 0 means 1 literal byte
+
+            for (size_t k = 0; k < (size_t)count; k++) {
+                out.push_back(data[i + k]);
+            }
+
+            i = j;
+        }
+    }
+    return out;
+}
+
+inline vector<uint8_t> packbits_decompress(const vector<uint8_t>& in) {
+    vector<uint8_t> out;
+    size_t i = 0;
+    while (i < in.size()) {
+        int8_t n = (int8_t)in[i++];
+        if (n == -128) continue; // No-op
+
+        if (n >= 0) {
+            // 0 to 127: Copy N+1 bytes
+            int count = n + 1;
+            for (int k = 0; k < count && i < in.size(); k++) {
+                out.push_back(in[i++]);
+            }
+        } else {
+            // -1 to -127: Repeat next byte (1-N) times
+            int count = 1 - n;
+            if (i < in.size()) {
+                uint8_t val = in[i++];
+                for (int k = 0; k < count; k++) {
+                    out.push_back(val);
+                }
+            }
+        }
+    }
+    return out;
+}
+
+inline bool is_base64(unsigned char c) {
+    return (isalnum(c) || (c == '+') || (c == '/'));
+}
+
+inline vector<unsigned char> base64_decode(const string& encoded_string) {
+    int in_len = encoded_string.size();
+    int i = 0, j = 0, in_ = 0;
+    unsigned char char_array_4[4], char_array_3[3];
+    vector<unsigned char> ret;
+
+    while (in_len-- && encoded_string[in_] != '=' && is_base64(encoded_string[in_])) {
+        char_array_4[i++] = encoded_string[in_]; in_++;
+        if (i == 4) {
+            for (i = 0; i < 4; i++)
+                char_array_4[i] = b64_chars.find(char_array_4[i]);
+
+            char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
+            char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
+            char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+
+            for (i = 0; i < 3; i++)
+                ret.push_back(char_array_3[i]);
+            i = 0;
+        }
+    }
+
+    if (i) {
+        for (j = i; j < 4; j++) char_array_4[j] = 0;
+        for (j = 0; j < 4; j++) char_array_4[j] = b64_chars.find(char_array_4[j]);
+
+        char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
+        char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
+        char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+
+        for (j = 0; j < i - 1; j++) ret.push_back(char_array_3[j]);
+    }
+
+    return ret;
+}
+
+// --- BASE CLASS ---
+class Brush {
+public:
+    int size = 15;
+    int opacity = 255;
+    virtual ~Brush() = default;
+    virtual void paint(int x, int y, Pixel color, int size, int pressure, int angle, std::function<void(int, int, Pixel)> setPixel) = 0;
+};
+
+// --- EXISTING BRUSHES (Unchanged) ---
+class RoundBrush : public Brush {
+public:
+    void paint(int x, int y, Pixel color, int size, int pressure, int angle, std::function<void(int, int, Pixel)> setPixel) override {
+        (void)angle; (void)pressure;
+        color.a = (uint8_t)((color.a * opacity) / 255);
+        int r = size / 2;
+        if (r < 1) { setPixel(x, y, color); return; }
+        for (int i = -r; i <= r; i++) {
+            for (int j = -r; j <= r; j++) {
+                if (i*i + j*j <= r*r) setPixel(x + i, y + j, color);
+            }
+        }
+    }
+};
+
+class SquareBrush : public Brush {
+public:
+    void paint(int x, int y, Pixel color, int size, int pressure, int angle, std::function<void(int, int, Pixel)> setPixel) override {
+        (void)angle; (void)pressure;
+        color.a = (uint8_t)((color.a * opacity) / 255);
+        int r = size / 2;
+        for (int i = -r; i <= r; i++) {
+            for (int j = -r; j <= r; j++) setPixel(x + i, y + j, color);
+        }
+    }
+};
+
+class HardEraserBrush : public Brush {
+public:
+    void paint(int x, int y, Pixel color, int size, int pressure, int angle, std::function<void(int, int, Pixel)> setPixel) override {
+        (void)color; (void)pressure; (void)angle;
+        int r = size / 2;
+        for (int i = -r; i <= r; i++) {
+            for (int j = -r; j <= r; j++) {
+                Pixel erased = {0, 0, 0, 0};
+                setPixel(x + i, y + j, erased);
+            }
+        }
+    }
+};
+
+class PressureBrush : public Brush {
+public:
+    void paint(int x, int y, Pixel color, int maxSize, int pressure, int angle, std::function<void(int, int, Pixel)> setPixel) override {
+        (void)angle;
+        float p = pressure / 255.0f;
+        float opacityCurve = 0.2f + 0.8f * sqrt(p);
+        if (opacityCurve > 1.0f) opacityCurve = 1.0f;
+        float baseAlpha = (color.a * opacity / 255.0f) * opacityCurve;
+
+        // Thinner at low pressure: 10% to 100%
+        float effectiveDiameter = maxSize * (0.1f + 0.9f * p);
+        float radius = effectiveDiameter / 2.0f;
+        if (radius < 0.5f) radius = 0.5f;
+        int range = (int)ceil(radius) + 1;
+
+        float featherRange = 1.5f;
+        float maxDist = radius + (featherRange / 2.0f);
+        float maxDist2 = maxDist * maxDist;
+
+        for (int i = -range; i <= range; i++) {
+            int i2 = i * i;
+            for (int j = -range; j <= range; j++) {
+                float dist2 = i2 + j*j;
+                if (dist2 < maxDist2) {
+                    float dist = sqrt(dist2);
+                    float delta = (radius - dist + (featherRange / 2.0f)) / featherRange;
+                    if (delta > 0.0f) {
+                        if (delta > 1.0f) delta = 1.0f;
+                        Pixel px = color;
+                        px.a = (uint8_t)(baseAlpha * delta);
+                        if (px.a > 0) setPixel(x + i, y + j, px);
+                    }
+                }
+            }
+        }
+    }
+};
+
+class Airbrush : public Brush {
+public:
+    void paint(int x, int y, Pixel color, int size, int pressure, int angle, std::function<void(int, int, Pixel)> setPixel) override {
+        (void)angle;
+        float p = pressure / 255.0f;
+        int effectiveSize = (int)(size * (0.5f + 0.5f * p));
+        if (effectiveSize < 1) effectiveSize = 1;
+
+        // Much lower alpha for accumulation (0.05 to 0.2)
+        float pressureAlphaMod = 0.05f + 0.15f * p;
+        int r = effectiveSize;
+        int r2 = r * r;
+
+        for (int i = -r; i <= r; i++) {
+            int i2 = i * i;
+            for (int j = -r; j <= r; j++) {
+                int dist2 = i2 + j*j;
+                if (dist2 <= r2) {
+                    float dist = sqrt(dist2);
+                    float falloff = 1.0f - (dist / r);
+                    falloff = falloff * falloff;
+                    float finalAlphaFloat = (color.a * opacity / 255.0f) * pressureAlphaMod * falloff;
+                    Pixel px = color;
+                    px.a = (uint8_t)finalAlphaFloat;
+                    if (px.a > 0) setPixel(x + i, y + j, px);
+                }
+            }
+        }
+    }
+};
+
+// --- NEW / MODIFIED BRUSHES ---
+class TexturedBrush : public Brush {
+    // A smoother bristle map. Lower numbers are gaps between bristles.
+    const float bristles[32] = {
+        0.3f, 0.7f, 0.9f, 0.5f, 0.2f, 0.8f, 0.9f, 0.4f,
+        0.9f, 0.6f, 0.3f, 0.8f, 0.9f, 0.2f, 0.7f, 0.5f,
+        0.4f, 0.9f, 0.8f, 0.3f, 0.6f, 0.9f, 0.5f, 0.2f,
+        0.8f, 0.4f, 0.9f, 0.7f, 0.3f, 0.8f, 0.6f, 0.4f
+    };
+
+public:
+    void paint(int x, int y, Pixel color, int size, int pressure, int angle, std::function<void(int, int, Pixel)> setPixel) override {
+        float rads = angle * (M_PI / 180.0f);
+        float p = pressure / 255.0f;
+
+        // Vector perpendicular to drawing direction
+        float dx = -sin(rads);
+        float dy = cos(rads);
+
+        // Width doesn't change much with pressure to keep it controllable
+        int halfWidth = size / 2;
+        if (halfWidth < 1) halfWidth = 1;
+
+        // Pressure Curve: High pressure rapidly approaches 1.0 (solid)
+        // Low pressure stays near 0.0 (transparent/streaky)
+        float pressurePower = pow(p, 0.5f); // Square root curve for fast ramp-up
+
+        for (int i = -halfWidth; i <= halfWidth; i++) {
+            int px = x + (int)(dx * i);
+            int py = y + (int)(dy * i);
+
+            // Sample bristle map. We mirror it for symmetry around the center.
+            int patternIndex = abs(i) % 32;
+            float bristleStrength = bristles[patternIndex];
+
+            // If pressure is high (1.0), combined strength becomes >= 1.0 everywhere.
+            // If pressure is low, the bristle map dominates.
+            float combinedStrength = bristleStrength + (pressurePower * 0.8f);
+            if (combinedStrength > 1.0f) combinedStrength = 1.0f;
+
+            // Soft Edges: A slight falloff at the very tips of the brush
+            float edgeDist = (float)abs(i) / halfWidth;
+            float edgeSoftness = 1.0f - pow(edgeDist, 4.0f); // Sharp falloff near edge
+
+            float finalAlpha = (color.a / 255.0f) * (opacity / 255.0f) * combinedStrength * edgeSoftness;
+
+            Pixel finalColor = color;
+            finalColor.a = (uint8_t)(finalAlpha * 255);
+
+            // Only draw visible pixels
+            if (finalColor.a > 5) {
+                setPixel(px, py, finalColor);
+            }
+        }
+    }
+};
+
+// 2. NEW SOFT ERASER
+class SoftEraserBrush : public Brush {
+public:
+    void paint(int x, int y, Pixel color, int size, int pressure, int angle, std::function<void(int, int, Pixel)> setPixel) override {
+        (void)color; (void)angle;
+        float p = pressure / 255.0f;
+
+        // Dynamic size with pressure (like airbrush)
+        int effectiveSize = (int)(size * (0.5f + 0.5f * p));
+        if (effectiveSize < 1) effectiveSize = 1;
+
+        // Pressure affects how STRONG the erasing is
+        // 10% min strength -> 100% max
+        float pressureMod = 0.1f + 0.9f * p;
+
+        int r = effectiveSize;
+        int r2 = r * r;
+
+        for (int i = -r; i <= r; i++) {
+            int i2 = i * i;
+            for (int j = -r; j <= r; j++) {
+                int dist2 = i2 + j*j;
+                if (dist2 <= r2) {
+                    float dist = sqrt(dist2);
+                    // Soft edges (Cubic falloff)
+                    float falloff = 1.0f - (dist / r);
+                    falloff = falloff * falloff * falloff;
+
+                    // Calculate "Eraser Strength" (0 to 255)
+                    // We store this in the ALPHA channel of the pixel we pass
+                    uint8_t strength = (uint8_t)(255 * falloff * pressureMod * (opacity / 255.0f));
+
+                    if (strength > 0) {
+                        // We send {0,0,0, strength}.
+                        // The RGB doesn't matter, only the Alpha (Strength).
+                        Pixel p = {0, 0, 0, strength};
+                        setPixel(x + i, y + j, p);
+                    }
+                }
+            }
+        }
+    }
+};
+
+} // namespace baseline
+
+#endif
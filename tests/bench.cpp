@@ -0,0 +1,253 @@
+// Microbenchmarks for the shared headers: blend kernels, base64 kernels,
+// tile codecs, brush dabs and line rasterization (swept stamp against a dab
+// per step). base64, codec and dabs also run the code each header replaced
+// (baseline.h). Best of 7 runs, single thread.
+//
+//   g++ -std=c++17 -O2 -DSERVER_SIDE tests/bench.cpp -o bench
+//   ./bench [blend|base64|codec|dabs|lines]
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include "rgba_sink.h"
+#include "baseline.h"
+#include "../base64.h"
+#include "../codec.h"
+
+static uint32_t rng = 1;
+
+static uint32_t next() {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+// Best wall time of f() in seconds
+template<class F>
+static double best_of(F f, int runs = 7) {
+    double best = 1e9;
+    for (int i = 0; i < runs; i++) {
+        auto t0 = std::chrono::steady_clock::now();
+        f();
+        std::chrono::duration<double> dt = std::chrono::steady_clock::now() - t0;
+        best = std::min(best, dt.count());
+    }
+    return best;
+}
+
+static void bench_blend() {
+    const int n = 1 << 20;
+    std::vector<uint8_t> src(n * 4), dst(n * 4), alpha(n), work;
+    for (int i = 0; i < n; i++) {
+        for (int ch = 0; ch < 3; ch++) src[i * 4 + ch] = next(), dst[i * 4 + ch] = next();
+        src[i * 4 + 3] = 1 + next() % 254;
+        dst[i * 4 + 3] = next();
+        alpha[i] = 1 + next() % 254;
+    }
+    uint8_t rgba[4] = {200, 100, 50, 255};
+
+    struct { const char* name; BlendRowFn row; BlendSpanFn span; bool ok; } kernels[] = {
+        {"scalar", blend_row_scalar, blend_span_scalar, true},
+#ifdef BLEND_X86
+        {"sse2", blend_row_sse2, blend_span_sse2, (bool)__builtin_cpu_supports("sse2")},
+        {"avx2", blend_row_avx2, blend_span_avx2, (bool)__builtin_cpu_supports("avx2")},
+#endif
+    };
+    printf("blend, 1M pixels, alpha 1-254 (Mpix/s)\n");
+    for (auto& k : kernels) {
+        if (!k.ok) continue;
+        work = dst;
+        double row = best_of([&] { k.row(work.data(), src.data(), n); });
+        double span = best_of([&] { k.span(work.data(), n, rgba, alpha.data()); });
+        printf("  %-7s row %6.0f   span + mask %6.0f\n", k.name, n / row / 1e6, n / span / 1e6);
+    }
+}
+
+static void bench_base64() {
+    const char* chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string in(8 << 20, 'A');
+    for (char& ch : in) ch = chars[next() % 64];
+    std::vector<uint8_t> out(base64_decoded_size(in.size()));
+
+    struct { const char* name; Base64DecodeFn fn; bool ok; } kernels[] = {
+        {"scalar", base64_decode_scalar, true},
+#ifdef BASE64_X86
+        {"ssse3", base64_decode_ssse3, (bool)__builtin_cpu_supports("ssse3")},
+        {"avx2", base64_decode_avx2, (bool)__builtin_cpu_supports("avx2")},
+#endif
+    };
+    printf("base64 decode, 8 MB of text (MB/s)\n");
+    double old = best_of([&] { baseline::base64_decode(in); });
+    printf("  %-7s %6.0f\n", "old", in.size() / old / 1e6);
+    for (auto& k : kernels) {
+        if (!k.ok) continue;
+        double t = best_of([&] { k.fn(in.data(), in.size(), out.data()); });
+        printf("  %-7s %6.0f\n", k.name, in.size() / t / 1e6);
+    }
+}
+
+// A 1280x720 layer painted with random round, pressure, airbrush and soft
+// eraser strokes
+static RgbaImage painted_layer() {
+    RgbaImage img(1280, 720);
+    static const RoundBrush round;
+    static const PressureBrush pressure;
+    static const Airbrush air;
+    static const SoftEraserBrush soft;
+    for (int i = 0; i < 400; i++) {
+        DabOp op;
+        op.x = next() % 1280;
+        op.y = next() % 720;
+        op.ex = op.x + (int)(next() % 200) - 100;
+        op.ey = op.y + (int)(next() % 200) - 100;
+        op.line = true;
+        op.params = {{(uint8_t)next(), (uint8_t)next(), (uint8_t)next(), 255}, 4 + (int)(next() % 40),
+                     (int)(next() % 256), 0, 128 + (int)(next() % 128)};
+        switch (i % 8) {
+            case 0: case 1: case 2: paint_rgba(&round, op, img); break;
+            case 3: case 4: paint_rgba(&pressure, op, img); break;
+            case 5: case 6: paint_rgba(&air, op, img); break;
+            default: paint_rgba(&soft, op, img); break;
+        }
+    }
+    return img;
+}
+
+static void bench_codec() {
+    RgbaImage img = painted_layer();
+    const int tiles_x = 1280 / TILE_SIZE, tiles_y = 720 / TILE_SIZE;
+    std::vector<std::vector<uint32_t>> tiles;
+    for (int ty = 0; ty < tiles_y; ty++) {
+        for (int tx = 0; tx < tiles_x; tx++) {
+            std::vector<uint32_t> px(TILE_PIXELS);
+            for (int y = 0; y < TILE_SIZE; y++) {
+                memcpy(&px[y * TILE_SIZE], &img.at(tx * TILE_SIZE, ty * TILE_SIZE + y), TILE_SIZE * 4);
+            }
+            tiles.push_back(px);
+        }
+    }
+    double raw = (double)tiles.size() * TILE_PIXELS * 4;
+
+    printf("tile codecs, painted 1280x720 layer (raw / encoded, encode / decode MB/s)\n");
+    // The old layer storage: PackBits over the whole row-major layer
+    std::vector<uint8_t> packed;
+    double pe = best_of([&] { packed = baseline::packbits_compress((const uint8_t*)img.px.data(), raw); });
+    bool pok = true;
+    double pd = best_of([&] { pok &= baseline::packbits_decompress(packed).size() == raw; });
+    printf("  %-8s %5.1fx  %6.0f / %6.0f%s\n", "packbits", raw / packed.size(), raw / pe / 1e6, raw / pd / 1e6,
+           pok ? "" : "  (DECODE FAILED)");
+    for (uint8_t codec : {(uint8_t)TILE_CODEC_RLE, (uint8_t)TILE_CODEC_ROWS}) {
+        std::vector<std::vector<uint8_t>> enc(tiles.size());
+        double te = best_of([&] {
+            for (size_t i = 0; i < tiles.size(); i++) {
+                enc[i].clear();
+                encode_tile_pixels(tiles[i].data(), TILE_SIZE, TILE_SIZE, codec, enc[i]);
+            }
+        });
+        size_t bytes = 0;
+        for (auto& e : enc) bytes += e.size();
+        uint32_t px[TILE_PIXELS];
+        bool ok = true;
+        double td = best_of([&] {
+            for (size_t i = 0; i < tiles.size(); i++) {
+                ok &= codec == TILE_CODEC_ROWS
+                    ? rows_decode_pixels(enc[i].data(), enc[i].size(), px, TILE_SIZE, TILE_SIZE)
+                    : rle_decode_pixels(enc[i].data(), enc[i].size(), px, TILE_PIXELS);
+            }
+        });
+        printf("  %-8s %5.1fx  %6.0f / %6.0f%s\n", codec == TILE_CODEC_ROWS ? "rows" : "rle",
+               raw / bytes, raw / te / 1e6, raw / td / 1e6, ok ? "" : "  (DECODE FAILED)");
+    }
+}
+
+// One 60 px dab at a time, written the way the server wrote layers before
+// blending: replaced, or alpha subtracted for the soft eraser. Old is the
+// per-pixel std::function brush, new the span brush into RgbaSink.
+template<class B, class Old>
+static void bench_dab(const char* name) {
+    static const B brush;
+    Old old_brush;
+    const bool subtract = B::KIND == BRUSH_KIND_SOFT_ERASER;
+    RgbaImage img(1280, 720);
+    DabOp op = {0, 0, 0, 0, false, {{200, 40, 90, 255}, 60, 200, 30, 255}};
+    const int dabs = 2000;
+    auto at = [](int i, int& x, int& y) { x = 40 + i * 37 % 1200; y = 40 + i * 53 % 640; };
+
+    auto set_pixel = [&](int x, int y, Pixel c) {
+        if (x < 0 || x >= img.w || y < 0 || y >= img.h) return;
+        Pixel& p = img.at(x, y);
+        if (subtract) p.a = p.a > c.a ? p.a - c.a : 0;
+        else p = c;
+    };
+    double t_old = best_of([&] {
+        for (int i = 0; i < dabs; i++) {
+            int x, y;
+            at(i, x, y);
+            old_brush.paint(x, y, op.params.color, op.params.size, op.params.pressure, op.params.angle, set_pixel);
+        }
+    });
+    auto run_new = [&](auto sink) {
+        DabClip<decltype(sink)> out = {sink, img.w, img.h};
+        return best_of([&] {
+            for (int i = 0; i < dabs; i++) {
+                at(i, op.x, op.y);
+                paint_op(&brush, op, out);
+            }
+        });
+    };
+    double t_new = subtract ? run_new(RgbaSink<DAB_SUBTRACT>(img)) : run_new(RgbaSink<DAB_ERASE>(img));
+    printf("  %-12s %7.1fk -> %7.1fk  (x%.1f)\n", name, dabs / t_old / 1e3, dabs / t_new / 1e3, t_old / t_new);
+}
+
+static void bench_dabs() {
+    printf("60 px dabs, replace (old std::function per pixel -> span sink, dabs/s)\n");
+    bench_dab<RoundBrush, baseline::RoundBrush>("round");
+    bench_dab<SquareBrush, baseline::SquareBrush>("square");
+    bench_dab<HardEraserBrush, baseline::HardEraserBrush>("hard eraser");
+    bench_dab<PressureBrush, baseline::PressureBrush>("pressure");
+    bench_dab<Airbrush, baseline::Airbrush>("airbrush");
+    bench_dab<TexturedBrush, baseline::TexturedBrush>("textured");
+    bench_dab<SoftEraserBrush, baseline::SoftEraserBrush>("soft eraser");
+}
+
+template<class B, DabMode Mode>
+static void bench_line(const char* name) {
+    static const B brush;
+    RgbaImage img(1280, 720);
+    DabOp op = {500, 300, 700, 340, true, {{200, 40, 90, 255}, 50, 200, 0, 255}};
+    const int lines = 200;
+    RgbaSink<Mode> sink(img);
+    DabClip<RgbaSink<Mode>> out = {sink, img.w, img.h};
+    double steps = best_of([&] {
+        for (int i = 0; i < lines; i++) {
+            bresenham(op.x, op.y, op.ex, op.ey, [&](int x, int y) { brush.dab(x, y, op.params, out); });
+        }
+    });
+    double sweep = best_of([&] {
+        for (int i = 0; i < lines; i++) paint_op(&brush, op, out);
+    });
+    printf("  %-12s %7.1f us -> %6.1f us  (x%.1f)\n", name, steps / lines * 1e6, sweep / lines * 1e6, steps / sweep);
+}
+
+static void bench_lines() {
+    printf("200 px line, size 50 (per step -> swept, per line)\n");
+    bench_line<RoundBrush, DAB_OVER>("round");
+    bench_line<SquareBrush, DAB_OVER>("square");
+    bench_line<PressureBrush, DAB_OVER>("pressure");
+    bench_line<Airbrush, DAB_OVER>("airbrush");
+    bench_line<SoftEraserBrush, DAB_SUBTRACT>("soft eraser");
+}
+
+int main(int argc, char** argv) {
+    std::string only = argc > 1 ? argv[1] : "";
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+#endif
+    if (only.empty() || only == "blend") bench_blend();
+    if (only.empty() || only == "base64") bench_base64();
+    if (only.empty() || only == "codec") bench_codec();
+    if (only.empty() || only == "dabs") bench_dabs();
+    if (only.empty() || only == "lines") bench_lines();
+    return 0;
+}
@@ -0,0 +1,174 @@
+// blend.h: the scalar kernels against the formula in its header comment,
+// and every vector kernel this CPU runs against the scalar ones.
+//
+//   g++ -std=c++17 -O2 tests/blend_test.cpp -o blend_test
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include "../blend.h"
+
+static uint32_t rng = 2024;
+
+static uint32_t next() {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+// Mostly transparent, opaque or anything, like real coverage
+static uint8_t random_alpha() {
+    switch (next() % 4) {
+        case 0: return 0;
+        case 1: return 255;
+        default: return (uint8_t)next();
+    }
+}
+
+static void random_pixels(std::vector<uint8_t>& px) {
+    for (size_t i = 0; i < px.size(); i += 4) {
+        for (int ch = 0; ch < 3; ch++) px[i + ch] = (uint8_t)next();
+        px[i + 3] = random_alpha();
+    }
+}
+
+struct Kernels {
+    const char* name;
+    BlendRowFn row, row_pm;
+    BlendSpanFn span, span_pm;
+    PixelRowFn premultiply;
+};
+
+static int failures = 0;
+
+static void expect(bool ok, const char* kernel, const char* what, int n) {
+    if (ok) return;
+    if (failures++ < 10) printf("  FAIL %s %s (n = %d)\n", kernel, what, n);
+}
+
+// blend_pixel against the straight-alpha formula, every (sa, da) pair
+static void check_formula() {
+    for (int sa = 0; sa < 256; sa++) {
+        for (int da = 0; da < 256; da++) {
+            uint8_t s[4] = {(uint8_t)next(), (uint8_t)next(), (uint8_t)next(), (uint8_t)sa};
+            uint8_t d[4] = {(uint8_t)next(), (uint8_t)next(), (uint8_t)next(), (uint8_t)da};
+            uint8_t want[4] = {d[0], d[1], d[2], d[3]};
+            if (sa) {
+                int t = (da * (255 - sa) + 127) / 255;
+                int oa = sa + t;
+                int f = sa * 256 / oa;
+                for (int ch = 0; ch < 3; ch++) want[ch] = (s[ch] * f + d[ch] * (256 - f) + 128) >> 8;
+                want[3] = oa;
+            }
+            blend_pixel(d, s);
+            expect(memcmp(d, want, 4) == 0, "scalar", "formula", 1);
+        }
+    }
+}
+
+// One kernel set against scalar on n pixels from misaligned offsets
+static void check_rows(const Kernels& k, int n) {
+    int off = next() % 4 * 4;
+    std::vector<uint8_t> src(n * 4 + 16), dst(n * 4 + 16), ref, out;
+    std::vector<uint8_t> alpha(n + 4);
+    random_pixels(src);
+    random_pixels(dst);
+    for (uint8_t& a : alpha) a = random_alpha();
+    uint8_t rgba[4] = {(uint8_t)next(), (uint8_t)next(), (uint8_t)next(), random_alpha()};
+
+    ref = dst;
+    out = dst;
+    blend_row_scalar(&ref[off], &src[off], n);
+    k.row(&out[off], &src[off], n);
+    expect(ref == out, k.name, "row", n);
+
+    ref = dst;
+    out = dst;
+    blend_span_scalar(&ref[off], n, rgba, nullptr);
+    k.span(&out[off], n, rgba, nullptr);
+    expect(ref == out, k.name, "span", n);
+
+    ref = dst;
+    out = dst;
+    blend_span_scalar(&ref[off], n, rgba, &alpha[off / 4]);
+    k.span(&out[off], n, rgba, &alpha[off / 4]);
+    expect(ref == out, k.name, "span + mask", n);
+
+    ref = dst;
+    out = dst;
+    blend_row_pm_scalar(&ref[off], &src[off], n);
+    k.row_pm(&out[off], &src[off], n);
+    expect(ref == out, k.name, "row_pm", n);
+
+    ref = dst;
+    out = dst;
+    blend_span_pm_scalar(&ref[off], n, rgba, nullptr);
+    k.span_pm(&out[off], n, rgba, nullptr);
+    expect(ref == out, k.name, "span_pm", n);
+
+    ref = dst;
+    out = dst;
+    blend_span_pm_scalar(&ref[off], n, rgba, &alpha[off / 4]);
+    k.span_pm(&out[off], n, rgba, &alpha[off / 4]);
+    expect(ref == out, k.name, "span_pm + mask", n);
+
+    ref = src;
+    out = src;
+    premultiply_row_scalar(&ref[off], n);
+    k.premultiply(&out[off], n);
+    expect(ref == out, k.name, "premultiply", n);
+}
+
+// Every (sa, da) pair in one row, so each lane position sees all of them
+static void check_pairs(const Kernels& k) {
+    const int n = 65536;
+    std::vector<uint8_t> src(n * 4), dst(n * 4);
+    random_pixels(src);
+    random_pixels(dst);
+    for (int i = 0; i < n; i++) {
+        src[i * 4 + 3] = i >> 8;
+        dst[i * 4 + 3] = i & 255;
+    }
+    std::vector<uint8_t> ref = dst, out = dst;
+    blend_row_scalar(ref.data(), src.data(), n);
+    k.row(out.data(), src.data(), n);
+    expect(ref == out, k.name, "row, every (sa, da)", n);
+
+    ref = dst;
+    out = dst;
+    blend_row_pm_scalar(ref.data(), src.data(), n);
+    k.row_pm(out.data(), src.data(), n);
+    expect(ref == out, k.name, "row_pm, every (sa, da)", n);
+}
+
+int main() {
+    std::vector<Kernels> kernels;
+#ifdef BLEND_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        kernels.push_back({"sse2", blend_row_sse2, blend_row_pm_sse2, blend_span_sse2,
+                           blend_span_pm_sse2, premultiply_row_sse2});
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.push_back({"avx2", blend_row_avx2, blend_row_pm_avx2, blend_span_avx2,
+                           blend_span_pm_avx2, premultiply_row_avx2});
+    }
+#endif
+    printf("dispatch: %s\n", BlendKernel::get().name);
+
+    check_formula();
+    printf("scalar == formula, every (sa, da)   %s\n", failures ? "FAIL" : "ok");
+
+    for (const Kernels& k : kernels) {
+        int before = failures;
+        check_pairs(k);
+        for (int rep = 0; rep < 20000; rep++) check_rows(k, next() % 80);
+        for (int rep = 0; rep < 500; rep++) check_rows(k, 1000 + next() % 1000);
+        printf("%-6s == scalar                     %s\n", k.name, failures > before ? "FAIL" : "ok");
+    }
+    if (kernels.empty()) printf("no vector kernels on this CPU\n");
+
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,157 @@
+// codec.h: round trips of both tile codecs over full and edge tiles, the
+// per-byte pixel_sub/pixel_add against plain byte arithmetic, and rejection
+// of truncated, padded and corrupted payloads.
+//
+//   g++ -std=c++17 -O2 tests/codec_test.cpp -o codec_test
+//
+// Add -fsanitize=address to also catch reads past a corrupted payload.
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+#include "../codec.h"
+
+static uint32_t rng = 99;
+
+static uint32_t next() {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+static int failures = 0;
+
+static void expect(bool ok, const char* what, int w, int h) {
+    if (ok) return;
+    if (failures++ < 10) printf("  FAIL %s (%dx%d)\n", what, w, h);
+}
+
+// Tile contents the codecs see: noise, flat colour, clear and repeated
+// rows, gradients, soft edges
+static void random_tile(uint32_t* px, int w, int h) {
+    int kind = next() % 6;
+    uint32_t c = next();
+    for (int y = 0; y < h; y++) {
+        int row_kind = kind == 5 ? next() % 5 : kind;
+        for (int x = 0; x < w; x++) {
+            uint32_t v;
+            switch (row_kind) {
+                case 0: v = next(); break;
+                case 1: v = c; break;
+                case 2: v = (next() % 8) ? 0 : next(); break;
+                case 3: v = y > 0 && next() % 3 ? px[(y - 1) * w + x] : c + x; break;
+                default: v = (c & 0x00ffffff) | (uint32_t)((x * 4 + y * 3) & 255) << 24; break;
+            }
+            px[y * w + x] = v;
+        }
+    }
+}
+
+static void check_pixel_ops() {
+    for (int i = 0; i < 1000000; i++) {
+        uint32_t a = next(), b = next();
+        if (i < 65536) { // Every byte pair, in all four lanes
+            a = (i >> 8) * 0x01010101u;
+            b = (i & 255) * 0x01010101u;
+        }
+        uint32_t sub = 0, add = 0;
+        for (int k = 0; k < 32; k += 8) {
+            sub |= (uint32_t)(uint8_t)((a >> k) - (b >> k)) << k;
+            add |= (uint32_t)(uint8_t)((a >> k) + (b >> k)) << k;
+        }
+        expect(pixel_sub(a, b) == sub, "pixel_sub", 1, 1);
+        expect(pixel_add(a, b) == add, "pixel_add", 1, 1);
+    }
+}
+
+static bool decode(uint8_t codec, const std::vector<uint8_t>& in, size_t len, uint32_t* px, int w, int h) {
+    return codec == TILE_CODEC_ROWS ? rows_decode_pixels(in.data(), len, px, w, h)
+                                    : rle_decode_pixels(in.data(), len, px, w * h);
+}
+
+static void check_codec(uint8_t codec, int w, int h) {
+    const char* name = codec == TILE_CODEC_ROWS ? "rows" : "rle";
+    uint32_t px[TILE_PIXELS], back[TILE_PIXELS];
+    random_tile(px, w, h);
+    std::vector<uint8_t> enc;
+    encode_tile_pixels(px, w, h, codec, enc);
+    expect(enc.size() <= TILE_MAX_PAYLOAD, name, w, h);
+    expect(decode(codec, enc, enc.size(), back, w, h) && memcmp(px, back, w * h * 4) == 0, name, w, h);
+
+    // Any shorter or longer payload is rejected
+    size_t cut = next() % enc.size();
+    expect(!decode(codec, enc, cut, back, w, h), "truncated", w, h);
+    enc.push_back(0);
+    expect(!decode(codec, enc, enc.size(), back, w, h), "trailing byte", w, h);
+    enc.pop_back();
+
+    // Corruption either fails or decodes to something, without overrunning
+    for (int k = 0; k < 4; k++) enc[next() % enc.size()] ^= 1 << (next() % 8);
+    std::vector<uint32_t> guard(TILE_PIXELS + 16, 0xdeadbeef);
+    decode(codec, enc, enc.size(), guard.data(), w, h);
+    bool inside = true;
+    for (size_t i = w * h; i < guard.size(); i++) inside &= guard[i] == 0xdeadbeef;
+    expect(inside, "corrupt payload stayed in the tile", w, h);
+}
+
+// A whole image through encode_snapshot_tile / decode_snapshot_tile,
+// clipped tiles on the right and bottom edges
+static void check_snapshot(int img_w, int img_h) {
+    std::vector<uint8_t> img((size_t)img_w * img_h * 4), back(img.size(), 0x5a);
+    for (int ty = 0; ty * TILE_SIZE < img_h; ty++) {
+        for (int tx = 0; tx * TILE_SIZE < img_w; tx++) {
+            int w = std::min(TILE_SIZE, img_w - tx * TILE_SIZE), h = std::min(TILE_SIZE, img_h - ty * TILE_SIZE);
+            uint32_t px[TILE_PIXELS];
+            random_tile(px, w, h);
+            for (int y = 0; y < h; y++) {
+                memcpy(&img[((size_t)(ty * TILE_SIZE + y) * img_w + tx * TILE_SIZE) * 4], &px[y * w], w * 4);
+            }
+        }
+    }
+
+    std::vector<uint8_t> list;
+    for (int ty = 0; ty * TILE_SIZE < img_h; ty++) {
+        for (int tx = 0; tx * TILE_SIZE < img_w; tx++) {
+            int x0 = tx * TILE_SIZE, y0 = ty * TILE_SIZE;
+            encode_snapshot_tile(img.data(), img_w, tx, ty, x0, y0, std::min(TILE_SIZE, img_w - x0),
+                                 std::min(TILE_SIZE, img_h - y0), list);
+        }
+    }
+    size_t pos = 0;
+    bool ok = true;
+    while (pos < list.size() && ok) {
+        SnapshotTileHeader th;
+        memcpy(&th, &list[pos], sizeof(th));
+        pos += sizeof(th);
+        int x0 = th.tx * TILE_SIZE, y0 = th.ty * TILE_SIZE;
+        ok = pos + th.len <= list.size() &&
+             decode_snapshot_tile(th, &list[pos], back.data(), img_w, x0, y0,
+                                  std::min(TILE_SIZE, img_w - x0), std::min(TILE_SIZE, img_h - y0));
+        pos += th.len;
+    }
+    expect(ok && back == img, "snapshot tiles", img_w, img_h);
+}
+
+int main() {
+    check_pixel_ops();
+    printf("pixel_sub / pixel_add == per byte   %s\n", failures ? "FAIL" : "ok");
+
+    int before = failures;
+    for (int i = 0; i < 20000; i++) {
+        int w = next() % 8 ? TILE_SIZE : 1 + next() % TILE_SIZE;
+        int h = next() % 8 ? TILE_SIZE : 1 + next() % TILE_SIZE;
+        check_codec(TILE_CODEC_RLE, w, h);
+        check_codec(TILE_CODEC_ROWS, w, h);
+    }
+    printf("rle / rows round trips, rejects      %s\n", failures > before ? "FAIL" : "ok");
+
+    before = failures;
+    check_snapshot(1280, 720);
+    check_snapshot(150, 100);
+    check_snapshot(1, 1);
+    printf("snapshot tiles, edge tiles           %s\n", failures > before ? "FAIL" : "ok");
+
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,130 @@
+// Line ops: DabStamp::sweep against the dab per Bresenham step it replaced.
+//
+//   g++ -std=c++17 -O2 -DSERVER_SIDE tests/line_sweep_test.cpp -o line_sweep_test
+//
+// A swept line must cover exactly the pixels the per-step dabs cover, each
+// once, at the highest alpha any of them gives it. Opaque solid brushes
+// (and the hard eraser) must leave a layer as per-step painting did, and
+// textured lines, which are not swept, must match it exactly.
+
+#include <cstdio>
+#include "rgba_sink.h"
+
+static const int W = 160, H = 120;
+static uint32_t rng = 12345;
+
+static uint32_t next() {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+static int range(int lo, int hi) { return lo + (int)(next() % (uint32_t)(hi - lo + 1)); }
+
+struct Tally {
+    int runs = 0, failed = 0;
+    void check(bool ok, const char* what, const char* brush, const DabOp& op) {
+        runs++;
+        if (ok) return;
+        if (failed++ < 10) {
+            printf("  FAIL %s %s: (%d,%d)-(%d,%d) size %d pressure %d opacity %d alpha %d\n",
+                   brush, what, op.x, op.y, op.ex, op.ey, op.params.size, op.params.pressure,
+                   op.params.opacity, op.params.color.a);
+        }
+    }
+};
+
+static Tally swept, opaque, textured;
+
+static DabOp random_line() {
+    DabOp op;
+    op.x = range(-40, W + 40);
+    op.y = range(-40, H + 40);
+    op.ex = range(-40, W + 40);
+    op.ey = range(-40, H + 40);
+    op.line = true;
+    op.params.color = {(uint8_t)next(), (uint8_t)next(), (uint8_t)next(), (uint8_t)next()};
+    op.params.size = range(0, 60);
+    op.params.pressure = range(0, 255);
+    op.params.angle = range(0, 359);
+    op.params.opacity = range(0, 255);
+    return op;
+}
+
+// The old MSG_LINE path: a full dab at every step
+template<class B, class Sink>
+static void paint_steps(const B* brush, const DabOp& op, DabClip<Sink>& out) {
+    bresenham(op.x, op.y, op.ex, op.ey, [&](int x, int y) {
+        brush->dab(x, y, op.params, out);
+    });
+}
+
+template<class B, DabMode Mode>
+static bool same_layer(const B* brush, const DabOp& op) {
+    RgbaImage steps(W, H), line(W, H);
+    for (Pixel& p : steps.px) p = {(uint8_t)next(), (uint8_t)next(), (uint8_t)next(), (uint8_t)next()};
+    line.px = steps.px;
+    RgbaSink<Mode> sink(steps);
+    DabClip<RgbaSink<Mode>> out = {sink, W, H};
+    paint_steps(brush, op, out);
+    paint_rgba(brush, op, line);
+    return memcmp(steps.px.data(), line.px.data(), steps.px.size() * sizeof(Pixel)) == 0;
+}
+
+template<class B>
+static bool same_coverage(const B* brush, const DabOp& op) {
+    CoverageSink steps(W, H), line(W, H);
+    DabClip<CoverageSink> steps_out = {steps, W, H}, line_out = {line, W, H};
+    paint_steps(brush, op, steps_out);
+    paint_op(brush, op, line_out);
+    for (size_t i = 0; i < steps.hits.size(); i++) {
+        if ((steps.hits[i] > 0) != (line.hits[i] > 0) || line.hits[i] > 1) return false;
+        if (!line.hits[i]) continue;
+        if (memcmp(&steps.best[i], &line.best[i], sizeof(Pixel)) != 0) return false;
+    }
+    return true;
+}
+
+template<class B>
+static void check_brush(const char* name, int lines) {
+    static const B brush;
+    for (int n = 0; n < lines; n++) {
+        DabOp op = random_line();
+        if constexpr (B::STAMPED) {
+            swept.check(same_coverage(&brush, op), "coverage", name, op);
+            bool solid = B::KIND == BRUSH_KIND_ROUND || B::KIND == BRUSH_KIND_SQUARE;
+            if (B::KIND == BRUSH_KIND_HARD_ERASER) {
+                opaque.check(same_layer<B, DAB_ERASE>(&brush, op), "layer", name, op);
+            } else if (solid) {
+                op.params.color.a = 255;
+                op.params.opacity = 255;
+                opaque.check(same_layer<B, DAB_OVER>(&brush, op), "layer", name, op);
+            }
+        } else {
+            textured.check(same_layer<B, DAB_OVER>(&brush, op), "layer", name, op);
+        }
+    }
+}
+
+static bool report(const char* what, const Tally& t) {
+    printf("%-36s %d/%d\n", what, t.runs - t.failed, t.runs);
+    return t.failed == 0;
+}
+
+int main() {
+    const int lines = 500;
+    check_brush<RoundBrush>("round", lines);
+    check_brush<SquareBrush>("square", lines);
+    check_brush<HardEraserBrush>("hard eraser", lines);
+    check_brush<PressureBrush>("pressure", lines);
+    check_brush<Airbrush>("airbrush", lines);
+    check_brush<TexturedBrush>("textured", lines);
+    check_brush<SoftEraserBrush>("soft eraser", lines);
+
+    bool ok = report("sweep == per-pixel max over dabs", swept);
+    ok &= report("opaque solid == per-step layer", opaque);
+    ok &= report("textured == per-step layer", textured);
+    printf("%s\n", ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
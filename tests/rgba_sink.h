@@ -0,0 +1,89 @@
+#ifndef TESTS_RGBA_SINK_H
+#define TESTS_RGBA_SINK_H
+
+// Brush sinks over a plain row-major RGBA image, composited the way the
+// server's straight-alpha LayerSink composites a layer (without the tiles),
+// plus a sink that only records coverage. Shared by the tests and
+// benchmarks in this folder; build them with -DSERVER_SIDE.
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "../brushes.h"
+#include "../blend.h"
+
+struct RgbaImage {
+    int w, h;
+    std::vector<Pixel> px;
+    RgbaImage(int w_, int h_) : w(w_), h(h_), px((size_t)w_ * h_) {}
+    Pixel& at(int x, int y) { return px[(size_t)y * w + x]; }
+};
+
+template<DabMode Mode>
+struct RgbaSink {
+    RgbaImage& img;
+    explicit RgbaSink(RgbaImage& i) : img(i) {}
+
+    void span(int y, int x0, int x1, Pixel c) { write(y, x0, x1, c, nullptr); }
+    void cover(int y, int x0, int x1, Pixel c, const uint8_t* alpha) { write(y, x0, x1, c, alpha); }
+
+    void write(int y, int x0, int x1, Pixel c, const uint8_t* alpha) {
+        Pixel* px = &img.at(x0, y);
+        int n = x1 - x0 + 1;
+        if (Mode == DAB_OVER) {
+            blend_span((uint8_t*)px, n, (const uint8_t*)&c, alpha);
+            return;
+        }
+        for (int k = 0; k < n; k++) {
+            if (alpha && !alpha[k]) continue;
+            Pixel s = c;
+            if (alpha) s.a = alpha[k];
+            if (Mode == DAB_ERASE) px[k] = s;
+            else px[k].a = px[k].a > s.a ? px[k].a - s.a : 0;
+        }
+    }
+};
+
+// Paint op with brush into img, composited per dab_mode(brush)
+template<class B>
+inline void paint_rgba(const B* brush, const DabOp& op, RgbaImage& img) {
+    auto run = [&](auto sink) {
+        DabClip<decltype(sink)> out = {sink, img.w, img.h};
+        paint_op(brush, op, out);
+    };
+    switch (dab_mode(brush)) {
+        case DAB_OVER:     run(RgbaSink<DAB_OVER>(img)); break;
+        case DAB_ERASE:    run(RgbaSink<DAB_ERASE>(img)); break;
+        case DAB_SUBTRACT: run(RgbaSink<DAB_SUBTRACT>(img)); break;
+    }
+}
+
+// Records, per pixel, how many runs covered it and the strongest alpha
+// (the colour's for span(), the mask's for cover()) and colour they gave it
+struct CoverageSink {
+    int w, h;
+    std::vector<uint16_t> hits;
+    std::vector<Pixel> best;
+
+    CoverageSink(int w_, int h_) : w(w_), h(h_), hits((size_t)w_ * h_), best((size_t)w_ * h_) {}
+
+    void record(int x, int y, Pixel c) {
+        size_t i = (size_t)y * w + x;
+        if (!hits[i]++ || c.a > best[i].a) best[i] = c;
+    }
+
+    void span(int y, int x0, int x1, Pixel c) {
+        for (int x = x0; x <= x1; x++) record(x, y, c);
+    }
+
+    void cover(int y, int x0, int x1, Pixel c, const uint8_t* alpha) {
+        for (int x = x0; x <= x1; x++) {
+            if (!alpha[x - x0]) continue;
+            Pixel s = c;
+            s.a = alpha[x - x0];
+            record(x, y, s);
+        }
+    }
+};
+
+#endif
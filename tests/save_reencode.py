@@ -0,0 +1,62 @@
+#!/usr/bin/env python3
+# Saves share tile encodings with the live layer: after a save, editing one
+# tile and saving again must encode that tile only.
+#
+#   python3 tests/save_reencode.py [path/to/server]
+#
+# Runs the server in a scratch directory on the default ports.
+import os, re, shutil, socket, struct, subprocess, sys, tempfile, time
+
+SERVER = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else "./server")
+TCP_FMT = "<BBHBBB256s"       # TCPMessage
+UDP_FMT = "<BBBBhhhhBBBBBBBHB" # UDPMessage
+MSG_LOGIN, MSG_SAVE, MSG_DRAW = 1, 5, 6
+
+def tcpmsg(t, data=b""):
+    return struct.pack(TCP_FMT, t, 0, len(data), 0, 0, 0, data)
+
+def draw(x, y, size, rgb):
+    return struct.pack(UDP_FMT, MSG_DRAW, 0, 0, 1, x, y, 0, 0, *rgb, 255, size, 255, 0, 0, 255)
+
+def encoded_counts(log_path):
+    with open(log_path) as f:
+        return [int(n) for n in re.findall(r"\((\d+) tiles encoded", f.read())]
+
+def main():
+    work = tempfile.mkdtemp()
+    log_path = os.path.join(work, "log.txt")
+    with open(log_path, "w") as log:
+        server = subprocess.Popen(["stdbuf", "-oL", SERVER], cwd=work, stdout=log, stderr=subprocess.STDOUT)
+    try:
+        time.sleep(0.6)
+        tcp = socket.create_connection(("127.0.0.1", 6769))
+        tcp.sendall(tcpmsg(MSG_LOGIN, b"tester"))
+        udp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        srv = ("127.0.0.1", 6770)
+        time.sleep(0.2)
+
+        # Strokes over many tiles, then a first save encodes all of them
+        for i in range(200):
+            udp.sendto(draw(30 + i * 6, 100 + (i % 5) * 60, 12, (i % 256, 40, 90)), srv)
+            time.sleep(0.001)
+        time.sleep(0.3)
+        tcp.sendall(tcpmsg(MSG_SAVE))
+        time.sleep(0.8)
+
+        # One small dab inside a single tile
+        udp.sendto(draw(700, 420, 6, (1, 2, 3)), srv)
+        time.sleep(0.3)
+        tcp.sendall(tcpmsg(MSG_SAVE))
+        time.sleep(0.8)
+    finally:
+        server.kill()
+        server.wait()
+
+    counts = encoded_counts(log_path)[-2:] # The startup save comes first
+    shutil.rmtree(work)
+    ok = len(counts) == 2 and counts[0] > 1 and counts[1] == 1
+    print("tiles encoded per save:", counts, "OK" if ok else "FAIL")
+    return 0 if ok else 1
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -34,7 +34,8 @@ extern int layerCount;
 extern int layerDisplayIds[];
 extern int loggedin;
 extern bool isEyedropping;
-extern vector<Brush*> availableBrushes;
+extern vector<const Brush*> availableBrushes;
+extern vector<BrushSettings> brushSettings;
 extern SDL_Texture* canvasTexture;
 extern SDL_Texture* layerTextures[];
 extern uint8_t layerOpacity[];
@@ -63,6 +64,7 @@ extern void perform_redo();
 extern void record_add_layer_command();
 extern void record_delete_layer_command(int layer_id);
 extern void download_as_bmp();
+extern bool premultipliedLayers;
 extern vector<Command*> redoStack;
 
 // Dynamic UI Dimensions
@@ -324,7 +326,7 @@ public:
         int cx = x+w/2, cy = y+h/2;
         SDL_RenderDrawLine(renderer, cx-5, cy, cx+5, cy); SDL_RenderDrawLine(renderer, cx, cy-5, cx, cy+5);
     }
-    virtual void Click() override { if (currentBrushId >= 0 && currentBrushId < (int)availableBrushes.size()) availableBrushes[currentBrushId]->size++; }
+    virtual void Click() override { if (currentBrushId >= 0 && currentBrushId < (int)availableBrushes.size()) brushSettings[currentBrushId].size++; }
 };
 
 class SizeDownButton : public Button {
@@ -338,7 +340,7 @@ public:
     }
     virtual void Click() override { 
         if (currentBrushId >= 0 && currentBrushId < (int)availableBrushes.size()) 
-            if (availableBrushes[currentBrushId]->size > 1) availableBrushes[currentBrushId]->size--; 
+            if (brushSettings[currentBrushId].size > 1) brushSettings[currentBrushId].size--; 
     }
 };
 
@@ -572,9 +574,17 @@ inline void draw_ui(SDL_Renderer* renderer, bool uiVisible, std::function<void(S
     // Draw Canvas Layers
     if (canvasTexture) SDL_RenderCopy(renderer, canvasTexture, NULL, &destRect);
     
+    // Premultiplied layers blend as src + dst * (1 - src alpha), and the
+    // layer opacity has to scale their colour along with the alpha
+    static const SDL_BlendMode premultipliedBlend = SDL_ComposeCustomBlendMode(
+        SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA, SDL_BLENDOPERATION_ADD,
+        SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA, SDL_BLENDOPERATION_ADD);
     pthread_mutex_lock(&layerMutex);
     for (int i = 0; i < layerCount; i++) {
         if (layerTextures[i]) {
+            uint8_t colorMod = premultipliedLayers ? layerOpacity[i] : 255;
+            SDL_SetTextureBlendMode(layerTextures[i], premultipliedLayers ? premultipliedBlend : SDL_BLENDMODE_BLEND);
+            SDL_SetTextureColorMod(layerTextures[i], colorMod, colorMod, colorMod);
             SDL_SetTextureAlphaMod(layerTextures[i], layerOpacity[i]);
             SDL_RenderCopy(renderer, layerTextures[i], NULL, &destRect);
         }
@@ -612,7 +622,7 @@ inline void draw_ui(SDL_Renderer* renderer, bool uiVisible, std::function<void(S
     if (!isEyedropping) { 
         // Draw cursor everywhere (even if off-canvas)
         if (currentBrushId >= 0 && currentBrushId < (int)availableBrushes.size()) {
-            int size = availableBrushes[currentBrushId]->size;
+            int size = brushSettings[currentBrushId].size;
             SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
             SDL_RenderDrawLine(renderer, mx - 5, my, mx + 5, my);
             SDL_RenderDrawLine(renderer, mx, my - 5, mx, my + 5);
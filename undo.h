@@ -4,13 +4,16 @@
 #include <vector>
 #include <cstring>
 #include <cstdint>
+#include <algorithm>
 #include <SDL2/SDL.h>
 #include <cstdio>
+#include "codec.h"
 
 // Forward declarations of functions we need to call from client.cpp
 #define MAX_LAYERS 15
 extern uint8_t* layers[MAX_LAYERS]; 
 extern void send_tcp_layer_sync(int layer_id); 
+extern void send_tcp_layer_delta(int layer_id, const std::vector<int>& tiles); // Changed tiles only
 extern void send_tcp_add_layer(int layer_id); // Readding a deleted layer
 extern void send_tcp_delete_layer(int layer_id);
 extern void send_tcp_reorder_layer(int old_idx, int new_idx);
@@ -38,9 +41,13 @@ class PaintCommand : public Command {
     uint8_t* pixelsBefore;
     uint8_t* pixelsAfter;
     int width, height;
+    std::vector<int> changedTiles; // ty * tilesX + tx, found by captureAfter
+    int tilesX, tilesY;
 
 public:
     PaintCommand(int id, int w, int h) : layerId(id), width(w), height(h) {
+        tilesX = (w + TILE_SIZE - 1) / TILE_SIZE;
+        tilesY = (h + TILE_SIZE - 1) / TILE_SIZE;
         pixelsBefore = new uint8_t[w * h * 4];
         pixelsAfter = new uint8_t[w * h * 4];
     }
@@ -56,22 +63,54 @@ public:
     }
 
     void captureAfter() {
-        if (layerExists(layerId)) 
-            memcpy(pixelsAfter, layers[layerId], width * height * 4);
+        if (!layerExists(layerId)) return;
+        memcpy(pixelsAfter, layers[layerId], width * height * 4);
+
+        // Remember which tiles the stroke touched
+        changedTiles.clear();
+        for (int ty = 0; ty < tilesY; ty++) {
+            for (int tx = 0; tx < tilesX; tx++) {
+                int x0 = tx * TILE_SIZE, y0 = ty * TILE_SIZE;
+                int w = std::min(TILE_SIZE, width - x0), h = std::min(TILE_SIZE, height - y0);
+                for (int y = y0; y < y0 + h; y++) {
+                    size_t off = ((size_t)y * width + x0) * 4;
+                    if (memcmp(pixelsBefore + off, pixelsAfter + off, w * 4) != 0) {
+                        changedTiles.push_back(ty * tilesX + tx);
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    // Put back the touched tiles from src and send just those (MSG_LAYER_DELTA).
+    // Falls back to the full-layer copy + MSG_LAYER_SYNC when most tiles changed.
+    void restore(const uint8_t* src) {
+        if (changedTiles.empty()) return;
+        if (changedTiles.size() * 2 > (size_t)(tilesX * tilesY)) {
+            memcpy(layers[layerId], src, width * height * 4);
+            send_tcp_layer_sync(layerId);
+            return;
+        }
+        for (int idx : changedTiles) {
+            int x0 = (idx % tilesX) * TILE_SIZE, y0 = (idx / tilesX) * TILE_SIZE;
+            int w = std::min(TILE_SIZE, width - x0), h = std::min(TILE_SIZE, height - y0);
+            for (int y = y0; y < y0 + h; y++) {
+                size_t off = ((size_t)y * width + x0) * 4;
+                memcpy(layers[layerId] + off, src + off, w * 4);
+            }
+        }
+        send_tcp_layer_delta(layerId, changedTiles);
     }
 
     void undo() override {
         if (!layerExists(layerId)) return;
-        // Restore local memory
-        memcpy(layers[layerId], pixelsBefore, width * height * 4);
-        // Sync with server (reuse existing standard message)
-        send_tcp_layer_sync(layerId); 
+        restore(pixelsBefore);
     }
 
     void redo() override {
         if (!layerExists(layerId)) return;
-        memcpy(layers[layerId], pixelsAfter, width * height * 4);
-        send_tcp_layer_sync(layerId);
+        restore(pixelsAfter);
     }
 };
 